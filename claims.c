@@ -0,0 +1,149 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+
+/*******************************************************************************
+ * description: just enough JSON and base64 for IdP responses and id tokens,
+ *              shared by the PAM module and the embeddable engine (engine.c)
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "deviceflow.h"
+
+/* decode base64 or base64url (as used in JWTs), padding optional; returns a NUL terminated buffer */
+char *base64decodeLen (const void *b64_decode_this, int decode_this_many_bytes, int *decoded_length){
+    const unsigned char *in = b64_decode_this;
+    char *base64_decoded = calloc( (decode_this_many_bytes*3)/4+1, sizeof(char) ); //+1 = null.
+    unsigned int bits = 0;
+    int nbits = 0, decoded_byte_index = 0;
+
+    if (base64_decoded == NULL) return NULL;
+    for (int i = 0; i < decode_this_many_bytes; i++) {
+        int c = in[i], v;
+        if (c >= 'A' && c <= 'Z') v = c - 'A';
+        else if (c >= 'a' && c <= 'z') v = c - 'a' + 26;
+        else if (c >= '0' && c <= '9') v = c - '0' + 52;
+        else if (c == '+' || c == '-') v = 62;
+        else if (c == '/' || c == '_') v = 63;
+        else if (c == '=') break;
+        else continue;    /* skip whitespace */
+
+        bits = (bits << 6) | v;
+        nbits += 6;
+        if (nbits >= 8) {
+            nbits -= 8;
+            base64_decoded[decoded_byte_index++] = (bits >> nbits) & 0xff;
+        }
+    }
+    if (decoded_length) *decoded_length = decoded_byte_index;
+    return base64_decoded;        //Returns base-64 decoded data with trailing null terminator.
+}
+
+char *base64decode (const void *b64_decode_this, int decode_this_many_bytes){
+    return base64decodeLen(b64_decode_this, decode_this_many_bytes, NULL);
+}
+
+/* copy a string claim into out without modifying the JSON; returns out or NULL */
+char * getClaim(const char * json, const char * key, char * out, size_t outlen) {
+        size_t klen = strlen(key);
+        const char * p = json;
+
+        while ((p = strchr(p, '"')) != NULL) {
+                p++;
+                if (strncmp(p, key, klen) || p[klen] != '"') {
+                        /* skip over this string, honouring escapes */
+                        while (*p && *p != '"') p += (*p == '\\' && p[1]) ? 2 : 1;
+                        if (*p) p++;
+                        continue;
+                }
+                p += klen + 1;
+                while (*p == ' ' || *p == ':') p++;
+                if (*p != '"') return NULL;
+                p++;
+
+                size_t n = 0;
+                while (*p && *p != '"' && n + 1 < outlen) {
+                        if (*p == '\\' && p[1]) p++;
+                        out[n++] = *p++;
+                }
+                out[n] = '\0';
+                return out;
+        }
+        return NULL;
+}
+
+/* numeric claim such as "interval":5, or dflt when absent */
+long getNumberClaim(const char * json, const char * key, long dflt) {
+        char pattern[128];
+        snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+
+        const char * p = strstr(json, pattern);
+        if (p == NULL) return dflt;
+        p += strlen(pattern);
+        while (*p == ' ' || *p == ':' || *p == '"') p++;
+        if (*p < '0' || *p > '9') return dflt;
+        return strtol(p, NULL, 10);
+}
+
+/* boolean claim such as "email_verified":true; some IdPs send the string "true" */
+int getBoolClaim(const char * json, const char * key) {
+        char pattern[128];
+        snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+
+        const char * p = strstr(json, pattern);
+        if (p == NULL) return 0;
+        p += strlen(pattern);
+        while (*p == ' ' || *p == ':' || *p == '"') p++;
+        return !strncmp(p, "true", 4);
+}
+
+/* call fn for every string in the array claim key, e.g. "groups":["a","b"]; stops when fn returns non-zero */
+int forEachClaimValue(const char * json, const char * key, int (*fn)(const char *, void *), void * arg) {
+        char pattern[128];
+        snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+
+        const char * p = strstr(json, pattern);
+        if (p == NULL) return 0;
+        p += strlen(pattern);
+        while (*p == ' ' || *p == ':') p++;
+        if (*p != '[') return 0;
+        p++;
+
+        char value[1024];
+        while (*p && *p != ']') {
+                if (*p != '"') {
+                        p++;
+                        continue;
+                }
+                p++;
+                size_t n = 0;
+                while (*p && *p != '"') {
+                        if (*p == '\\' && p[1]) p++;
+                        if (n + 1 < sizeof(value)) value[n++] = *p;
+                        p++;
+                }
+                value[n] = '\0';
+                if (*p) p++;
+                int rc = fn(value, arg);
+                if (rc) return rc;
+        }
+        return 0;
+}
@@ -0,0 +1,100 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: batches PAM conversation messages
+ *
+ * Every conv call can cost an SSH round trip over keyboard-interactive, and
+ * sshd holds PAM_TEXT_INFO back until it has a prompt to send anyway. So info
+ * messages are queued and go out in one pam_message array together with the
+ * next prompt, or with whatever is left when authentication returns.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <security/pam_appl.h>
+
+#include "deviceflow.h"
+
+#define CONV_QUEUE_MAX 8
+
+static struct pam_message queue[CONV_QUEUE_MAX + 1];
+static int queued;
+
+static void dropQueue(void) {
+        for (int i = 0; i < queued; i++) free((char *)queue[i].msg);
+        queued = 0;
+}
+
+/* send the queue, plus one prompt if style is not 0; *answer gets the prompt's reply */
+static int exchange(pam_handle_t * pamh, int style, const char * prompt, char ** answer) {
+        const struct pam_message * pmsg[CONV_QUEUE_MAX + 1];
+        struct pam_response * resp = NULL;
+        const struct pam_conv * conv = NULL;
+        int n = queued;
+
+        if (style) {
+                queue[n].msg_style = style;
+                queue[n].msg = (char *)prompt;
+                n++;
+        }
+        if (n == 0) return PAM_SUCCESS;
+        for (int i = 0; i < n; i++) pmsg[i] = &queue[i];
+
+        int rc = pam_get_item(pamh, PAM_CONV, (const void **)&conv);
+        if (rc == PAM_SUCCESS && (conv == NULL || conv->conv == NULL)) rc = PAM_CONV_ERR;
+        if (rc == PAM_SUCCESS) rc = conv->conv(n, pmsg, &resp, conv->appdata_ptr);
+
+        if (resp) {
+                for (int i = 0; i < n; i++) {
+                        if (style && i == n - 1 && answer && rc == PAM_SUCCESS) {
+                                *answer = resp[i].resp;
+                        } else if (resp[i].resp) {
+                                memset(resp[i].resp, 0, strlen(resp[i].resp));
+                                free(resp[i].resp);
+                        }
+                }
+                free(resp);
+        }
+        dropQueue();
+        return rc;
+}
+
+/* queue an informational message for the next exchange */
+int convInfo(pam_handle_t * pamh, const char * text) {
+        if (queued == CONV_QUEUE_MAX && exchange(pamh, 0, NULL, NULL) != PAM_SUCCESS) return PAM_CONV_ERR;
+        char * copy = strdup(text);
+        if (copy == NULL) return PAM_BUF_ERR;
+        queue[queued].msg_style = PAM_TEXT_INFO;
+        queue[queued].msg = copy;
+        queued++;
+        return PAM_SUCCESS;
+}
+
+/* everything queued plus this prompt in one conv call; *answer must be freed */
+int convPrompt(pam_handle_t * pamh, int style, const char * prompt, char ** answer) {
+        *answer = NULL;
+        return exchange(pamh, style, prompt, answer);
+}
+
+/* deliver whatever is still queued, e.g. the welcome banner on the way out */
+int convFlush(pam_handle_t * pamh) {
+        return exchange(pamh, 0, NULL, NULL);
+}
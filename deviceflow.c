@@ -21,209 +21,1012 @@ under the License.
  * author:      Huan Liu
  * description: PAM module to use device flow
 *******************************************************************************/
+#define _GNU_SOURCE             /* POLLRDHUP */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 
-#include <curl/curl.h>
 #include <security/pam_appl.h>
 #include <security/pam_modules.h>
 #include <security/pam_ext.h>
 
-/* needed for base64 decoder */
-#include <openssl/pem.h>
+#include "deviceflow.h"
+#include "df.h"
+#include "dynload.h"
+#include "fleet.h"
+#include "trace.h"
 
 #define DEVICE_AUTHORIZE_URL  "https://dev-57525606.okta.com/oauth2/v1/device/authorize"
 #define TOKEN_URL "https://dev-57525606.okta.com/oauth2/v1/token"
 #define CLIENT_ID "0oa15wulqt5yqD9FP5d7"
 
-/* structure used for curl return */
-struct MemoryStruct {
-  char *memory;
-  size_t size;
+/* where discovery metadata and JWKS are cached between logins */
+#define CACHE_DIR "/var/cache/deviceflow"
+/* used when the IdP sends no Cache-Control max-age */
+#define DEFAULT_METADATA_TTL 3600
+/* how long one approval satisfies further logins of the same user+source across the fleet */
+#define DEFAULT_FLEET_TTL 300
+/* validity of SSH certificates minted after a login */
+#define DEFAULT_CERT_LIFETIME 3600
+
+struct Options options;
+
+void parseOptions(int argc, const char **argv) {
+        memset(&options, 0, sizeof(options));
+        options.clientId = CLIENT_ID;
+        options.cacheDir = CACHE_DIR;
+        options.fleetTtl = DEFAULT_FLEET_TTL;
+        options.certLifetime = DEFAULT_CERT_LIFETIME;
+        for (int i = 0; i < argc; i++) {
+                if (!strncmp(argv[i], "principals=", 11)) options.principals = argv[i] + 11;
+                else if (!strncmp(argv[i], "issuer=", 7)) options.issuer = argv[i] + 7;
+                else if (!strncmp(argv[i], "client_id=", 10)) options.clientId = argv[i] + 10;
+                else if (!strncmp(argv[i], "cache_dir=", 10)) options.cacheDir = argv[i] + 10;
+                else if (!strcmp(argv[i], "session_cache")) options.sessionCache = 1;
+                else if (!strncmp(argv[i], "fleet=", 6)) options.fleet = argv[i] + 6;
+                else if (!strncmp(argv[i], "fleet_secret=", 13)) options.fleetSecret = argv[i] + 13;
+                else if (!strncmp(argv[i], "fleet_ttl=", 10)) options.fleetTtl = atol(argv[i] + 10);
+                else if (!strncmp(argv[i], "cert_ca=", 8)) options.certCa = argv[i] + 8;
+                else if (!strncmp(argv[i], "cert_lifetime=", 14)) options.certLifetime = atol(argv[i] + 14);
+                else if (!strncmp(argv[i], "routes=", 7)) options.routes = argv[i] + 7;
+                else if (!strncmp(argv[i], "scope=", 6)) options.scope = argv[i] + 6;
+                else if (!strcmp(argv[i], "adaptive_poll") || !strcmp(argv[i], "adaptive_poll=learn")) options.adaptivePoll = 1;
+                else if (!strcmp(argv[i], "adaptive_poll=skip")) options.adaptivePoll = 2;
+                else if (!strncmp(argv[i], "hop_key=", 8)) options.hopKey = argv[i] + 8;
+                else if (!strncmp(argv[i], "hop_address=", 12)) options.hopAddress = argv[i] + 12;
+                else if (!strncmp(argv[i], "delegate_audience=", 18)) options.delegateAudience = argv[i] + 18;
+                else if (!strncmp(argv[i], "hop_trust=", 10)) options.hopTrust = argv[i] + 10;
+                else if (!strncmp(argv[i], "hop_audience=", 13)) options.hopAudience = argv[i] + 13;
+        }
+}
+
+struct PrincipalCheck {
+        struct dfIndex * idx;
+        const char * issuer;
+        const char * account;
+        const char * claim;
 };
 
-char *base64decode (const void *b64_decode_this, int decode_this_many_bytes){
-    BIO *b64_bio, *mem_bio;      //Declares two OpenSSL BIOs: a base64 filter and a memory BIO.
-    char *base64_decoded = calloc( (decode_this_many_bytes*3)/4+1, sizeof(char) ); //+1 = null.
-    b64_bio = BIO_new(BIO_f_base64());                      //Initialize our base64 filter BIO.
-    mem_bio = BIO_new(BIO_s_mem());                         //Initialize our memory source BIO.
-    BIO_write(mem_bio, b64_decode_this, decode_this_many_bytes); //Base64 data saved in source.
-    BIO_push(b64_bio, mem_bio);          //Link the BIOs by creating a filter-source BIO chain.
-    BIO_set_flags(b64_bio, BIO_FLAGS_BASE64_NO_NL);          //Don't require trailing newlines.
-    int decoded_byte_index = 0;   //Index where the next base64_decoded byte should be written.
-    while ( 0 < BIO_read(b64_bio, base64_decoded+decoded_byte_index, 1) ){ //Read byte-by-byte.
-        decoded_byte_index++; //Increment the index until read of BIO decoded data is complete.
-    } //Once we're done reading decoded data, BIO_read returns -1 even though there's no error.
-    BIO_free_all(b64_bio);  //Destroys all BIOs in chain, starting with b64 (i.e. the 1st one).
-    return base64_decoded;        //Returns base-64 decoded data with trailing null terminator.
+/*
+ * Rules written under "issuer <url>" only answer for tokens from that issuer.
+ * Unscoped rules (issuer "*") predate tenants and would let one tenant's
+ * users satisfy another's, so they only count without routes=.
+ */
+int principalAllowed(struct dfIndex * idx, const char * issuer, const char * account, const char * claim,
+                     const char * value) {
+        const char * issuers[] = { issuer, options.routes ? "" : "*" };
+        const char * accounts[] = { account, "*" };
+        char key[4096];
+        for (int i = 0; i < 2; i++) {
+                if (!issuers[i][0]) continue;
+                for (int j = 0; j < 2; j++) {
+                        size_t len = principalKey(key, sizeof(key), issuers[i], accounts[j], claim, value);
+                        if (len && dfIndexLookup(idx, key, len, NULL)) return 1;
+                }
+        }
+        return 0;
+}
+
+static int checkClaimValue(const char * value, void * arg) {
+        struct PrincipalCheck * pc = arg;
+        return principalAllowed(pc->idx, pc->issuer, pc->account, pc->claim, value);
+}
+
+/* is the approver described by the id token claims allowed to log in as account? */
+int authorizePrincipal(const char * claims, const char * account) {
+        struct dfIndex idx;
+        if (dfIndexOpen(&idx, options.principals) < 0) {
+                fprintf(stderr, "cannot open principal index %s\n", options.principals);
+                return 0;
+        }
+
+        static const char * const stringClaims[] = { "preferred_username", "email", "sub" };
+        char value[1024], issuer[1024];
+        int allowed = 0;
+        if (getClaim(claims, "iss", issuer, sizeof(issuer)) == NULL) issuer[0] = '\0';
+        for (size_t i = 0; !allowed && i < sizeof(stringClaims) / sizeof(stringClaims[0]); i++) {
+                /* anyone can type any address into an IdP profile; only a verified one names a person */
+                if (!strcmp(stringClaims[i], "email") && !getBoolClaim(claims, "email_verified")) continue;
+                if (getClaim(claims, stringClaims[i], value, sizeof(value)))
+                        allowed = principalAllowed(&idx, issuer, account, stringClaims[i], value);
+        }
+        if (!allowed) {
+                struct PrincipalCheck pc = { &idx, issuer, account, "groups" };
+                allowed = forEachClaimValue(claims, "groups", checkClaimValue, &pc);
+        }
+
+        dfIndexClose(&idx);
+        return allowed;
+}
+
+unsigned long long traceId;
+
+/*
+ * A pending flow must not outlive its SSH connection. sshd sends SIGALRM on
+ * LoginGraceTime and SIGTERM/SIGHUP when it tears a child down, so those just
+ * raise a flag; the wait loop also watches the client socket and our parent.
+ */
+static volatile sig_atomic_t abortSignal;
+static const int abortSignals[] = { SIGTERM, SIGHUP, SIGINT, SIGALRM };
+static struct sigaction savedActions[sizeof(abortSignals) / sizeof(abortSignals[0])];
+static pid_t parentPid;
+static int clientFd = -1;
+static int clientGone;
+
+static void abortHandler(int sig) {
+        abortSignal = sig;
+}
+
+/* an address as 16 bytes, IPv4 mapped into IPv6, so both families compare alike */
+static int addressBytes(const struct sockaddr_storage * ss, unsigned char out[16], int * port) {
+        if (ss->ss_family == AF_INET) {
+                const struct sockaddr_in * in = (const struct sockaddr_in *)ss;
+                memset(out, 0, 10);
+                out[10] = out[11] = 0xff;
+                memcpy(out + 12, &in->sin_addr, 4);
+                *port = ntohs(in->sin_port);
+                return 0;
+        }
+        if (ss->ss_family == AF_INET6) {
+                const struct sockaddr_in6 * in6 = (const struct sockaddr_in6 *)ss;
+                memcpy(out, &in6->sin6_addr, 16);
+                *port = ntohs(in6->sin6_port);
+                return 0;
+        }
+        return -1;
+}
+
+/*
+ * The TCP connection to the ssh client, if this process has it open. Only a
+ * socket whose peer is the client (SSH_CONNECTION, else PAM_RHOST) counts:
+ * anything else, such as a keep-alive connection to the IdP, closing must not
+ * abort the login. -1, and no socket watching, if nothing matches.
+ */
+static int findClientSocket(pam_handle_t * pamh) {
+        char host[INET6_ADDRSTRLEN] = "";
+        int wantPort = 0;
+        unsigned char want[16];
+        struct in_addr v4;
+
+        const char * conn = pam_getenv(pamh, "SSH_CONNECTION");
+        if (conn == NULL) conn = getenv("SSH_CONNECTION");
+        if (conn == NULL || sscanf(conn, "%45s %d", host, &wantPort) != 2) {
+                const char * rhost = NULL;
+                wantPort = 0;
+                if (pam_get_item(pamh, PAM_RHOST, (const void **)&rhost) != PAM_SUCCESS || rhost == NULL) return -1;
+                snprintf(host, sizeof(host), "%s", rhost);
+        }
+        if (inet_pton(AF_INET, host, &v4) == 1) {
+                memset(want, 0, 10);
+                want[10] = want[11] = 0xff;
+                memcpy(want + 12, &v4, 4);
+        } else if (inet_pton(AF_INET6, host, want) != 1) {
+                return -1;
+        }
+
+        for (int fd = 0; fd < 256; fd++) {
+                struct sockaddr_storage peer;
+                socklen_t len = sizeof(peer);
+                unsigned char addr[16];
+                int type, port;
+                socklen_t tlen = sizeof(type);
+                if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &tlen) < 0 || type != SOCK_STREAM) continue;
+                if (getpeername(fd, (struct sockaddr *)&peer, &len) < 0) continue;
+                if (addressBytes(&peer, addr, &port) < 0 || memcmp(addr, want, 16)) continue;
+                if (wantPort == 0 || port == wantPort) return fd;
+        }
+        return -1;
+}
+
+void installAbortHandlers(pam_handle_t * pamh) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = abortHandler;   /* no SA_RESTART, so blocking calls return EINTR */
+        sigemptyset(&sa.sa_mask);
+
+        abortSignal = 0;
+        clientGone = 0;
+        parentPid = getppid();
+        clientFd = findClientSocket(pamh);
+        for (size_t i = 0; i < sizeof(abortSignals) / sizeof(abortSignals[0]); i++)
+                sigaction(abortSignals[i], &sa, &savedActions[i]);
+}
+
+/* put sshd's handlers back and hand it any signal we swallowed */
+void restoreAbortHandlers(void) {
+        for (size_t i = 0; i < sizeof(abortSignals) / sizeof(abortSignals[0]); i++)
+                sigaction(abortSignals[i], &savedActions[i], NULL);
+        if (abortSignal) raise(abortSignal);
+}
+
+int loginAborted(void) {
+        return abortSignal != 0 || clientGone || (parentPid && getppid() != parentPid);
+}
+
+/* the client closed its end; remembered, so every later check sees it too */
+static int clientHungUp(short revents) {
+        if (revents & (POLLRDHUP | POLLHUP | POLLERR | POLLNVAL)) clientGone = 1;
+        return clientGone;
+}
+
+static long long monotonicNow(void * ctx) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
 }
 
-/* function to write curl output */
-static size_t
-WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp)
-{
-  size_t realsize = size * nmemb;
-  struct MemoryStruct *mem = (struct MemoryStruct *)userp;
+/* sleep until when, returns -1 as soon as the login is abandoned */
+static int sleepUntilAbandoned(void * ctx, long long when) {
+        for (;;) {
+                if (loginAborted()) return -1;
+                long long ms = when - monotonicNow(ctx);
+                if (ms <= 0) return 0;
 
-  char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-  if(!ptr) {
-    /* out of memory! */
-    printf("not enough memory (realloc returned NULL)\n");
-    return 0;
-  }
+                /* wake at least every 250ms to notice the parent going away */
+                struct pollfd pfd = { clientFd, POLLRDHUP, 0 };
+                int rc = poll(&pfd, clientFd >= 0 ? 1 : 0, ms < 250 ? (int)ms : 250);
+                if (rc > 0 && clientHungUp(pfd.revents)) return -1;
+        }
+}
+
+static struct dfClock realClock = { monotonicNow, sleepUntilAbandoned, NULL };
+struct dfClock * dfclock = &realClock;
 
-  mem->memory = ptr;
-  memcpy(&(mem->memory[mem->size]), contents, realsize);
-  mem->size += realsize;
-  mem->memory[mem->size] = 0;
+/*
+ * A login keeps its time on dfclock. dfstated shares epoch seconds between
+ * bastions, so expiry and lease times are converted on the way in and out,
+ * against one reading of both clocks taken when the login starts.
+ */
+static long long clockAnchor;
+static time_t wallAnchor;
 
-  return realsize;
+void anchorClock(void) {
+        clockAnchor = dfclock->now(dfclock->ctx);
+        wallAnchor = time(NULL);
 }
 
-/* parse JSON output looking for value for a key. Assume string key value, so it parses on \" boundary */
-char * getValueForKey(char * in, const char * key) {
-	char * token = strtok(in, "\"");
-        while ( token != NULL ) {
-        	if (!strcmp(token, key)) {
-                	token = strtok(NULL, "\""); /* skip : */
-                        token = strtok(NULL, "\"");
-			return token;
-		}
-		token = strtok(NULL, "\"");
-	}
-	return NULL;
+time_t toEpoch(long long when) {
+        return wallAnchor + (time_t)((when - clockAnchor) / 1000);
+}
+
+long long fromEpoch(time_t when) {
+        return clockAnchor + (long long)(when - wallAnchor) * 1000;
+}
+
+/*
+ * Drive the login's engine, watching the client connection alongside curl's
+ * sockets, until f has left DF_AUTHORIZING (or finished, with untilDone) and
+ * every fetch in x is done. -1 if the login went away first.
+ */
+#define MAX_ENGINE_FDS 16
+
+static int engineBusy(struct df_flow * f, int untilDone, struct df_fetch * const * x, int n) {
+        if (f && (df_state(f) == DF_AUTHORIZING || (untilDone && df_state(f) == DF_PENDING))) return 1;
+        for (int i = 0; i < n; i++)
+                if (x[i] && !df_fetch_done(x[i])) return 1;
+        return 0;
+}
+
+static int runEngine(struct df_engine * e, struct df_flow * f, int untilDone, struct df_fetch * const * x, int n) {
+        struct df_fd fds[MAX_ENGINE_FDS];
+        struct pollfd pfds[MAX_ENGINE_FDS + 1];
+
+        while (engineBusy(f, untilDone, x, n)) {
+                if (loginAborted()) return -1;
+                int nfds = df_fds(e, fds, MAX_ENGINE_FDS);
+                for (int i = 0; i < nfds; i++) {
+                        pfds[i].fd = fds[i].fd;
+                        pfds[i].events = ((fds[i].events & DF_READ) ? POLLIN : 0) | ((fds[i].events & DF_WRITE) ? POLLOUT : 0);
+                        pfds[i].revents = 0;
+                }
+                pfds[nfds].fd = clientFd;
+                pfds[nfds].events = POLLRDHUP;
+                pfds[nfds].revents = 0;
+
+                /* wake at least every 250ms to notice the parent going away */
+                long timeout = df_timeout(e);
+                if (timeout < 0 || timeout > 250) timeout = 250;
+                if (poll(pfds, nfds + (clientFd >= 0 ? 1 : 0), (int)timeout) < 0 && errno != EINTR) return -1;
+                if (clientFd >= 0 && clientHungUp(pfds[nfds].revents)) return -1;
+
+                for (int i = 0; i < nfds; i++) {
+                        if (pfds[i].revents == 0) continue;
+                        int ev = ((pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) ? DF_READ : 0) |
+                                 ((pfds[i].revents & POLLOUT) ? DF_WRITE : 0);
+                        df_step(e, pfds[i].fd, ev);
+                }
+                df_step(e, -1, 0);
+        }
+        return 0;
+}
+
+/* what the polling host owes the fleet and the probes */
+struct Owner {
+        struct FleetRecord * rec;
+        long long deadline;        /* dfclock */
+};
+
+static void ownerEvent(void * arg, struct df_flow * f, int event) {
+        struct Owner * owner = arg;
+
+        if (event == DF_EVENT_POLL_START) {
+                TRACE1(poll_start, df_polls(f) + 1);
+                return;
+        }
+        TRACE2(poll_done, df_http_status(f), df_error(f));
+        if (df_error(f)[0]) printf("error %s\n", df_error(f));
+
+        /* keep the lease past our next poll so followers do not start polling too */
+        if (owner->rec && df_state(f) == DF_PENDING) {
+                long long t = dfclock->now(dfclock->ctx);
+                owner->rec->lease = toEpoch(t + df_next_poll(f) + (df_interval(f) + 5) * 1000LL);
+                fleetPublish(owner->rec, FLEET_PENDING, toEpoch(owner->deadline), NULL);
+        }
 }
 
-CURL *curl;
-struct MemoryStruct chunk;
+/* IdP endpoints, either the compiled-in defaults or from discovery */
+struct Endpoints {
+        char authorize[512];
+        char token[512];
+        char jwks[512];
+};
+
+struct Endpoints endpoints;
+
+/* the engine of the login in progress; without one, metadata only comes from the cache */
+struct df_engine * loginEngine;
 
-void issuePost(char * url, char * data) {
-        /* send all data to this function  */
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-        /* we pass our 'chunk' struct to the callback function */
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *)&chunk);
+/* GET url on the login's engine and wait for it: the body of a 2xx (caller frees), or NULL */
+static char * fetchNow(const char * url, long * maxAge) {
+        struct df_fetch * x = loginEngine ? df_fetch_begin(loginEngine, url) : NULL;
+        char * body = NULL;
 
-        curl_easy_setopt(curl, CURLOPT_URL, url ) ;
-        curl_easy_setopt(curl, CURLOPT_POST, 1);  /* this is a POST */
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data);
-        int res = curl_easy_perform( curl ) ;
+        if (x == NULL) return NULL;
+        if (runEngine(loginEngine, NULL, 0, &x, 1) == 0 && df_fetch_status(x) >= 200 && df_fetch_status(x) < 300) {
+                body = strdup(df_fetch_body(x));
+                *maxAge = df_fetch_max_age(x);
+        }
+        df_fetch_end(x);
+        return body;
 }
 
+/*
+ * cache files are "<expiry epoch>\n<issuer>\n<body>", one per issuer and kind.
+ * The name is only a 32 bit hash, so the issuer inside decides whose it is.
+ */
+void cachePath(char * out, size_t len, const char * kind) {
+        snprintf(out, len, "%s/%08x.%s", options.cacheDir, dfHash(options.issuer, strlen(options.issuer)), kind);
+}
 
-void
-sendPAMMessage(pam_handle_t *pamh, char * prompt_message) {
-        int retval;
-	//char * resp;
-        
-//	retval = pam_prompt(pamh, PAM_TEXT_INFO, &resp, "%s", prompt_message);
-      
-	struct pam_message msg[1],*pmsg[1];
-        struct pam_response *resp;
-        struct pam_conv *conv ;
+/* returns the cached body (caller frees) and its expiry, or NULL; stale entries are still returned */
+char * readCache(const char * path, time_t * expires) {
+        struct stat st;
+        FILE * f = fopen(path, "r");
+        if (f == NULL) return NULL;
 
-        pmsg[0] = &msg[0] ;
-        msg[0].msg_style = PAM_TEXT_INFO ;
-        msg[0].msg = prompt_message;
+        /* whoever can write the cache can redirect the token endpoint */
+        if (fstat(fileno(f), &st) < 0 || st.st_uid != 0 || (st.st_mode & 022)) {
+                fclose(f);
+                return NULL;
+        }
+        char * body = calloc(1, st.st_size + 1);
+        long exp = 0;
+        if (body == NULL || fscanf(f, "%ld\n", &exp) != 1 || fgets(body, st.st_size + 1, f) == NULL ||
+            strcspn(body, "\n") != strlen(options.issuer) || strncmp(body, options.issuer, strlen(options.issuer))) {
+                /* another issuer with the same hash, or a cache from before issuers were recorded */
+                free(body);
+                fclose(f);
+                return NULL;
+        }
+        size_t n = fread(body, 1, st.st_size, f);
+        body[n] = '\0';
+        fclose(f);
+        *expires = exp;
+        return body;
+}
 
-        resp = NULL ;
+void writeCache(const char * path, const char * body, long maxAge) {
+        char tmp[1024];
 
-        retval = pam_get_item( pamh, PAM_CONV, (const void **) &conv ) ;
-        if( retval==PAM_SUCCESS ) {
-                retval = conv->conv( 1, (const struct pam_message **) pmsg, &resp, conv->appdata_ptr ) ;
+        if (maxAge < 0) maxAge = DEFAULT_METADATA_TTL;
+        if (maxAge == 0) return;
+        mkdir(options.cacheDir, 0755);
+
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+        int fd = mkstemp(tmp);
+        if (fd < 0) return;
+        fchmod(fd, 0644);
+        FILE * f = fdopen(fd, "w");
+        if (f == NULL) {
+                close(fd);
+                unlink(tmp);
+                return;
         }
-        if( resp ) {
-                free( resp );
+        fprintf(f, "%ld\n%s\n%s", (long)time(NULL) + maxAge, options.issuer, body);
+        if (fclose(f) != 0 || rename(tmp, path) < 0) unlink(tmp);
+}
+
+/* RFC 8414 3.3: the document must name the issuer we asked, or someone else's endpoints could be served */
+int parseDiscovery(const char * json, struct Endpoints * out) {
+        struct Endpoints ep;
+        char issuer[1024];
+        memset(&ep, 0, sizeof(ep));
+        if (getClaim(json, "issuer", issuer, sizeof(issuer)) == NULL || strcmp(issuer, options.issuer)) {
+                fprintf(stderr, "discovery document is not for %s\n", options.issuer);
+                return -1;
         }
+        if (getClaim(json, "device_authorization_endpoint", ep.authorize, sizeof(ep.authorize)) == NULL ||
+            getClaim(json, "token_endpoint", ep.token, sizeof(ep.token)) == NULL) {
+                return -1;
+        }
+        getClaim(json, "jwks_uri", ep.jwks, sizeof(ep.jwks));
+        *out = ep;
+        return 0;
+}
+
+static void discoveryUrl(char * out, size_t len) {
+        snprintf(out, len, "%s/.well-known/openid-configuration", options.issuer);
 }
 
+/* the issuer's JWKS, from cache unless refresh is set (a kid we have not seen means keys rotated) */
+char * loadJwks(int refresh) {
+        char path[1024];
+        time_t expires = 0;
 
+        if (options.issuer == NULL) return NULL;
+        cachePath(path, sizeof(path), "jwks");
+        char * jwks = readCache(path, &expires);
+        if (jwks && !refresh) return jwks;
+        if (endpoints.jwks[0] == 0) return jwks;
+
+        long maxAge = -1;
+        char * body = fetchNow(endpoints.jwks, &maxAge);
+        if (body) {
+                writeCache(path, body, maxAge);
+                free(jwks);
+                jwks = body;
+        }
+        return jwks;
+}
+
+/*
+ * Fill endpoints: the compiled-in defaults, or the issuer's discovery document.
+ * A cached document is used even when stale (revalidateBegin refreshes it);
+ * only a cold cache costs a round trip here. Every login needs this, followers
+ * included: they verify fleet approvals and may have to take over polling.
+ */
+int resolveEndpoints(void) {
+        if (options.issuer == NULL) {
+                snprintf(endpoints.authorize, sizeof(endpoints.authorize), "%s", DEVICE_AUTHORIZE_URL);
+                snprintf(endpoints.token, sizeof(endpoints.token), "%s", TOKEN_URL);
+                return 0;
+        }
+
+        char discPath[1024], discUrl[1024];
+        time_t discExp = 0;
+        cachePath(discPath, sizeof(discPath), "discovery");
+        char * disc = readCache(discPath, &discExp);
+        int rc = disc ? parseDiscovery(disc, &endpoints) : -1;
+        free(disc);
+        if (rc == 0) return 0;
+
+        /* nothing to go on, discovery has to come first */
+        long maxAge = -1;
+        discoveryUrl(discUrl, sizeof(discUrl));
+        char * body = fetchNow(discUrl, &maxAge);
+        if (body && parseDiscovery(body, &endpoints) == 0) {
+                writeCache(discPath, body, maxAge);
+                rc = 0;
+        } else {
+                fprintf(stderr, "no usable discovery metadata for %s\n", options.issuer);
+        }
+        free(body);
+        return rc;
+}
+
+/*
+ * Stale discovery metadata and JWKS are refetched alongside the authorize
+ * request, on the same engine; this login keeps the endpoints it started
+ * with and the next one picks up changes. In steady state both are fresh
+ * and only the authorize request goes out.
+ */
+struct Revalidation {
+        struct df_fetch * disc;
+        struct df_fetch * jwks;
+};
+
+static void revalidateBegin(struct Revalidation * r) {
+        char path[1024], url[1024];
+        time_t now = time(NULL), expires = 0;
+
+        memset(r, 0, sizeof(*r));
+        if (options.issuer == NULL) return;
+        cachePath(path, sizeof(path), "discovery");
+        free(readCache(path, &expires));
+        discoveryUrl(url, sizeof(url));
+        if (expires <= now) r->disc = df_fetch_begin(loginEngine, url);
+
+        expires = 0;
+        cachePath(path, sizeof(path), "jwks");
+        free(readCache(path, &expires));
+        if (expires <= now && endpoints.jwks[0]) r->jwks = df_fetch_begin(loginEngine, endpoints.jwks);
+}
+
+static void revalidateEnd(struct Revalidation * r) {
+        char path[1024];
+        struct Endpoints fresh;
+
+        if (r->disc && df_fetch_status(r->disc) == 200 && parseDiscovery(df_fetch_body(r->disc), &fresh) == 0) {
+                cachePath(path, sizeof(path), "discovery");
+                writeCache(path, df_fetch_body(r->disc), df_fetch_max_age(r->disc));
+        }
+        if (r->jwks && df_fetch_status(r->jwks) == 200) {
+                cachePath(path, sizeof(path), "jwks");
+                writeCache(path, df_fetch_body(r->jwks), df_fetch_max_age(r->jwks));
+        }
+        if (r->disc) df_fetch_end(r->disc);
+        if (r->jwks) df_fetch_end(r->jwks);
+        memset(r, 0, sizeof(*r));
+}
+
+
+/*
+ * Fleet coordination (fleet=host:port, a local dfstated). The first bastion to
+ * see a user+source+SSH key owns the device flow and polls the IdP; the others
+ * show the same code and just watch the replicated record, taking over if the
+ * owner's lease runs out. An approval then satisfies that login fleet-wide for
+ * fleet_ttl seconds.
+ */
+char fleetSecret[256];
+char fleetOwner[64];
+
+void fleetInit(void) {
+        char host[48] = "";
+        fleetSecret[0] = '\0';
+        if (options.fleetSecret) {
+                FILE * f = fopen(options.fleetSecret, "r");
+                if (f) {
+                        if (fgets(fleetSecret, sizeof(fleetSecret), f) == NULL) fleetSecret[0] = '\0';
+                        fclose(f);
+                }
+                fleetSecret[strcspn(fleetSecret, "\r\n")] = '\0';
+        }
+        gethostname(host, sizeof(host) - 1);
+        snprintf(fleetOwner, sizeof(fleetOwner), "%s:%d", host, (int)getpid());
+}
+
+/*
+ * This login's record, keyed on the key publickey auth proved (fleetKey).
+ * NULL without one: from behind a shared NAT address, user@rhost alone would
+ * hand one person's approval or device code to the next.
+ */
+struct FleetRecord * fleetRecord(pam_handle_t * pamh, const char * user) {
+        const char * rhost = NULL;
+        char sshKey[8192], fingerprint[64];
+        struct FleetRecord * rec;
+
+        pam_get_item(pamh, PAM_RHOST, (const void **)&rhost);
+        if (authenticatedKey(pamh, sshKey, sizeof(sshKey)) < 0 ||
+            sshKeyFingerprint(sshKey, fingerprint, sizeof(fingerprint)) < 0) {
+                fprintf(stderr, "no SSH key for %s (publickey first, ExposeAuthInfo yes), not using the fleet\n", user);
+                return NULL;
+        }
+        if ((rec = calloc(1, sizeof(*rec))) == NULL) return NULL;
+        if (fleetKey(rec->key, sizeof(rec->key), user, rhost, fingerprint) < 0) {
+                free(rec);
+                return NULL;
+        }
+        return rec;
+}
+
+/*
+ * An approved record carries the raw id token. Whoever can reach dfstated can
+ * write one, so it only counts if the IdP's signature, issuer, audience and
+ * expiry check out here. Returns the claims (caller frees) or NULL.
+ */
+char * fleetApproval(const struct FleetRecord * rec, time_t * expires) {
+        char * claims = verifyIdToken(rec->data, options.clientId);
+        if (claims == NULL) {
+                fprintf(stderr, "fleet approval for %s does not verify, ignoring it\n", rec->key);
+                return NULL;
+        }
+        *expires = rec->expires;
+        return claims;
+}
+
+/* a pending record carries "<device_code> <interval> <verification_uri_complete>" */
+int parseFleetFlow(const struct FleetRecord * rec, char * devicecode, long * interval, char * activateUrl) {
+        return sscanf(rec->data, "%1023s %ld %1023s", devicecode, interval, activateUrl) == 3 ? 0 : -1;
+}
+
+void fleetPublish(struct FleetRecord * rec, int state, long expires, const char * data) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        rec->version = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        rec->state = state;
+        rec->expires = expires;
+        snprintf(rec->owner, sizeof(rec->owner), "%s", fleetOwner);
+        if (data) snprintf(rec->data, sizeof(rec->data), "%s", data);
+        fleetPut(options.fleet, fleetSecret, rec);
+}
+
+/*
+ * Watch the record of a flow another bastion polls, once a second until
+ * deadline (dfclock). FOLLOW_APPROVED: *claims holds the verified approval,
+ * rec->data the id token. FOLLOW_OWNER: the owner's lease ran out and this
+ * host now polls the device code, interval and URL put in the arguments.
+ * FOLLOW_GONE: the flow failed or expired, or the login went away.
+ */
+int followFleetFlow(struct FleetRecord * rec, long long deadline, char * devicecode, long * interval,
+                    char * activateUrl, char ** claims, time_t * expires) {
+        *claims = NULL;
+        while (!loginAborted() && dfclock->now(dfclock->ctx) < deadline) {
+                /* the record is local and cheap to read, the IdP is not */
+                if (dfclock->sleepUntil(dfclock->ctx, dfclock->now(dfclock->ctx) + 1000) < 0) break;
+                long long t = dfclock->now(dfclock->ctx);
+                int got = fleetGet(options.fleet, fleetSecret, rec->key, rec);
+                if (got == 1 && rec->state == FLEET_APPROVED) {
+                        *claims = fleetApproval(rec, expires);
+                        return *claims ? FOLLOW_APPROVED : FOLLOW_GONE;
+                } else if (got == 0 || (got == 1 && rec->state == FLEET_FAILED)) {
+                        return FOLLOW_GONE;
+                } else if (got == 1 && fromEpoch(rec->lease) <= t) {
+                        /* owner vanished, carry on with its device code */
+                        snprintf(rec->owner, sizeof(rec->owner), "%s", fleetOwner);
+                        rec->data[0] = '\0';
+                        rec->lease = toEpoch(t + (2 * *interval + 5) * 1000);
+                        if (fleetClaim(options.fleet, fleetSecret, rec) == 1 &&
+                            fleetGet(options.fleet, fleetSecret, rec->key, rec) == 1 &&
+                            parseFleetFlow(rec, devicecode, interval, activateUrl) == 0) {
+                                return FOLLOW_OWNER;
+                        }
+                }
+        }
+        return FOLLOW_GONE;
+}
+
+/* authorization, welcome banner and session cache for approved id token claims */
+int completeLogin(pam_handle_t * pamh, const char * user, const char * claims, time_t expires) {
+        char prompt_message[2000], issuer[1024];
+        int allowed = options.principals == NULL || authorizePrincipal(claims, user);
+
+        /* claims that reached us some other way (a hop, the fleet) must still come from this login's tenant */
+        if (getClaim(claims, "iss", issuer, sizeof(issuer)) == NULL) issuer[0] = '\0';
+        if (options.issuer && strcmp(issuer, options.issuer)) {
+                fprintf(stderr, "id token from \"%s\", expected %s\n", issuer, options.issuer);
+                allowed = 0;
+        }
+
+        char name[256];
+        if (getClaim(claims, "name", name, sizeof(name)) == NULL) strcpy(name, "unknown");
+
+        if (allowed) {
+                sprintf(prompt_message, "\n\n*********************************\n  Welcome, %s\n*********************************\n\n\n", name);
+        } else {
+                sprintf(prompt_message, "\n\n%s is not authorized to log in as %s\n\n", name, user);
+        }
+        /* goes out with the last exchange, not in one of its own */
+        convInfo(pamh, prompt_message);
+
+        if (allowed && options.sessionCache) saveLoginIdentity(pamh, user, claims, expires);
+        return allowed ? PAM_SUCCESS : PAM_AUTH_ERR;
+}
 
 extern char * getQR(char * str);
 
-/* expected hook */
+/* expected hook; sshd calls it before pam_loginuid, so the session cache binds in open_session */
 PAM_EXTERN int pam_sm_setcred( pam_handle_t *pamh, int flags, int argc, const char **argv ) {
         return PAM_SUCCESS ;
 }
 
+/* succeeds while this session holds an unexpired identity that may act as PAM_USER */
+PAM_EXTERN int pam_sm_acct_mgmt( pam_handle_t *pamh, int flags, int argc, const char **argv ) {
+        const char * user = NULL;
+
+        parseOptions(argc, argv);
+        if (!options.sessionCache || pam_get_user(pamh, &user, NULL) != PAM_SUCCESS || user == NULL)
+                return PAM_IGNORE;
+        return cachedIdentityAllows(pamh, user) ? PAM_SUCCESS : PAM_IGNORE;
+}
+
+/* the audit session id is only assigned by pam_loginuid during session setup; bind checks it has been */
+PAM_EXTERN int pam_sm_open_session( pam_handle_t *pamh, int flags, int argc, const char **argv ) {
+        parseOptions(argc, argv);
+        if (options.sessionCache) bindSessionIdentity(pamh);
+        return PAM_SUCCESS;
+}
+
+PAM_EXTERN int pam_sm_close_session( pam_handle_t *pamh, int flags, int argc, const char **argv ) {
+        parseOptions(argc, argv);
+        if (options.sessionCache) dropSessionIdentity(pamh);
+        return PAM_SUCCESS;
+}
+
 /* expected hook, this is where custom stuff happens */
 PAM_EXTERN int pam_sm_authenticate( pam_handle_t *pamh, int flags,int argc, const char **argv ) {
         int res ;
-	char postData[1024];
+        const char * user = NULL;
 
-        fprintf(stderr, "starting\n");
+        /* correlates this login's probes, see trace.h */
+        if (getrandom(&traceId, sizeof(traceId), GRND_NONBLOCK) != sizeof(traceId))
+                traceId = ((unsigned long long)getpid() << 32) ^ (unsigned long long)time(NULL);
+        fprintf(stderr, "starting %016llx\n", traceId);
 
-        /* memory for curl return */
-        chunk.memory = malloc(1);  /* will be grown as needed by the realloc above */
-        chunk.size = 0;    /* no data at this point */
+        parseOptions(argc, argv);
+        if ((options.principals || options.sessionCache || options.fleet || options.routes || options.hopTrust ||
+             options.certCa) &&
+            (pam_get_user(pamh, &user, NULL) != PAM_SUCCESS || user == NULL)) {
+                TRACE2(verdict, PAM_USER_UNKNOWN, "");
+                return PAM_USER_UNKNOWN;
+        }
 
-        /* init Curl handle */
-        curl_global_init(CURL_GLOBAL_ALL);
-        curl = curl_easy_init();
+        /* sudo/su inside a session that already did a device flow */
+        if (options.sessionCache && cachedIdentityAllows(pamh, user)) {
+                TRACE2(verdict, PAM_SUCCESS, user);
+                return PAM_SUCCESS;
+        }
 
-        /* hold temp string */
-        char str1[4096], str2[1024], str3[1024];;
+        /* publickey already took one of our certificates, which only a device flow hands out */
+        if (certifiedLogin(pamh, user)) {
+                fprintf(stderr, "%s logged in with a deviceflow certificate\n", user);
+                TRACE2(verdict, PAM_SUCCESS, user);
+                return PAM_SUCCESS;
+        }
 
-        /* call authorize end point */
-	sprintf(postData, "client_id=%s&scope=openid profile offline_access", CLIENT_ID); 
-        issuePost(DEVICE_AUTHORIZE_URL, postData);
+        /* per-tenant issuer, client and scopes; discovery and JWKS caches follow the issuer */
+        static struct RouteTenant tenant;
+        if (options.routes) {
+                const char * rhost = NULL;
+                pam_get_item(pamh, PAM_RHOST, (const void **)&rhost);
+                int routed = routeLookup(options.routes, user, rhost, &tenant);
+                if (routed < 0) {
+                        fprintf(stderr, "cannot use routing table %s\n", options.routes);
+                        TRACE2(verdict, PAM_AUTHINFO_UNAVAIL, user);
+                        return PAM_AUTHINFO_UNAVAIL;
+                }
+                if (routed) {
+                        options.issuer = tenant.issuer;
+                        if (tenant.clientId[0]) options.clientId = tenant.clientId;
+                        if (tenant.scope[0]) options.scope = tenant.scope;
+                        TRACE1(routed, tenant.name);
+                }
+        }
 
-	strcpy(str1, chunk.memory);
-        char * usercode = getValueForKey(str1, "user_code");
-	strcpy(str2, chunk.memory);
-        char * devicecode = getValueForKey(str2, "device_code");
-	strcpy(str3, chunk.memory);
-	char * activateUrl = getValueForKey(str3, "verification_uri_complete");
-        printf("auth: %s %s\n", usercode, devicecode);
+        /* an earlier ProxyJump hop already ran the flow: one signature check instead */
+        long hopExpires = 0;
+        char * hopClaims = hopAccept(pamh, user, &hopExpires);
+        if (hopClaims) {
+                int rc = completeLogin(pamh, user, hopClaims, hopExpires);
+                if (rc == PAM_SUCCESS && options.hopKey) hopDelegate(pamh, user, hopClaims);
+                convFlush(pamh);
+                free(hopClaims);
+                TRACE2(verdict, rc, user);
+                return rc;
+        }
 
-	char prompt_message[2000];
-        char * qrc = getQR(activateUrl);
-  	sprintf(prompt_message, "\n\nPlease login at %s or scan the QRCode below:\n\n%s", activateUrl, qrc );
-        free(qrc);
-        sendPAMMessage(pamh, prompt_message);
+        /* only now is libcurl worth mapping */
+        if (loadCurl() < 0) {
+                TRACE2(verdict, PAM_AUTHINFO_UNAVAIL, user ? user : "");
+                return PAM_AUTHINFO_UNAVAIL;
+        }
 
-	/* work around SSH PAM bug that buffers PAM_TEXT_INFO */ 
-	char * resp;
-        res = pam_prompt(pamh, PAM_PROMPT_ECHO_ON, &resp, "Press Enter to continue:");
+        /* hold temp string */
+        char devicecode[1024] = "", activateUrl[1024] = "";
+        char prompt_message[2000];
+        long interval = 0;
+        long long deadline = 0;     /* dfclock, converted for the fleet */
+        time_t expires = 0;
+        char * claims = NULL;       /* id token claims once approved, here or (verified) elsewhere in the fleet */
+        int follower = 0;           /* another bastion polls the IdP for this flow */
+        struct FleetRecord * rec = NULL;
+        char * rawToken = NULL;     /* the id token itself */
+        struct ApprovalHist * hist = NULL;
+        struct df_flow * flow = NULL;
+        struct Revalidation reval = { NULL, NULL };
+        struct Owner owner = { NULL, 0 };
+        int retval = PAM_AUTH_ERR;
 
-        int waitingForActivate = 1;
-        sprintf(postData, "device_code=%s&grant_type=urn:ietf:params:oauth:grant-type:device_code&client_id=%s", devicecode, CLIENT_ID);
+        struct dfScheduler learned;
+        const struct dfScheduler * sched = &fixedScheduler;
+        if (options.adaptivePoll) {
+                char histPath[1024];
+                snprintf(histPath, sizeof(histPath), "%s/approval.hist", options.cacheDir);
+                mkdir(options.cacheDir, 0755);
+                if ((hist = approvalHistOpen(histPath)) != NULL) {
+                        /* skipping polls trades detection delay for load, so it is opt-in */
+                        if (options.adaptivePoll == 2) adaptiveScheduler(&learned, hist);
+                        else learningScheduler(&learned, hist);
+                        sched = &learned;
+                }
+        }
 
-        while (waitingForActivate) {
-                // sendPAMMessage(pamh, "Waiting for user activation");
+        /* every request of this login goes through one engine: metadata, authorize and polls */
+        anchorClock();
+        installAbortHandlers(pamh);
+        if ((loginEngine = df_engine_new()) == NULL) {
+                retval = PAM_AUTHINFO_UNAVAIL;
+                goto cleanup;
+        }
+        df_engine_set_clock(loginEngine, dfclock);
+
+        if (resolveEndpoints() < 0) {
+                retval = PAM_AUTHINFO_UNAVAIL;
+                goto cleanup;
+        }
 
-                chunk.size = 0;
-                issuePost(TOKEN_URL, postData);
+        if (options.fleet && (rec = fleetRecord(pamh, user)) != NULL) {
+                fleetInit();
+                if (fleetGet(options.fleet, fleetSecret, rec->key, rec) == 1) {
+                        if (rec->state == FLEET_APPROVED) {
+                                if ((claims = fleetApproval(rec, &expires)) != NULL) rawToken = strdup(rec->data);
+                        } else if (rec->state == FLEET_PENDING && parseFleetFlow(rec, devicecode, &interval, activateUrl) == 0) {
+                                follower = 1;
+                                deadline = fromEpoch(rec->expires);
+                        }
+                }
+        }
 
-		strcpy(str1, chunk.memory);
-                char * errormsg = getValueForKey(str1, "error");
-                if (errormsg == NULL) {
+        if (claims == NULL && !follower) {
+                struct df_options o = {
+                        .authorize_url = endpoints.authorize,
+                        .token_url = endpoints.token,
+                        .client_id = options.clientId,
+                        .scope = options.scope,
+                        .scheduler = sched,
+                        .on_event = ownerEvent,
+                        .arg = &owner,
+                };
+                TRACE1(authorize_start, endpoints.authorize);
+                if ((flow = df_begin(loginEngine, &o)) == NULL) {
+                        fprintf(stderr, "cannot start a device flow at \"%s\"\n", endpoints.authorize);
+                        retval = PAM_AUTHINFO_UNAVAIL;
+                        goto cleanup;
+                }
+                revalidateBegin(&reval);
+                struct df_fetch * fetches[] = { reval.disc, reval.jwks };
+                int rc = runEngine(loginEngine, flow, 0, fetches, 2);
+                revalidateEnd(&reval);
+                if (rc < 0) goto abandoned;
+                TRACE1(authorize_done, df_http_status(flow));
+                if (df_state(flow) != DF_PENDING) {
+                        fprintf(stderr, "device authorization failed: %s\n", df_error(flow));
+                        retval = PAM_AUTHINFO_UNAVAIL;
+                        goto cleanup;
+                }
 
-			/* Parse response to find id_token, then find payload, then find name claim */
-			char * idtoken = getValueForKey(chunk.memory, "id_token");
+                snprintf(devicecode, sizeof(devicecode), "%s", df_device_code(flow));
+                snprintf(activateUrl, sizeof(activateUrl), "%s", df_verification_uri(flow));
+                interval = df_interval(flow);
+                deadline = dfclock->now(dfclock->ctx) + df_expires_in(flow) * 1000LL;
+                printf("auth: %s %s\n", df_user_code(flow), devicecode);
 
-			char * header = strtok(idtoken, ".");
-			char * payload = strtok(NULL, ".");
+                if (rec) {
+                        /* lose the race and we follow whoever won it; our device code is simply never used */
+                        snprintf(rec->data, sizeof(rec->data), "%s %ld %s", devicecode, interval, activateUrl);
+                        snprintf(rec->owner, sizeof(rec->owner), "%s", fleetOwner);
+                        rec->state = FLEET_PENDING;
+                        rec->expires = toEpoch(deadline);
+                        rec->lease = toEpoch(dfclock->now(dfclock->ctx) + (2 * interval + 5) * 1000);
+                        if (fleetClaim(options.fleet, fleetSecret, rec) == 0) {
+                                if (rec->state == FLEET_APPROVED) {
+                                        /* one that does not verify is overwritten by ours once approved */
+                                        if ((claims = fleetApproval(rec, &expires)) != NULL) rawToken = strdup(rec->data);
+                                } else if (parseFleetFlow(rec, devicecode, &interval, activateUrl) == 0) {
+                                        follower = 1;
+                                        deadline = fromEpoch(rec->expires);
+                                }
+                                if (claims || follower) {
+                                        df_end(flow);
+                                        flow = NULL;
+                                }
+                        }
+                }
+        }
 
-			char * decoded = base64decode(payload, strlen(payload));
+        if (claims == NULL) {
+                char * qrc = getQR(activateUrl);
+                TRACE1(qr_rendered, qrc ? strlen(qrc) : 0);
+                sprintf(prompt_message, "\n\nPlease login at %s or scan the QRCode below:\n\n%s", activateUrl, qrc ? qrc : "");
+                free(qrc);
+                convInfo(pamh, prompt_message);
 
-			char * name = getValueForKey(decoded, "name");
+                /* sshd buffers PAM_TEXT_INFO, so the QR code and this prompt go out as one exchange */
+                char * resp = NULL;
+                res = convPrompt(pamh, PAM_PROMPT_ECHO_ON, "Press Enter to continue:", &resp);
+                TRACE1(prompt_delivered, res);
+                free(resp);
+                if (res != PAM_SUCCESS) {
+                        retval = PAM_CONV_ERR;
+                        goto cleanup;
+                }
+        }
 
-			sprintf(prompt_message, "\n\n*********************************\n  Welcome, %s\n*********************************\n\n\n", name);
-			sendPAMMessage(pamh, prompt_message);
+        if (claims == NULL && follower) {
+                int followed = followFleetFlow(rec, deadline, devicecode, &interval, activateUrl, &claims, &expires);
+                if (followed == FOLLOW_APPROVED) rawToken = strdup(rec->data);
+                else if (followed == FOLLOW_OWNER) follower = 0;
+        }
 
-                        if (curl) curl_easy_cleanup( curl ) ;
-                        curl_global_cleanup();
+        /* our own flow, or the device code of an owner that vanished */
+        if (claims == NULL && !follower && !loginAborted() && dfclock->now(dfclock->ctx) < deadline) {
+                owner.rec = rec;
+                owner.deadline = deadline;
+                if (flow) {
+                        df_continue(flow);
+                } else {
+                        struct df_options o = {
+                                .token_url = endpoints.token,
+                                .client_id = options.clientId,
+                                .device_code = devicecode,
+                                .interval = interval,
+                                .expires_in = (deadline - dfclock->now(dfclock->ctx)) / 1000,
+                                .scheduler = sched,
+                                .on_event = ownerEvent,
+                                .arg = &owner,
+                        };
+                        flow = df_begin(loginEngine, &o);
+                }
+                if (flow == NULL) {
+                        fprintf(stderr, "cannot poll the token endpoint \"%s\"\n", endpoints.token);
+                        retval = PAM_AUTHINFO_UNAVAIL;
+                } else if (runEngine(loginEngine, flow, 1, NULL, 0) == 0) {
+                        if (df_state(flow) == DF_APPROVED) {
+                                rawToken = strdup(df_id_token(flow));
+                                claims = strdup(df_result(flow));
+                                expires = claims ? getNumberClaim(claims, "exp", 0) : 0;
+                                if (expires == 0) expires = toEpoch(dfclock->now(dfclock->ctx)) + DEFAULT_FLEET_TTL;
+                                TRACE1(token_decoded, expires);
+                                if (rec && rawToken) {
+                                        long until = toEpoch(dfclock->now(dfclock->ctx)) + options.fleetTtl;
+                                        fleetPublish(rec, FLEET_APPROVED, until < expires ? until : expires, rawToken);
+                                }
+                        } else if (rec) {
+                                /* access_denied, expired_token, ... are final for every bastion */
+                                fleetPublish(rec, FLEET_FAILED, toEpoch(dfclock->now(dfclock->ctx)) + 10, NULL);
+                        }
+                }
+        }
 
-                        return PAM_SUCCESS;
+        if (claims) {
+                retval = completeLogin(pamh, user, claims, expires);
+                if (retval == PAM_SUCCESS && options.certCa && rawToken) issueCertificate(pamh, user, rawToken);
+                if (retval == PAM_SUCCESS && options.hopKey && rawToken) {
+                        /* only vouch for what the IdP verifiably signed */
+                        char * verified = verifyIdToken(rawToken, options.clientId);
+                        if (verified) hopDelegate(pamh, user, verified);
+                        free(verified);
                 }
-                printf("error %s\n", errormsg);
-                sleep(5);
         }
-        /* Curl clean up */
-        if (curl) curl_easy_cleanup( curl ) ;
-        curl_global_cleanup();
+abandoned:
+        if (claims == NULL && loginAborted()) {
+                fprintf(stderr, "client went away, abandoning device flow\n");
+                retval = PAM_ABORT;
+        }
+
+cleanup:
+        convFlush(pamh);
+
+        if (flow) df_end(flow);
+        df_engine_free(loginEngine);
+        loginEngine = NULL;
+        free(claims);
+        free(rawToken);
+        free(rec);
+        approvalHistClose(hist);
 
-        return PAM_AUTH_ERR;
+        if (parentPid) restoreAbortHandlers();
+        parentPid = 0;
+        TRACE2(verdict, retval, user ? user : "");
+        return retval;
 }
@@ -0,0 +1,271 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: declarations shared between the PAM module and its helper tools
+*******************************************************************************/
+#ifndef DEVICEFLOW_H
+#define DEVICEFLOW_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* default location of the compiled claim-to-account index */
+#define PRINCIPALS_INDEX "/etc/deviceflow/principals.idx"
+/* per-session identity cache, see session.c; tests/run.sh points it elsewhere */
+#ifndef SESSION_DIR
+#define SESSION_DIR "/run/deviceflow"
+#endif
+
+/* module arguments, e.g. "auth required deviceflow.so principals=/etc/deviceflow/principals.idx" */
+struct Options {
+        const char * principals;
+        const char * issuer;       /* enables discovery, e.g. https://example.okta.com/oauth2/default */
+        const char * clientId;
+        const char * cacheDir;
+        int sessionCache;          /* reuse the login's identity for sudo/su in the same session */
+        const char * fleet;        /* host:port of the local dfstated */
+        const char * fleetSecret;  /* file holding dfstated's shared secret */
+        long fleetTtl;
+        const char * certCa;       /* CA private key for ssh-keygen -s */
+        long certLifetime;
+        const char * routes;       /* compiled IdP routing table, see route.c */
+        const char * scope;
+        int adaptivePoll;          /* 1: learn when users approve, 2: also skip polls until then */
+        const char * hopKey;       /* Ed25519 key signing assertions for the next ProxyJump hop */
+        const char * hopAddress;   /* where this host's outgoing connections come from */
+        const char * delegateAudience;
+        const char * hopTrust;     /* public keys of upstream hops whose assertions we accept */
+        const char * hopAudience;  /* the audience upstream hops use for us */
+};
+
+extern struct Options options;
+
+/*
+ * Read-only hash index, built once by dfcompile and mmapped by every sshd
+ * child. Keys are arbitrary byte strings, values are 32 bit.
+ *
+ * File layout: header, nbuckets x uint32 bucket array, entry pool, and an
+ * optional trailer the index itself does not interpret.
+ * A bucket holds 0 (empty) or 1 + the pool offset of an entry.
+ * An entry is: uint32 hash, uint32 value, uint32 keylen, key bytes,
+ * padded to a 4 byte boundary.
+ */
+#define DFINDEX_MAGIC "DFIDX01"
+
+struct dfIndexHeader {
+        char magic[8];
+        uint32_t nbuckets;   /* always a power of two */
+        uint32_t nentries;
+        uint32_t poolSize;
+        uint32_t trailerSize;
+};
+
+struct dfIndex {
+        void *base;
+        size_t size;
+        const struct dfIndexHeader *hdr;
+        const uint32_t *buckets;
+        const unsigned char *pool;
+};
+
+struct dfIndexBuilder {
+        char **keys;
+        size_t *keylens;
+        uint32_t *values;
+        size_t count;
+        size_t capacity;
+};
+
+uint32_t dfHash(const void *key, size_t len);
+
+int dfIndexOpen(struct dfIndex *idx, const char *path);
+int dfIndexLookup(const struct dfIndex *idx, const void *key, size_t keylen, uint32_t *value);
+void dfIndexClose(struct dfIndex *idx);
+
+void dfIndexBuilderInit(struct dfIndexBuilder *b);
+int dfIndexAdd(struct dfIndexBuilder *b, const void *key, size_t keylen, uint32_t value);
+int dfIndexWrite(struct dfIndexBuilder *b, const char *path);
+int dfIndexWriteTrailer(struct dfIndexBuilder *b, const char *path, const void *trailer, size_t trailerSize);
+const void *dfIndexTrailer(const struct dfIndex *idx, size_t *len);
+void dfIndexBuilderFree(struct dfIndexBuilder *b);
+
+/* principal keys are "issuer\0account\0claim\0value", issuer "*" for unscoped rules */
+size_t principalKey(char *out, size_t outlen, const char *issuer, const char *account, const char *claim,
+                    const char *value);
+
+/*
+ * IdP routing table, built by "dfcompile routes". A dfIndex maps
+ * "user\0<name>", "prefix\0<start of name>", "domain\0<suffix after @>" and
+ * "group\0<local group>" to a rule number; the trailer holds a RouteHeader,
+ * the tenant of each rule, the tenants, and a binary trie over PAM_RHOST
+ * addresses (IPv4 mapped into IPv6). The lowest matching rule number wins.
+ */
+#define ROUTES_MAGIC "DFRTE01"
+
+struct RouteHeader {
+        char magic[8];
+        uint32_t nrules;
+        uint32_t ntenants;
+        uint32_t nnodes;
+        uint32_t reserved;
+};
+
+struct RouteTenant {
+        char name[64];
+        char issuer[256];
+        char clientId[128];
+        char scope[128];
+};
+
+/* node 0 is the root; rule is 1 + the best rule whose network ends here, 0 if none */
+struct RouteNode {
+        uint32_t child[2];
+        uint32_t rule;
+};
+
+size_t routeKey(char *out, size_t outlen, const char *kind, const char *pattern, size_t patternLen);
+int routeLookup(const char *path, const char *user, const char *rhost, struct RouteTenant *out);
+
+/*
+ * Time source for everything that waits (poll.c, deviceflow.c). The module
+ * runs on the monotonic clock; dfsim swaps in simulated time. Milliseconds.
+ * sleepUntil returns -1 if the wait was cut short because the login is gone.
+ */
+struct dfClock {
+        long long (*now)(void * ctx);
+        int (*sleepUntil)(void * ctx, long long when);
+        void * ctx;
+};
+
+extern struct dfClock * dfclock;
+
+struct PollState;
+
+/*
+ * Decides when a pending flow polls next; pollResult enforces the IdP minimum.
+ * approved, if set, learns how long after the start an approval came, and
+ * gaveUp how long a flow that never got one waited (expired, denied or
+ * abandoned), so slow approvers are not forgotten.
+ */
+struct dfScheduler {
+        const char * name;
+        long long (*nextPoll)(void * ctx, const struct PollState * ps, long long now);
+        void (*approved)(void * ctx, const struct PollState * ps, long long after);
+        void (*gaveUp)(void * ctx, const struct PollState * ps, long long after);
+        void * ctx;
+};
+
+/* host-wide time-to-approval histogram, CACHE_DIR/approval.hist */
+#define APPROVAL_HIST_MAGIC "DFHST02"
+#define APPROVAL_HIST_BUCKET_MS 1000
+#define APPROVAL_HIST_BUCKETS 600    /* the last one also holds anything later */
+
+struct ApprovalHist {
+        char magic[8];
+        uint32_t bucketMs;
+        uint32_t total;
+        uint32_t counts[APPROVAL_HIST_BUCKETS];      /* approved after this long */
+        uint32_t censored[APPROVAL_HIST_BUCKETS];    /* still not approved when the flow ended */
+};
+
+struct PollState {
+        const struct dfScheduler * sched;
+        long long start;
+        long long deadline;
+        long long nextPoll;
+        long long lastPoll;
+        long long interval;        /* current poll interval, grows on slow_down */
+        long long minInterval;     /* never poll more often than this */
+        int polls;
+        int slowDowns;
+};
+
+enum { POLL_AGAIN, POLL_DONE, POLL_FAILED };
+
+/* poll.c */
+extern const struct dfScheduler fixedScheduler;
+struct ApprovalHist * approvalHistOpen(const char * path);
+void approvalHistClose(struct ApprovalHist * h);
+void approvalHistAdd(struct ApprovalHist * h, long long after, int approved);
+void learningScheduler(struct dfScheduler * sched, struct ApprovalHist * h);
+void adaptiveScheduler(struct dfScheduler * sched, struct ApprovalHist * h);
+void pollBegin(struct PollState * ps, const struct dfScheduler * sched, long long now, long intervalSec, long expiresInSec);
+int pollExpired(const struct PollState * ps, long long now);
+int pollResult(struct PollState * ps, long long now, const char * error);
+void pollGaveUp(const struct PollState * ps, long long now);
+
+/* claims.c */
+char * getClaim(const char * json, const char * key, char * out, size_t outlen);
+long getNumberClaim(const char * json, const char * key, long dflt);
+int getBoolClaim(const char * json, const char * key);
+int forEachClaimValue(const char * json, const char * key, int (*fn)(const char *, void *), void * arg);
+char * base64decode(const void * b64_decode_this, int decode_this_many_bytes);
+char * base64decodeLen(const void * b64_decode_this, int decode_this_many_bytes, int * decoded_length);
+
+/* deviceflow.c */
+int authorizePrincipal(const char * claims, const char * account);
+char * loadJwks(int refresh);
+void cachePath(char * out, size_t len, const char * kind);
+char * readCache(const char * path, time_t * expires);
+void writeCache(const char * path, const char * body, long maxAge);
+int resolveEndpoints(void);
+struct df_engine;
+extern struct df_engine * loginEngine;
+struct FleetRecord;
+struct pam_handle;
+extern char fleetSecret[];
+void fleetInit(void);
+struct FleetRecord * fleetRecord(struct pam_handle * pamh, const char * user);
+void fleetPublish(struct FleetRecord * rec, int state, long expires, const char * data);
+enum { FOLLOW_GONE, FOLLOW_APPROVED, FOLLOW_OWNER };
+int followFleetFlow(struct FleetRecord * rec, long long deadline, char * devicecode, long * interval,
+                    char * activateUrl, char ** claims, time_t * expires);
+/* dfclock ms <-> epoch seconds for what goes to dfstated, from one reading taken per login */
+void anchorClock(void);
+time_t toEpoch(long long when);
+long long fromEpoch(time_t when);
+
+/* jwt.c */
+char * verifyIdToken(const char * idtoken, const char * audience);
+
+/* session.c; pam_handle_t comes from security/pam_appl.h */
+struct pam_handle;
+int saveLoginIdentity(struct pam_handle * pamh, const char * account, const char * claims, long expires);
+int bindSessionIdentity(struct pam_handle * pamh);
+void dropSessionIdentity(struct pam_handle * pamh);
+int cachedIdentityAllows(struct pam_handle * pamh, const char * account);
+
+/* conv.c */
+int convInfo(struct pam_handle * pamh, const char * text);
+int convPrompt(struct pam_handle * pamh, int style, const char * prompt, char ** answer);
+int convFlush(struct pam_handle * pamh);
+
+/* hop.c */
+int hopDelegate(struct pam_handle * pamh, const char * user, const char * claims);
+char * hopAccept(struct pam_handle * pamh, const char * user, long * expires);
+
+/* sshcert.c */
+int authenticatedKey(struct pam_handle * pamh, char * out, size_t outlen);
+int sshKeyFingerprint(const char * key, char * out, size_t outlen);
+int issueCertificate(struct pam_handle * pamh, const char * user, const char * idtoken);
+int certifiedLogin(struct pam_handle * pamh, const char * user);
+
+#endif
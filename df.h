@@ -0,0 +1,122 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: non-blocking device flow engine for event loops
+ *
+ * One df_engine per event loop drives any number of device flows on one
+ * curl multi handle, never blocking and never sleeping:
+ *
+ *   struct df_engine * e = df_engine_new();
+ *   struct df_flow * f = df_begin(e, &opts);
+ *   loop:
+ *       n = df_fds(e, fds, max);        watch these for DF_READ / DF_WRITE
+ *       t = df_timeout(e);              and wake after at most t ms (-1: no timer)
+ *       df_step(e, fd, events);         for each ready fd, or (e, -1, 0) on timeout
+ *       df_state(f):                    DF_PENDING -> show df_user_code/df_verification_uri
+ *                                       DF_APPROVED -> df_result(f) has the claims
+ *   df_end(f); df_engine_free(e);
+ *
+ * The set of fds changes as connections come and go, so re-read it after
+ * every df_step. df_fetch_begin puts a GET (discovery, JWKS) on the same
+ * handle; it is done once df_fetch_done says so. deviceflow.so runs its
+ * logins, and the metadata they need, through the same engine.
+ *
+ * The first df_engine_new maps libcurl and runs curl_global_init for the
+ * process, which is never undone (dynload.c). curl_global_init is not thread
+ * safe: a threaded embedder creates its first engine, or calls
+ * curl_global_init itself, before starting other threads.
+*******************************************************************************/
+#ifndef DF_H
+#define DF_H
+
+struct df_engine;
+struct df_flow;
+struct df_fetch;
+struct dfScheduler;
+struct dfClock;
+
+enum df_state {
+        DF_AUTHORIZING,     /* waiting for the device authorization response */
+        DF_PENDING,         /* code issued, polling until the user acts */
+        DF_APPROVED,
+        DF_DENIED,
+        DF_EXPIRED,
+        DF_FAILED
+};
+
+#define DF_READ 1
+#define DF_WRITE 2
+
+struct df_fd {
+        int fd;
+        int events;
+};
+
+/* reported through df_options.on_event */
+enum df_event { DF_EVENT_POLL_START, DF_EVENT_POLL_DONE };
+
+struct df_options {
+        const char * authorize_url;
+        const char * token_url;
+        const char * client_id;
+        const char * scope;                 /* NULL: "openid profile offline_access" */
+        const char * device_code;           /* set to poll a flow authorized elsewhere */
+        long interval;                      /* seconds, with device_code; 0: 5 */
+        long expires_in;                    /* seconds, with device_code; 0: 600 */
+        const struct dfScheduler * scheduler;   /* NULL: poll every interval */
+        void (*on_event)(void * arg, struct df_flow * flow, int event);
+        void * arg;
+};
+
+struct df_engine * df_engine_new(void);
+void df_engine_free(struct df_engine * e);
+/* time source for all of e's timers (deviceflow.h); NULL or never set: CLOCK_MONOTONIC */
+void df_engine_set_clock(struct df_engine * e, const struct dfClock * clock);
+int df_fds(struct df_engine * e, struct df_fd * out, int max);
+long df_timeout(struct df_engine * e);
+int df_step(struct df_engine * e, int fd, int events);
+
+/* NULL if a URL or the client id is missing or empty */
+struct df_flow * df_begin(struct df_engine * e, const struct df_options * opts);
+void df_continue(struct df_flow * f);      /* the user says they are done, poll as soon as allowed */
+void df_end(struct df_flow * f);
+
+int df_state(const struct df_flow * f);
+const char * df_user_code(const struct df_flow * f);
+const char * df_device_code(const struct df_flow * f);
+const char * df_verification_uri(const struct df_flow * f);  /* verification_uri_complete if given */
+const char * df_error(const struct df_flow * f);        /* last OAuth error, "" if none */
+long df_http_status(const struct df_flow * f);
+int df_polls(const struct df_flow * f);
+long df_interval(const struct df_flow * f);            /* seconds, grows on slow_down */
+long df_next_poll(const struct df_flow * f);           /* ms from now */
+long df_expires_in(const struct df_flow * f);          /* seconds the device code has left, 0 unless DF_PENDING */
+const char * df_result(const struct df_flow * f);      /* id token claims once DF_APPROVED */
+const char * df_id_token(const struct df_flow * f);
+
+/* NULL if the URL is missing or empty */
+struct df_fetch * df_fetch_begin(struct df_engine * e, const char * url);
+void df_fetch_end(struct df_fetch * x);
+int df_fetch_done(const struct df_fetch * x);
+long df_fetch_status(const struct df_fetch * x);       /* HTTP status once done, 0 if nothing came back */
+const char * df_fetch_body(const struct df_fetch * x); /* never NULL */
+long df_fetch_max_age(const struct df_fetch * x);      /* Cache-Control seconds, 0 for no-store/no-cache, -1 if none */
+
+#endif
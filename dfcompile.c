@@ -0,0 +1,395 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: install-time compiler for the policy files read by deviceflow.so
+ *
+ *   dfcompile principals /etc/deviceflow/principals /etc/deviceflow/principals.idx
+ *
+ * The principals policy has one rule per line:
+ *
+ *   # account   claim                value
+ *   alice       preferred_username   alice@example.com
+ *   deploy      groups               Release Managers
+ *   *           groups               SRE
+ *
+ * meaning a device flow approved by someone whose id token carries that claim
+ * value may log in as account ("*" = any account). A line
+ *
+ *   issuer      https://retail.okta.com/oauth2/default
+ *
+ * makes the rules after it apply to tokens from that issuer only, up to the
+ * next issuer line ("issuer *" goes back to any issuer). A line with a third
+ * field is an ordinary rule for a local account named issuer. With routes=
+ * the module ignores unscoped rules, so each tenant needs its own section.
+ * The claim is one of
+ * preferred_username, email (only counted when email_verified), sub or
+ * groups. The value runs to the end of the line so group names may contain
+ * spaces; a '#' only starts a comment at the start of a line or after
+ * whitespace, so "dev#ops" is a value but "SRE  # on call" is "SRE".
+ *
+ *   dfcompile routes /etc/deviceflow/routes /etc/deviceflow/routes.idx
+ *
+ * The routes policy names tenants and then says which logins go to which:
+ *
+ *   # tenant  name     issuer                                   client id   scopes
+ *   tenant    retail   https://retail.okta.com/oauth2/default   0oa1retail  openid profile offline_access
+ *   tenant    bank     https://login.bank.example/oauth2/aus1   0oa2bank
+ *
+ *   # kind    pattern               tenant
+ *   user      alice                 bank
+ *   user      svc-*                 retail
+ *   domain    bank.example.com      bank      (alice@bank.example.com and subdomains)
+ *   group     finance               bank      (local group of the target account)
+ *   network   10.20.0.0/16          bank      (PAM_RHOST)
+ *   user      *                     retail    (everyone else)
+ *
+ * The first rule that matches a login wins. A tenant must be defined before
+ * a rule uses it; its scopes default to the module's.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <arpa/inet.h>
+
+#include "deviceflow.h"
+
+static void usage(void) {
+        fprintf(stderr, "usage: dfcompile principals <policy file> <index file>\n"
+                        "       dfcompile routes <routes file> <index file>\n");
+        exit(2);
+}
+
+static char *nextField(char **p) {
+        while (isspace((unsigned char)**p)) (*p)++;
+        if (**p == '\0') return NULL;
+        char *start = *p;
+        while (**p && !isspace((unsigned char)**p)) (*p)++;
+        if (**p) *(*p)++ = '\0';
+        return start;
+}
+
+/* nothing but whitespace left; unlike nextField this does not consume anything */
+static int atEnd(const char *p) {
+        while (isspace((unsigned char)*p)) p++;
+        return *p == '\0';
+}
+
+/* cut a comment: '#' at the start of the line or after whitespace */
+static void stripComment(char *line) {
+        for (char *p = line; *p; p++) {
+                if (*p == '#' && (p == line || isspace((unsigned char)p[-1]))) {
+                        *p = '\0';
+                        return;
+                }
+        }
+}
+
+/* the claims authorizePrincipal looks at; a rule on any other would never match */
+static int knownClaim(const char *claim) {
+        static const char *const claims[] = { "preferred_username", "email", "sub", "groups" };
+        for (size_t i = 0; i < sizeof(claims) / sizeof(claims[0]); i++)
+                if (!strcmp(claim, claims[i])) return 1;
+        return 0;
+}
+
+static int compilePrincipals(const char *in, const char *out) {
+        FILE *f = fopen(in, "r");
+        if (!f) {
+                perror(in);
+                return 1;
+        }
+
+        struct dfIndexBuilder b;
+        dfIndexBuilderInit(&b);
+
+        char line[4096], key[8192], issuer[1024] = "*";
+        int lineno = 0, errors = 0;
+        while (fgets(line, sizeof(line), f)) {
+                lineno++;
+                char *p = line;
+                stripComment(p);
+
+                char *account = nextField(&p);
+                if (!account) continue;
+                char *claim = nextField(&p);
+
+                /*
+                 * "issuer <url>" scopes the rules that follow, "issuer *" lifts the scope.
+                 * Two fields only: "issuer groups SRE" is a rule for an account named issuer.
+                 */
+                if (!strcmp(account, "issuer") && claim && atEnd(p)) {
+                        if (strlen(claim) >= sizeof(issuer) || (strcmp(claim, "*") && strncmp(claim, "https://", 8))) {
+                                fprintf(stderr, "%s:%d: issuer must be an https URL or *\n", in, lineno);
+                                errors++;
+                        } else {
+                                strcpy(issuer, claim);
+                        }
+                        continue;
+                }
+
+                /* value is the rest of the line, trimmed */
+                while (isspace((unsigned char)*p)) p++;
+                char *value = p;
+                char *end = value + strlen(value);
+                while (end > value && isspace((unsigned char)end[-1])) *--end = '\0';
+
+                if (!claim || *value == '\0') {
+                        fprintf(stderr, "%s:%d: expected <account> <claim> <value>\n", in, lineno);
+                        errors++;
+                        continue;
+                }
+                if (!knownClaim(claim)) {
+                        fprintf(stderr, "%s:%d: unknown claim %s (preferred_username, email, sub or groups)\n",
+                                in, lineno, claim);
+                        errors++;
+                        continue;
+                }
+                size_t len = principalKey(key, sizeof(key), issuer, account, claim, value);
+                if (len == 0 || dfIndexAdd(&b, key, len, 1) < 0) {
+                        fprintf(stderr, "%s:%d: rule too long or out of memory\n", in, lineno);
+                        errors++;
+                }
+        }
+        fclose(f);
+
+        if (errors == 0 && dfIndexWrite(&b, out) < 0) {
+                perror(out);
+                errors++;
+        }
+        if (errors == 0) printf("%s: %zu rules\n", out, b.count);
+        dfIndexBuilderFree(&b);
+        return errors ? 1 : 0;
+}
+
+struct RouteBuilder {
+        struct RouteTenant *tenants;
+        uint32_t ntenants;
+        uint32_t *ruleTenant;
+        uint32_t nrules;
+        struct RouteNode *nodes;
+        uint32_t nnodes;
+};
+
+static void *grow(void *p, uint32_t count, size_t size) {
+        /* room for one more: capacity doubles whenever count reaches a power of two */
+        if (count & (count - 1)) return p;
+        void *q = realloc(p, (count ? (size_t)count * 2 : 1) * size);
+        if (!q) {
+                perror("dfcompile");
+                exit(1);
+        }
+        return q;
+}
+
+static int findTenant(const struct RouteBuilder *rb, const char *name) {
+        for (uint32_t i = 0; i < rb->ntenants; i++)
+                if (!strcmp(rb->tenants[i].name, name)) return i;
+        return -1;
+}
+
+/* "10.0.0.0/8" or "2001:db8::/32" as an IPv6 (IPv4 mapped) address and prefix length */
+static int parseNetwork(const char *text, unsigned char addr[16], int *bits) {
+        char host[64];
+        const char *slash = strchr(text, '/');
+        size_t len = slash ? (size_t)(slash - text) : strlen(text);
+        struct in_addr v4;
+
+        if (len >= sizeof(host)) return -1;
+        memcpy(host, text, len);
+        host[len] = '\0';
+
+        int max;
+        if (inet_pton(AF_INET, host, &v4) == 1) {
+                memset(addr, 0, 10);
+                addr[10] = addr[11] = 0xff;
+                memcpy(addr + 12, &v4, 4);
+                max = 32;
+        } else if (inet_pton(AF_INET6, host, addr) == 1) {
+                max = 128;
+        } else {
+                return -1;
+        }
+
+        char *end;
+        long n = slash ? strtol(slash + 1, &end, 10) : max;
+        if (slash && (end == slash + 1 || *end || n < 0 || n > max)) return -1;
+        *bits = (int)n + 128 - max;
+        return 0;
+}
+
+static void addNetwork(struct RouteBuilder *rb, const unsigned char addr[16], int bits, uint32_t rule) {
+        uint32_t node = 0;
+        for (int bit = 0; bit < bits; bit++) {
+                int side = (addr[bit / 8] >> (7 - bit % 8)) & 1;
+                if (rb->nodes[node].child[side] == 0) {
+                        rb->nodes = grow(rb->nodes, rb->nnodes, sizeof(*rb->nodes));
+                        memset(&rb->nodes[rb->nnodes], 0, sizeof(*rb->nodes));
+                        rb->nodes[node].child[side] = rb->nnodes++;
+                }
+                node = rb->nodes[node].child[side];
+        }
+        if (rb->nodes[node].rule == 0) rb->nodes[node].rule = rule + 1;
+}
+
+static int compileRoutes(const char *in, const char *out) {
+        FILE *f = fopen(in, "r");
+        if (!f) {
+                perror(in);
+                return 1;
+        }
+
+        struct dfIndexBuilder b;
+        struct RouteBuilder rb;
+        dfIndexBuilderInit(&b);
+        memset(&rb, 0, sizeof(rb));
+        rb.nodes = calloc(1, sizeof(*rb.nodes));
+        rb.nnodes = 1;
+
+        char line[4096], key[8192];
+        int lineno = 0, errors = 0;
+        while (fgets(line, sizeof(line), f)) {
+                lineno++;
+                char *p = line;
+                stripComment(p);
+
+                char *kind = nextField(&p);
+                if (!kind) continue;
+                char *name = nextField(&p);
+
+                if (!strcmp(kind, "tenant")) {
+                        char *issuer = nextField(&p);
+                        char *clientId = nextField(&p);
+                        while (isspace((unsigned char)*p)) p++;
+                        char *scope = p;
+                        char *end = scope + strlen(scope);
+                        while (end > scope && isspace((unsigned char)end[-1])) *--end = '\0';
+
+                        struct RouteTenant t;
+                        memset(&t, 0, sizeof(t));
+                        if (!name || !issuer || strlen(name) >= sizeof(t.name) || strlen(issuer) >= sizeof(t.issuer) ||
+                            (clientId && strlen(clientId) >= sizeof(t.clientId)) || strlen(scope) >= sizeof(t.scope)) {
+                                fprintf(stderr, "%s:%d: expected tenant <name> <issuer> [<client id> [<scopes>]]\n", in, lineno);
+                                errors++;
+                                continue;
+                        }
+                        if (findTenant(&rb, name) >= 0) {
+                                fprintf(stderr, "%s:%d: tenant %s defined twice\n", in, lineno, name);
+                                errors++;
+                                continue;
+                        }
+                        strcpy(t.name, name);
+                        strcpy(t.issuer, issuer);
+                        if (clientId) strcpy(t.clientId, clientId);
+                        strcpy(t.scope, scope);
+                        rb.tenants = grow(rb.tenants, rb.ntenants, sizeof(*rb.tenants));
+                        rb.tenants[rb.ntenants++] = t;
+                        continue;
+                }
+
+                char *tenantName = nextField(&p);
+                int tenant = tenantName ? findTenant(&rb, tenantName) : -1;
+                if (!name || !tenantName || nextField(&p)) {
+                        fprintf(stderr, "%s:%d: expected <kind> <pattern> <tenant>\n", in, lineno);
+                        errors++;
+                        continue;
+                }
+                if (tenant < 0) {
+                        fprintf(stderr, "%s:%d: unknown tenant %s\n", in, lineno, tenantName);
+                        errors++;
+                        continue;
+                }
+
+                uint32_t rule = rb.nrules;
+                size_t len = 0, n = strlen(name);
+                if (!strcmp(kind, "user") && n > 0 && name[n - 1] == '*') {
+                        len = routeKey(key, sizeof(key), "prefix", name, n - 1);
+                } else if (!strcmp(kind, "user") || !strcmp(kind, "group")) {
+                        len = routeKey(key, sizeof(key), kind, name, n);
+                } else if (!strcmp(kind, "domain")) {
+                        if (*name == '@') name++;
+                        len = routeKey(key, sizeof(key), kind, name, strlen(name));
+                } else if (!strcmp(kind, "network")) {
+                        unsigned char addr[16];
+                        int bits;
+                        if (parseNetwork(name, addr, &bits) < 0) {
+                                fprintf(stderr, "%s:%d: bad network %s\n", in, lineno, name);
+                                errors++;
+                                continue;
+                        }
+                        addNetwork(&rb, addr, bits, rule);
+                } else {
+                        fprintf(stderr, "%s:%d: unknown rule kind %s\n", in, lineno, kind);
+                        errors++;
+                        continue;
+                }
+                if (strcmp(kind, "network") && (len == 0 || dfIndexAdd(&b, key, len, rule) < 0)) {
+                        fprintf(stderr, "%s:%d: rule too long or out of memory\n", in, lineno);
+                        errors++;
+                        continue;
+                }
+                rb.ruleTenant = grow(rb.ruleTenant, rb.nrules, sizeof(*rb.ruleTenant));
+                rb.ruleTenant[rb.nrules++] = tenant;
+        }
+        fclose(f);
+
+        struct RouteHeader hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        memcpy(hdr.magic, ROUTES_MAGIC, sizeof(hdr.magic));
+        hdr.nrules = rb.nrules;
+        hdr.ntenants = rb.ntenants;
+        hdr.nnodes = rb.nnodes;
+
+        size_t size = sizeof(hdr) + (size_t)rb.nrules * 4 + (size_t)rb.ntenants * sizeof(struct RouteTenant) +
+                      (size_t)rb.nnodes * sizeof(struct RouteNode);
+        unsigned char *trailer = malloc(size), *t = trailer;
+        if (errors == 0 && !trailer) {
+                perror("dfcompile");
+                errors++;
+        }
+        if (errors == 0) {
+                memcpy(t, &hdr, sizeof(hdr));
+                t += sizeof(hdr);
+                memcpy(t, rb.ruleTenant, (size_t)rb.nrules * 4);
+                t += (size_t)rb.nrules * 4;
+                memcpy(t, rb.tenants, (size_t)rb.ntenants * sizeof(struct RouteTenant));
+                t += (size_t)rb.ntenants * sizeof(struct RouteTenant);
+                memcpy(t, rb.nodes, (size_t)rb.nnodes * sizeof(struct RouteNode));
+                if (dfIndexWriteTrailer(&b, out, trailer, size) < 0) {
+                        perror(out);
+                        errors++;
+                }
+        }
+        if (errors == 0) printf("%s: %u tenants, %u rules\n", out, rb.ntenants, rb.nrules);
+        free(trailer);
+        free(rb.tenants);
+        free(rb.ruleTenant);
+        free(rb.nodes);
+        dfIndexBuilderFree(&b);
+        return errors ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+        if (argc != 4) usage();
+        if (!strcmp(argv[1], "principals")) return compilePrincipals(argv[2], argv[3]);
+        if (!strcmp(argv[1], "routes")) return compileRoutes(argv[2], argv[3]);
+        usage();
+        return 2;
+}
@@ -0,0 +1,258 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: mmapped read-only hash index (lookup side used by the PAM
+ *              module, build side used by dfcompile)
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "deviceflow.h"
+
+/* FNV-1a, good enough for account/claim strings and trivially portable */
+uint32_t dfHash(const void *key, size_t len) {
+        const unsigned char *p = key;
+        uint32_t h = 2166136261u;
+        while (len--) {
+                h ^= *p++;
+                h *= 16777619u;
+        }
+        return h;
+}
+
+static size_t entrySize(size_t keylen) {
+        return (12 + keylen + 3) & ~(size_t)3;
+}
+
+/* map the index read-only; refuse files anyone but root could have written */
+int dfIndexOpen(struct dfIndex *idx, const char *path) {
+        struct stat st;
+        memset(idx, 0, sizeof(*idx));
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        if (fstat(fd, &st) < 0 || st.st_uid != 0 || (st.st_mode & 022) ||
+            (size_t)st.st_size < sizeof(struct dfIndexHeader)) {
+                close(fd);
+                return -1;
+        }
+
+        void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) return -1;
+
+        const struct dfIndexHeader *hdr = base;
+        size_t need = sizeof(*hdr) + (size_t)hdr->nbuckets * 4 + hdr->poolSize + hdr->trailerSize;
+        if (memcmp(hdr->magic, DFINDEX_MAGIC, sizeof(hdr->magic)) ||
+            hdr->nbuckets == 0 || (hdr->nbuckets & (hdr->nbuckets - 1)) ||
+            need > (size_t)st.st_size) {
+                munmap(base, st.st_size);
+                return -1;
+        }
+
+        idx->base = base;
+        idx->size = st.st_size;
+        idx->hdr = hdr;
+        idx->buckets = (const uint32_t *)(hdr + 1);
+        idx->pool = (const unsigned char *)(idx->buckets + hdr->nbuckets);
+        return 0;
+}
+
+/* returns 1 and fills value if key is present, 0 otherwise */
+int dfIndexLookup(const struct dfIndex *idx, const void *key, size_t keylen, uint32_t *value) {
+        if (idx->base == NULL) return 0;
+
+        uint32_t h = dfHash(key, keylen);
+        uint32_t mask = idx->hdr->nbuckets - 1;
+        uint32_t poolSize = idx->hdr->poolSize;
+
+        for (uint32_t i = 0; i <= mask; i++) {
+                uint32_t slot = idx->buckets[(h + i) & mask];
+                if (slot == 0) return 0;
+
+                uint32_t off = slot - 1;
+                if (off + 12 > poolSize) return 0;
+                const uint32_t *e = (const uint32_t *)(idx->pool + off);
+                if (e[0] != h || e[2] != keylen) continue;
+                if (off + entrySize(keylen) > poolSize) return 0;
+                if (memcmp(e + 3, key, keylen) == 0) {
+                        if (value) *value = e[1];
+                        return 1;
+                }
+        }
+        return 0;
+}
+
+/* bytes dfIndexWriteTrailer stored after the table, NULL if none */
+const void *dfIndexTrailer(const struct dfIndex *idx, size_t *len) {
+        if (idx->base == NULL || idx->hdr->trailerSize == 0) return NULL;
+        *len = idx->hdr->trailerSize;
+        return idx->pool + idx->hdr->poolSize;
+}
+
+void dfIndexClose(struct dfIndex *idx) {
+        if (idx->base) munmap(idx->base, idx->size);
+        memset(idx, 0, sizeof(*idx));
+}
+
+void dfIndexBuilderInit(struct dfIndexBuilder *b) {
+        memset(b, 0, sizeof(*b));
+}
+
+int dfIndexAdd(struct dfIndexBuilder *b, const void *key, size_t keylen, uint32_t value) {
+        if (b->count == b->capacity) {
+                size_t cap = b->capacity ? b->capacity * 2 : 256;
+                char **keys = realloc(b->keys, cap * sizeof(*keys));
+                if (keys) b->keys = keys;
+                size_t *lens = realloc(b->keylens, cap * sizeof(*lens));
+                if (lens) b->keylens = lens;
+                uint32_t *values = realloc(b->values, cap * sizeof(*values));
+                if (values) b->values = values;
+                if (!keys || !lens || !values) return -1;
+                b->capacity = cap;
+        }
+        char *copy = malloc(keylen ? keylen : 1);
+        if (!copy) return -1;
+        memcpy(copy, key, keylen);
+
+        b->keys[b->count] = copy;
+        b->keylens[b->count] = keylen;
+        b->values[b->count] = value;
+        b->count++;
+        return 0;
+}
+
+int dfIndexWrite(struct dfIndexBuilder *b, const char *path) {
+        return dfIndexWriteTrailer(b, path, NULL, 0);
+}
+
+/*
+ * Lay the table out in memory, followed by trailerSize opaque bytes (must be a
+ * multiple of 4), and atomically replace path with it.
+ */
+int dfIndexWriteTrailer(struct dfIndexBuilder *b, const char *path, const void *trailer, size_t trailerSize) {
+        if (trailerSize & 3 || trailerSize >= UINT32_MAX) return -1;
+
+        uint32_t nbuckets = 16;
+        while (nbuckets < b->count * 2) nbuckets <<= 1;
+
+        size_t poolSize = 0;
+        for (size_t i = 0; i < b->count; i++) poolSize += entrySize(b->keylens[i]);
+        if (poolSize >= UINT32_MAX) return -1;
+
+        size_t total = sizeof(struct dfIndexHeader) + (size_t)nbuckets * 4 + poolSize + trailerSize;
+        unsigned char *image = calloc(1, total);
+        if (!image) return -1;
+
+        struct dfIndexHeader *hdr = (struct dfIndexHeader *)image;
+        uint32_t *buckets = (uint32_t *)(hdr + 1);
+        unsigned char *pool = (unsigned char *)(buckets + nbuckets);
+        memcpy(hdr->magic, DFINDEX_MAGIC, sizeof(hdr->magic));
+        hdr->nbuckets = nbuckets;
+
+        uint32_t off = 0;
+        for (size_t i = 0; i < b->count; i++) {
+                size_t len = b->keylens[i];
+                uint32_t h = dfHash(b->keys[i], len);
+                uint32_t slot = h & (nbuckets - 1);
+                int dup = 0;
+
+                /* linear probing; the first definition of a key wins */
+                while (buckets[slot]) {
+                        const uint32_t *e = (const uint32_t *)(pool + buckets[slot] - 1);
+                        if (e[0] == h && e[2] == len && !memcmp(e + 3, b->keys[i], len)) {
+                                dup = 1;
+                                break;
+                        }
+                        slot = (slot + 1) & (nbuckets - 1);
+                }
+                if (dup) continue;
+
+                uint32_t *e = (uint32_t *)(pool + off);
+                e[0] = h;
+                e[1] = b->values[i];
+                e[2] = len;
+                memcpy(e + 3, b->keys[i], len);
+                buckets[slot] = off + 1;
+                off += entrySize(len);
+                hdr->nentries++;
+        }
+        hdr->poolSize = off;
+        hdr->trailerSize = trailerSize;
+        if (trailerSize) memcpy(pool + off, trailer, trailerSize);
+        total = sizeof(struct dfIndexHeader) + (size_t)nbuckets * 4 + off + trailerSize;
+
+        char tmp[4096];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+        FILE *f = fopen(tmp, "wb");
+        if (!f) {
+                free(image);
+                return -1;
+        }
+        int ok = fwrite(image, 1, total, f) == total;
+        ok = (fflush(f) == 0) && ok;
+        ok = (fsync(fileno(f)) == 0) && ok;
+        ok = (fclose(f) == 0) && ok;
+        free(image);
+        chmod(tmp, 0644);
+        if (!ok || rename(tmp, path) < 0) {
+                unlink(tmp);
+                return -1;
+        }
+        return 0;
+}
+
+void dfIndexBuilderFree(struct dfIndexBuilder *b) {
+        for (size_t i = 0; i < b->count; i++) free(b->keys[i]);
+        free(b->keys);
+        free(b->keylens);
+        free(b->values);
+        memset(b, 0, sizeof(*b));
+}
+
+/* route keys are "kind\0pattern" */
+size_t routeKey(char *out, size_t outlen, const char *kind, const char *pattern, size_t patternLen) {
+        size_t k = strlen(kind);
+        if (k + patternLen + 1 > outlen) return 0;
+        memcpy(out, kind, k);
+        out[k] = '\0';
+        memcpy(out + k + 1, pattern, patternLen);
+        return k + 1 + patternLen;
+}
+
+/* principal keys are "issuer\0account\0claim\0value" */
+size_t principalKey(char *out, size_t outlen, const char *issuer, const char *account, const char *claim,
+                    const char *value) {
+        const char *parts[] = { issuer, account, claim, value };
+        size_t len = 0;
+        for (int i = 0; i < 4; i++) {
+                size_t n = strlen(parts[i]);
+                if (len + n + (i < 3) > outlen) return 0;
+                memcpy(out + len, parts[i], n);
+                len += n;
+                if (i < 3) out[len++] = '\0';
+        }
+        return len;
+}
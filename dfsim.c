@@ -0,0 +1,327 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: discrete-event simulation of many logins against a model IdP
+ *
+ *   dfsim -n 10000 -r 5 -m 20 -s 0.8 -a 0.05
+ *
+ * Runs the same poll.c bookkeeping the PAM module uses, on simulated time, so
+ * a change to the polling policy can be judged on poll counts, how long an
+ * approval takes to be noticed and what the IdP sees, without an IdP.
+ *
+ * Model, per login:
+ *   - arrives (Poisson, -r per second), the authorize call takes one round trip
+ *   - the user presses Enter -e seconds after the QR code shows, polling starts
+ *   - approves after a lognormal delay (median -m seconds, shape -s) measured
+ *     from the QR code, or with probability -a walks away after such a delay
+ *     and disconnects, which ends the flow
+ *   - the IdP answers slow_down to a flow polling faster than its interval, and
+ *     to everyone once -q token requests per second are exceeded
+ *   - the device code expires after -x seconds
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "deviceflow.h"
+
+enum { EV_ARRIVE, EV_SHOWN, EV_ENTER, EV_POLL, EV_REPLY, EV_LEAVE };
+
+struct Event {
+        long long when;
+        int type;
+        int login;
+};
+
+struct Login {
+        struct PollState ps;
+        long long arrive;
+        long long shown;           /* QR code on screen */
+        long long approve;         /* user approves at the IdP, or leaves if abandons */
+        long long idpLast;         /* last token request the IdP saw, -1 if none */
+        long long idpInterval;     /* interval the IdP enforces for this device code */
+        long long expires;
+        int abandons;
+        int done;
+        const char * reply;        /* in flight, NULL once consumed */
+};
+
+static struct Event * heap;
+static size_t heapLen, heapCap;
+
+static void push(long long when, int type, int login) {
+        if (heapLen == heapCap) {
+                heapCap = heapCap ? heapCap * 2 : 1024;
+                heap = realloc(heap, heapCap * sizeof(*heap));
+                if (heap == NULL) exit(1);
+        }
+        size_t i = heapLen++;
+        while (i > 0 && heap[(i - 1) / 2].when > when) {
+                heap[i] = heap[(i - 1) / 2];
+                i = (i - 1) / 2;
+        }
+        heap[i] = (struct Event){ when, type, login };
+}
+
+static struct Event pop(void) {
+        struct Event top = heap[0], last = heap[--heapLen];
+        size_t i = 0;
+        for (;;) {
+                size_t c = 2 * i + 1;
+                if (c >= heapLen) break;
+                if (c + 1 < heapLen && heap[c + 1].when < heap[c].when) c++;
+                if (last.when <= heap[c].when) break;
+                heap[i] = heap[c];
+                i = c;
+        }
+        heap[i] = last;
+        return top;
+}
+
+/* simulated time: whatever event is being handled */
+static long long simNow;
+
+static long long simClockNow(void * ctx) {
+        return simNow;
+}
+
+static int simSleepUntil(void * ctx, long long when) {
+        if (when > simNow) simNow = when;
+        return 0;
+}
+
+static struct dfClock simClock = { simClockNow, simSleepUntil, NULL };
+struct dfClock * dfclock = &simClock;
+
+/* xorshift64*, so a seed reproduces a run on any libc */
+static unsigned long long rng = 88172645463325252ULL;
+
+static double uniform(void) {
+        rng ^= rng >> 12;
+        rng ^= rng << 25;
+        rng ^= rng >> 27;
+        return ((rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static double normal(void) {
+        double u = uniform();
+        while (u <= 0.0) u = uniform();
+        return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * uniform());
+}
+
+static int cmpLL(const void * a, const void * b) {
+        long long x = *(const long long *)a, y = *(const long long *)b;
+        return (x > y) - (x < y);
+}
+
+static double percentile(const long long * sorted, size_t n, double p) {
+        if (n == 0) return 0;
+        size_t i = (size_t)(p * (n - 1) + 0.5);
+        return sorted[i] / 1000.0;
+}
+
+/* learn and adaptive start from an empty in-memory histogram, as on a new host */
+static const struct dfScheduler * findScheduler(const char * name) {
+        static struct dfScheduler sched;
+        static struct ApprovalHist hist;
+
+        if (!strcmp(name, fixedScheduler.name)) return &fixedScheduler;
+        if (!strcmp(name, "learn")) {
+                learningScheduler(&sched, &hist);
+                return &sched;
+        }
+        if (!strcmp(name, "adaptive")) {
+                adaptiveScheduler(&sched, &hist);
+                return &sched;
+        }
+        return NULL;
+}
+
+static void usage(void) {
+        fprintf(stderr, "usage: dfsim [-n logins] [-r arrivals/s] [-i interval] [-x expires_in]\n"
+                        "             [-m median approval s] [-s sigma] [-a abandon fraction]\n"
+                        "             [-e enter delay s] [-t rtt ms] [-q idp token qps] [-P fixed|learn|adaptive] [-S seed]\n");
+        exit(2);
+}
+
+int main(int argc, char ** argv) {
+        long count = 10000, interval = 5, expiresIn = 600, rttMs = 150, qps = 0;
+        double rate = 5, median = 20, sigma = 0.8, abandon = 0.05, enter = 2;
+        const struct dfScheduler * sched = &fixedScheduler;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "n:r:i:x:m:s:a:e:t:q:P:S:")) != -1) {
+                switch (opt) {
+                case 'n': count = atol(optarg); break;
+                case 'r': rate = atof(optarg); break;
+                case 'i': interval = atol(optarg); break;
+                case 'x': expiresIn = atol(optarg); break;
+                case 'm': median = atof(optarg); break;
+                case 's': sigma = atof(optarg); break;
+                case 'a': abandon = atof(optarg); break;
+                case 'e': enter = atof(optarg); break;
+                case 't': rttMs = atol(optarg); break;
+                case 'q': qps = atol(optarg); break;
+                case 'P':
+                        if ((sched = findScheduler(optarg)) == NULL) usage();
+                        break;
+                case 'S': rng = strtoull(optarg, NULL, 10) * 2654435761ULL + 1; break;
+                default: usage();
+                }
+        }
+        if (count <= 0 || rate <= 0 || interval <= 0) usage();
+
+        struct Login * logins = calloc(count, sizeof(*logins));
+        long long * detect = calloc(count, sizeof(*detect));
+        long long * shell = calloc(count, sizeof(*shell));
+        if (!logins || !detect || !shell) return 1;
+
+        /* token requests per simulated second, grown as time advances */
+        long * perSec = NULL;
+        size_t perSecLen = 0;
+
+        long long t = 0;
+        for (long i = 0; i < count; i++) {
+                t += (long long)(-log(1.0 - uniform()) / rate * 1000.0);
+                logins[i].arrive = t;
+                logins[i].idpLast = -1;
+                push(t, EV_ARRIVE, i);
+        }
+
+        long approved = 0, abandoned = 0, expired = 0, denied = 0;
+        long long tokenRequests = 0, slowDowns = 0;
+        size_t ndetect = 0;
+
+        while (heapLen > 0) {
+                struct Event ev = pop();
+                struct Login * l = &logins[ev.login];
+                simNow = ev.when;
+                if (l->done) continue;
+
+                switch (ev.type) {
+                case EV_ARRIVE:
+                        push(simNow + rttMs, EV_SHOWN, ev.login);
+                        break;
+
+                case EV_SHOWN: {
+                        l->shown = simNow;
+                        l->expires = simNow + expiresIn * 1000LL;
+                        l->idpInterval = interval * 1000LL;
+                        l->abandons = uniform() < abandon;
+                        l->approve = simNow + (long long)(median * exp(sigma * normal()) * 1000.0);
+                        if (l->abandons) push(l->approve, EV_LEAVE, ev.login);
+                        push(simNow + (long long)(enter * 1000), EV_ENTER, ev.login);
+                        break;
+                }
+
+                case EV_ENTER:
+                        pollBegin(&l->ps, sched, dfclock->now(dfclock->ctx), interval, (l->expires - simNow) / 1000);
+                        push(l->ps.nextPoll, EV_POLL, ev.login);
+                        break;
+
+                case EV_POLL: {
+                        /* the IdP sees the request half a round trip later */
+                        long long at = simNow + rttMs / 2;
+                        size_t sec = at / 1000;
+                        if (sec >= perSecLen) {
+                                size_t n = sec * 2 + 64;
+                                perSec = realloc(perSec, n * sizeof(*perSec));
+                                if (perSec == NULL) return 1;
+                                memset(perSec + perSecLen, 0, (n - perSecLen) * sizeof(*perSec));
+                                perSecLen = n;
+                        }
+                        perSec[sec]++;
+                        tokenRequests++;
+
+                        if (at >= l->expires) {
+                                l->reply = "expired_token";
+                        } else if ((l->idpLast >= 0 && at - l->idpLast < l->idpInterval) ||
+                                   (qps > 0 && perSec[sec] > qps)) {
+                                l->idpInterval += 5000;
+                                l->reply = "slow_down";
+                                slowDowns++;
+                        } else if (!l->abandons && at >= l->approve) {
+                                l->reply = NULL;
+                        } else {
+                                l->reply = "authorization_pending";
+                        }
+                        l->idpLast = at;
+                        push(simNow + rttMs, EV_REPLY, ev.login);
+                        break;
+                }
+
+                case EV_REPLY: {
+                        int st = pollResult(&l->ps, dfclock->now(dfclock->ctx), l->reply);
+                        if (st == POLL_DONE) {
+                                approved++;
+                                detect[ndetect] = simNow - l->approve;
+                                shell[ndetect++] = simNow - l->arrive;
+                                l->done = 1;
+                        } else if (st == POLL_FAILED) {
+                                pollGaveUp(&l->ps, dfclock->now(dfclock->ctx));
+                                if (l->reply && !strcmp(l->reply, "expired_token")) expired++;
+                                else if (l->ps.nextPoll >= l->ps.deadline) expired++;
+                                else denied++;
+                                l->done = 1;
+                        } else {
+                                push(l->ps.nextPoll, EV_POLL, ev.login);
+                        }
+                        break;
+                }
+
+                case EV_LEAVE:
+                        /* the module notices the disconnect at once, see sleepUntilAbandoned */
+                        pollGaveUp(&l->ps, dfclock->now(dfclock->ctx));
+                        abandoned++;
+                        l->done = 1;
+                        break;
+                }
+        }
+
+        qsort(detect, ndetect, sizeof(*detect), cmpLL);
+        qsort(shell, ndetect, sizeof(*shell), cmpLL);
+
+        long peak = 0;
+        size_t busy = 0;
+        for (size_t i = 0; i < perSecLen; i++) {
+                if (perSec[i] > peak) peak = perSec[i];
+                if (perSec[i]) busy = i + 1;
+        }
+
+        printf("scheduler            %s\n", sched->name);
+        printf("logins               %ld (approved %ld, abandoned %ld, expired %ld, failed %ld)\n",
+               count, approved, abandoned, expired, denied);
+        printf("token requests       %lld (%.2f per login), slow_down %lld\n",
+               tokenRequests, (double)tokenRequests / count, slowDowns);
+        printf("approval->detected s p50 %.2f  p90 %.2f  p99 %.2f\n",
+               percentile(detect, ndetect, 0.5), percentile(detect, ndetect, 0.9), percentile(detect, ndetect, 0.99));
+        printf("login->shell s       p50 %.2f  p90 %.2f  p99 %.2f\n",
+               percentile(shell, ndetect, 0.5), percentile(shell, ndetect, 0.9), percentile(shell, ndetect, 0.99));
+        printf("idp token qps        mean %.2f  peak %ld\n", busy ? (double)tokenRequests / busy : 0.0, peak);
+
+        free(logins);
+        free(detect);
+        free(shell);
+        free(perSec);
+        free(heap);
+        return 0;
+}
@@ -0,0 +1,613 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: fleet state daemon, one per bastion
+ *
+ *   dfstated -k secretfile [-l 10.0.0.5:7070] [-p peer:7070 ...]
+ *
+ * Holds in-flight device flows and recent approvals keyed by user@source and
+ * replicates every write to its peers (full mesh, newest version wins, see
+ * fleet.h). On start it pulls a snapshot from the first peer that answers.
+ * Records are dropped once they expire, so memory tracks active users.
+ *
+ * Only holders of the shared secret (-k, required) can talk to it; they prove
+ * it with an HMAC over a per-connection nonce, so the secret itself never
+ * crosses the wire. It listens on 127.0.0.1:7070 unless -l says otherwise,
+ * which a fleet needs for its peers. Device codes and id tokens still travel
+ * in clear text, so keep that address on a private network. Approvals are
+ * raw id tokens that readers verify, so a client cannot forge one.
+ *
+ * Everything runs on one poll loop and no socket is ever waited on: replies
+ * and replication are queued per connection and written as the other end
+ * takes them, so a dead or slow peer (or client) costs the others nothing.
+*******************************************************************************/
+#define _GNU_SOURCE             /* accept4 */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "deviceflow.h"
+#include "dynload.h"
+#include "fleet.h"
+
+#define MAX_CLIENTS 1024
+#define MAX_PEERS 32
+#define NBUCKETS 4096
+/* a peer that did not answer is left alone this long */
+#define PEER_RETRY 5
+#define DEFAULT_LISTEN "127.0.0.1:7070"
+/* unsent replies beyond this mean the client is not reading; a DUMP of every record fits */
+#define MAX_CLIENT_QUEUE (64 << 20)
+/* replication backlog kept for a peer that is down; beyond it the peer resyncs with DUMP on restart */
+#define MAX_PEER_QUEUE (8 << 20)
+
+struct Entry {
+        struct FleetRecord rec;
+        struct Entry * next;
+};
+
+/* bytes waiting for a socket to take them */
+struct Queue {
+        char * data;
+        size_t len;
+        size_t cap;
+};
+
+struct Client {
+        int fd;
+        int authed;
+        char nonce[33];
+        size_t len;
+        char buf[FLEET_LINE_MAX];
+        struct Queue out;
+};
+
+enum { PEER_IDLE, PEER_CONNECTING, PEER_HELLO, PEER_READY };
+
+struct Peer {
+        const char * addr;
+        struct sockaddr_storage sa;
+        socklen_t salen;
+        int fd;
+        int state;
+        time_t retryAt;
+        char in[128];              /* the HELLO line */
+        size_t inLen;
+        struct Queue out;
+};
+
+static struct Entry * table[NBUCKETS];
+static struct Client * clients[MAX_CLIENTS];
+static struct Peer peers[MAX_PEERS];
+static int npeers;
+static char secret[256];
+
+static long long nowMs(void) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        return (long long)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static struct Entry ** slot(const char * key) {
+        struct Entry ** e = &table[dfHash(key, strlen(key)) % NBUCKETS];
+        while (*e && strcmp((*e)->rec.key, key)) e = &(*e)->next;
+        return e;
+}
+
+static struct FleetRecord * lookup(const char * key) {
+        struct Entry * e = *slot(key);
+        if (e == NULL || e->rec.expires <= time(NULL)) return NULL;
+        return &e->rec;
+}
+
+static int newer(const struct FleetRecord * a, const struct FleetRecord * b) {
+        if (a->version != b->version) return a->version > b->version;
+        return strcmp(a->owner, b->owner) > 0;
+}
+
+/* last writer wins; returns 1 if rec replaced what we had */
+static int store(const struct FleetRecord * rec) {
+        struct Entry ** e = slot(rec->key);
+        if (*e) {
+                if ((*e)->rec.expires > time(NULL) && !newer(rec, &(*e)->rec)) return 0;
+                (*e)->rec = *rec;
+                return 1;
+        }
+        struct Entry * n = malloc(sizeof(*n));
+        if (n == NULL) return 0;
+        n->rec = *rec;
+        n->next = NULL;
+        *e = n;
+        return 1;
+}
+
+static void sweep(void) {
+        time_t now = time(NULL);
+        for (int i = 0; i < NBUCKETS; i++) {
+                struct Entry ** e = &table[i];
+                while (*e) {
+                        if ((*e)->rec.expires <= now) {
+                                struct Entry * dead = *e;
+                                *e = dead->next;
+                                free(dead);
+                        } else {
+                                e = &(*e)->next;
+                        }
+                }
+        }
+}
+
+/* append (or with front set, prepend) text; -1 if that would pass max */
+static int enqueue(struct Queue * q, const char * text, size_t len, size_t max, int front) {
+        if (q->len + len > max) return -1;
+        if (q->len + len > q->cap) {
+                size_t cap = q->cap ? q->cap : 4096;
+                while (cap < q->len + len) cap *= 2;
+                char * data = realloc(q->data, cap);
+                if (data == NULL) return -1;
+                q->data = data;
+                q->cap = cap;
+        }
+        if (front) {
+                memmove(q->data + len, q->data, q->len);
+                memcpy(q->data, text, len);
+        } else {
+                memcpy(q->data + q->len, text, len);
+        }
+        q->len += len;
+        return 0;
+}
+
+/* write what the socket takes without blocking; -1 if the connection is dead */
+static int flush(int fd, struct Queue * q) {
+        while (q->len > 0) {
+                ssize_t n = send(fd, q->data, q->len, MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) return -1;
+                memmove(q->data, q->data + n, q->len - n);
+                q->len -= n;
+        }
+        return 0;
+}
+
+static void closePeer(struct Peer * p) {
+        if (p->fd >= 0) close(p->fd);
+        p->fd = -1;
+        p->state = PEER_IDLE;
+        p->inLen = 0;
+        p->retryAt = time(NULL) + PEER_RETRY;
+}
+
+/* start a non-blocking connect; the poll loop finishes it */
+static void connectPeer(struct Peer * p) {
+        p->fd = socket(p->sa.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+        if (p->fd < 0) {
+                closePeer(p);
+                return;
+        }
+        /* until READY, retryAt is the deadline for the handshake */
+        p->retryAt = time(NULL) + PEER_RETRY;
+        if (connect(p->fd, (struct sockaddr *)&p->sa, p->salen) == 0) p->state = PEER_HELLO;
+        else if (errno == EINPROGRESS) p->state = PEER_CONNECTING;
+        else closePeer(p);
+}
+
+/* queue a write for every peer; a peer that is down gets it when it is back */
+static void replicate(const struct FleetRecord * rec) {
+        char line[FLEET_LINE_MAX + 8];
+        strcpy(line, "SYNC ");
+        int n = fleetFormat(line + 5, sizeof(line) - 7, rec);
+        if (n < 0) return;
+        strcpy(line + 5 + n, "\n");
+
+        for (int i = 0; i < npeers; i++) {
+                struct Peer * p = &peers[i];
+                if (enqueue(&p->out, line, 5 + n + 1, MAX_PEER_QUEUE, 0) < 0) {
+                        fprintf(stderr, "dfstated: %s unreachable, dropping %zu bytes of backlog\n", p->addr, p->out.len);
+                        p->out.len = 0;
+                        enqueue(&p->out, line, 5 + n + 1, MAX_PEER_QUEUE, 0);
+                }
+                if (p->state == PEER_IDLE && p->retryAt <= time(NULL)) connectPeer(p);
+        }
+}
+
+/* the poll loop saw activity on a peer connection */
+static void peerEvent(struct Peer * p, short revents) {
+        if (p->state == PEER_CONNECTING) {
+                int err = 0;
+                socklen_t len = sizeof(err);
+                if (getsockopt(p->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+                        closePeer(p);
+                        return;
+                }
+                p->state = PEER_HELLO;
+                return;
+        }
+        if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t n = recv(p->fd, p->in + p->inLen, sizeof(p->in) - 1 - p->inLen, MSG_DONTWAIT);
+                if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+                /* peers never answer SYNC, so anything after HELLO is the end */
+                if (n <= 0 || p->state != PEER_HELLO) {
+                        closePeer(p);
+                        return;
+                }
+                p->inLen += n;
+                p->in[p->inLen] = '\0';
+                char * nl = strchr(p->in, '\n');
+                if (nl == NULL) {
+                        if (p->inLen == sizeof(p->in) - 1) closePeer(p);
+                        return;
+                }
+                *nl = '\0';
+                char auth[FLEET_PROOF_LEN + 8];
+                strcpy(auth, "AUTH ");
+                if (strncmp(p->in, "HELLO ", 6) || fleetProof(secret, p->in + 6, auth + 5) < 0) {
+                        closePeer(p);
+                        return;
+                }
+                strcat(auth, "\n");
+                if (enqueue(&p->out, auth, strlen(auth), MAX_PEER_QUEUE + sizeof(auth), 1) < 0) {
+                        closePeer(p);
+                        return;
+                }
+                p->state = PEER_READY;
+        }
+        if (p->state == PEER_READY && flush(p->fd, &p->out) < 0) closePeer(p);
+}
+
+static void reply(struct Client * c, const char * text) {
+        if (c->fd >= 0 && enqueue(&c->out, text, strlen(text), MAX_CLIENT_QUEUE, 0) < 0) {
+                close(c->fd);
+                c->fd = -1;
+        }
+}
+
+static void replyRecord(struct Client * c, const struct FleetRecord * rec) {
+        char line[FLEET_LINE_MAX + 8];
+        strcpy(line, "REC ");
+        int n = fleetFormat(line + 4, sizeof(line) - 6, rec);
+        if (n < 0) {
+                reply(c, "NONE\n");
+                return;
+        }
+        strcpy(line + 4 + n, "\n");
+        reply(c, line);
+}
+/*
+ * CLAIM succeeds unless someone else holds a live lease on a pending flow or
+ * the pair is already approved. A takeover of an abandoned flow that sends
+ * data "-" keeps the previous owner's device code.
+ */
+static void claim(struct Client * c, struct FleetRecord * rec) {
+        struct FleetRecord * cur = lookup(rec->key);
+        time_t now = time(NULL);
+
+        if (cur && cur->state == FLEET_APPROVED) {
+                replyRecord(c, cur);
+                return;
+        }
+        if (cur && cur->state == FLEET_PENDING && cur->lease > now && strcmp(cur->owner, rec->owner)) {
+                replyRecord(c, cur);
+                return;
+        }
+        if (cur && rec->data[0] == '\0') memcpy(rec->data, cur->data, sizeof(rec->data));
+        rec->version = nowMs();
+        if (cur && rec->version <= cur->version) rec->version = cur->version + 1;
+        store(rec);
+        replicate(rec);
+        reply(c, "OK\n");
+}
+
+/* hand out an approved record once: what is left is a tombstone that replicates like any write */
+static void take(struct Client * c, const char * key) {
+        struct FleetRecord * cur = lookup(key);
+        if (cur == NULL || cur->state != FLEET_APPROVED) {
+                reply(c, "NONE\n");
+                return;
+        }
+        replyRecord(c, cur);
+
+        long long version = nowMs();
+        cur->version = version > cur->version ? version : cur->version + 1;
+        cur->state = FLEET_FAILED;
+        cur->data[0] = '\0';
+        replicate(cur);
+}
+
+static void handleLine(struct Client * c, char * line) {
+        struct FleetRecord rec;
+
+        if (!c->authed) {
+                if (!strncmp(line, "AUTH ", 5) && fleetProofMatches(secret, c->nonce, line + 5)) {
+                        c->authed = 1;
+                        return;
+                }
+                close(c->fd);
+                c->fd = -1;
+                return;
+        }
+
+        if (!strncmp(line, "GET ", 4)) {
+                struct FleetRecord * cur = lookup(line + 4);
+                if (cur) replyRecord(c, cur);
+                else reply(c, "NONE\n");
+        } else if (!strncmp(line, "PUT ", 4) && fleetParse(line + 4, &rec) == 0) {
+                if (store(&rec)) {
+                        replicate(&rec);
+                        reply(c, "OK\n");
+                } else {
+                        reply(c, "OLD\n");
+                }
+        } else if (!strncmp(line, "CLAIM ", 6) && fleetParse(line + 6, &rec) == 0) {
+                claim(c, &rec);
+        } else if (!strncmp(line, "TAKE ", 5)) {
+                take(c, line + 5);
+        } else if (!strncmp(line, "SYNC ", 5) && fleetParse(line + 5, &rec) == 0) {
+                store(&rec);
+        } else if (!strcmp(line, "DUMP")) {
+                time_t now = time(NULL);
+                for (int i = 0; i < NBUCKETS && c->fd >= 0; i++)
+                        for (struct Entry * e = table[i]; e && c->fd >= 0; e = e->next)
+                                if (e->rec.expires > now) replyRecord(c, &e->rec);
+                if (c->fd >= 0) reply(c, "END\n");
+        } else {
+                reply(c, "ERR\n");
+        }
+}
+
+static void readClient(struct Client * c) {
+        ssize_t n = recv(c->fd, c->buf + c->len, sizeof(c->buf) - 1 - c->len, MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) return;
+        if (n <= 0) {
+                close(c->fd);
+                c->fd = -1;
+                return;
+        }
+        c->len += n;
+        c->buf[c->len] = '\0';
+
+        char * start = c->buf, * nl;
+        while (c->fd >= 0 && (nl = strchr(start, '\n')) != NULL) {
+                *nl = '\0';
+                if (nl > start && nl[-1] == '\r') nl[-1] = '\0';
+                handleLine(c, start);
+                start = nl + 1;
+        }
+        if (c->fd < 0) return;
+        c->len -= start - c->buf;
+        memmove(c->buf, start, c->len);
+        if (c->len == sizeof(c->buf) - 1) {
+                /* line too long */
+                close(c->fd);
+                c->fd = -1;
+        }
+}
+
+/* seed from the first peer that answers so a restarted daemon is not blind */
+static void pullSnapshot(void) {
+        for (int i = 0; i < npeers; i++) {
+                int fd = fleetConnect(peers[i].addr, 2000);
+                if (fd < 0) continue;
+
+                if (fleetHello(fd, secret) < 0) {
+                        close(fd);
+                        continue;
+                }
+                fleetSendAll(fd, "DUMP\n", 5);
+
+                FILE * f = fdopen(fd, "r");
+                if (f == NULL) {
+                        close(fd);
+                        continue;
+                }
+                static char line[FLEET_LINE_MAX];
+                struct FleetRecord rec;
+                int count = 0, complete = 0;
+                while (fgets(line, sizeof(line), f)) {
+                        line[strcspn(line, "\r\n")] = '\0';
+                        if (!strcmp(line, "END")) {
+                                complete = 1;
+                                break;
+                        }
+                        if (!strncmp(line, "REC ", 4) && fleetParse(line + 4, &rec) == 0) {
+                                store(&rec);
+                                count++;
+                        }
+                }
+                fclose(f);
+                fprintf(stderr, "dfstated: %d records from %s\n", count, peers[i].addr);
+                if (complete) return;
+        }
+}
+
+static int listenOn(const char * addr) {
+        char host[256];
+        const char * colon = strrchr(addr, ':');
+        if (colon == NULL || colon - addr >= (long)sizeof(host)) return -1;
+        memcpy(host, addr, colon - addr);
+        host[colon - addr] = '\0';
+
+        struct addrinfo hints, * res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_PASSIVE;
+        if (getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &res) != 0) return -1;
+
+        int fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (fd < 0 || bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 128) < 0) {
+                freeaddrinfo(res);
+                if (fd >= 0) close(fd);
+                return -1;
+        }
+        freeaddrinfo(res);
+        return fd;
+}
+
+/* peers are resolved once, so reconnecting never waits on DNS */
+static int resolvePeer(struct Peer * p) {
+        char host[256];
+        const char * colon = strrchr(p->addr, ':');
+        if (colon == NULL || colon - p->addr >= (long)sizeof(host)) return -1;
+        memcpy(host, p->addr, colon - p->addr);
+        host[colon - p->addr] = '\0';
+
+        struct addrinfo hints, * res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, colon + 1, &hints, &res) != 0) return -1;
+        memcpy(&p->sa, res->ai_addr, res->ai_addrlen);
+        p->salen = res->ai_addrlen;
+        freeaddrinfo(res);
+        return 0;
+}
+
+static void usage(void) {
+        fprintf(stderr, "usage: dfstated -k secretfile [-l host:port] [-p peer:port ...]\n");
+        exit(2);
+}
+
+int main(int argc, char ** argv) {
+        const char * listenAddr = DEFAULT_LISTEN;
+        int opt;
+
+        while ((opt = getopt(argc, argv, "l:p:k:")) != -1) {
+                if (opt == 'l') {
+                        listenAddr = optarg;
+                } else if (opt == 'p' && npeers < MAX_PEERS) {
+                        peers[npeers].addr = optarg;
+                        peers[npeers].fd = -1;
+                        npeers++;
+                } else if (opt == 'k') {
+                        FILE * f = fopen(optarg, "r");
+                        if (f == NULL || fgets(secret, sizeof(secret), f) == NULL) {
+                                perror(optarg);
+                                return 1;
+                        }
+                        fclose(f);
+                        secret[strcspn(secret, "\r\n")] = '\0';
+                } else {
+                        usage();
+                }
+        }
+        if (!secret[0]) {
+                fprintf(stderr, "dfstated: -k is required, an open daemon would let anyone approve logins\n");
+                usage();
+        }
+        if (loadCrypto() < 0) return 1;
+        for (int i = 0; i < npeers; i++) {
+                if (resolvePeer(&peers[i]) < 0) {
+                        fprintf(stderr, "dfstated: cannot resolve peer %s\n", peers[i].addr);
+                        return 1;
+                }
+        }
+
+        signal(SIGPIPE, SIG_IGN);
+        int lfd = listenOn(listenAddr);
+        if (lfd < 0) {
+                perror(listenAddr);
+                return 1;
+        }
+        pullSnapshot();
+
+        struct pollfd pfds[MAX_CLIENTS + MAX_PEERS + 1];
+        int which[MAX_CLIENTS + MAX_PEERS + 1];
+        time_t lastSweep = time(NULL);
+        for (;;) {
+                int n = 0, firstPeer;
+                pfds[n++] = (struct pollfd){ lfd, POLLIN, 0 };
+                for (int i = 0; i < MAX_CLIENTS; i++) {
+                        if (clients[i] == NULL) continue;
+                        which[n] = i;
+                        pfds[n++] = (struct pollfd){ clients[i]->fd, POLLIN | (clients[i]->out.len ? POLLOUT : 0), 0 };
+                }
+                firstPeer = n;
+                for (int i = 0; i < npeers; i++) {
+                        struct Peer * p = &peers[i];
+                        if (p->state == PEER_IDLE && p->out.len && p->retryAt <= time(NULL)) connectPeer(p);
+                        if (p->fd >= 0 && p->state != PEER_READY && p->retryAt <= time(NULL)) closePeer(p);
+                        if (p->fd < 0) continue;
+                        short events = p->state == PEER_CONNECTING ? POLLOUT :
+                                       POLLIN | (p->state == PEER_READY && p->out.len ? POLLOUT : 0);
+                        which[n] = i;
+                        pfds[n++] = (struct pollfd){ p->fd, events, 0 };
+                }
+
+                if (poll(pfds, n, 1000) < 0 && errno != EINTR) break;
+
+                if (pfds[0].revents & POLLIN) {
+                        int fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                        int i = 0;
+                        while (fd >= 0 && i < MAX_CLIENTS && clients[i]) i++;
+                        if (fd >= 0 && i < MAX_CLIENTS && (clients[i] = calloc(1, sizeof(struct Client)))) {
+                                unsigned char rnd[16];
+                                char hello[64];
+                                clients[i]->fd = fd;
+                                if (getrandom(rnd, sizeof(rnd), 0) != sizeof(rnd)) {
+                                        clients[i]->fd = -1;
+                                        close(fd);
+                                } else {
+                                        for (int b = 0; b < 16; b++) sprintf(clients[i]->nonce + 2 * b, "%02x", rnd[b]);
+                                        snprintf(hello, sizeof(hello), "HELLO %s\n", clients[i]->nonce);
+                                        reply(clients[i], hello);
+                                }
+                                if (clients[i]->fd < 0) {
+                                        free(clients[i]);
+                                        clients[i] = NULL;
+                                }
+                        } else if (fd >= 0) {
+                                close(fd);
+                        }
+                }
+                for (int k = 1; k < firstPeer; k++) {
+                        struct Client * c = clients[which[k]];
+                        if (c == NULL) continue;
+                        if (pfds[k].revents & (POLLIN | POLLHUP | POLLERR)) readClient(c);
+                        if (c->fd >= 0 && flush(c->fd, &c->out) < 0) {
+                                close(c->fd);
+                                c->fd = -1;
+                        }
+                        if (c->fd < 0) {
+                                free(c->out.data);
+                                free(c);
+                                clients[which[k]] = NULL;
+                        }
+                }
+                for (int k = firstPeer; k < n; k++) {
+                        if (pfds[k].revents) peerEvent(&peers[which[k]], pfds[k].revents);
+                }
+                if (time(NULL) - lastSweep >= 10) {
+                        sweep();
+                        lastSweep = time(NULL);
+                }
+        }
+        return 1;
+}
@@ -0,0 +1,128 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: lazy loading of libcurl, libqrencode and libcrypto
+ *
+ * Every process using a pam.d stack that mentions deviceflow.so maps the
+ * module, including account-only calls and logins satisfied from the session
+ * cache. Linking libcurl (and the TLS stack it drags in) directly costs each
+ * of them several milliseconds of relocation and megabytes of RSS, so the
+ * libraries are opened the first time a device flow really starts.
+ * They are never dlclose()d; neither library supports being unloaded.
+ * For the same reason curl_global_init runs once, when libcurl is mapped, and
+ * curl_global_cleanup never does.
+*******************************************************************************/
+#include <stdio.h>
+#include <dlfcn.h>
+
+#include "dynload.h"
+
+struct CurlApi curlApi;
+struct QRApi qrApi;
+struct CryptoApi cryptoApi;
+
+static void *openLibrary(const char *const *names) {
+        for (; *names; names++) {
+                void *lib = dlopen(*names, RTLD_NOW | RTLD_LOCAL);
+                if (lib) return lib;
+        }
+        return NULL;
+}
+
+#define LOAD(lib, field, symbol) \
+        if ((*(void **)&(field) = dlsym(lib, symbol)) == NULL) { \
+                fprintf(stderr, "deviceflow: missing %s: %s\n", symbol, dlerror()); \
+                return -1; \
+        }
+
+int loadCurl(void) {
+        static const char *const names[] = { "libcurl.so.4", "libcurl-gnutls.so.4", "libcurl.so", NULL };
+        static void *lib;
+
+        if (curlApi.multi_cleanup) return 0;
+        if (lib == NULL && (lib = openLibrary(names)) == NULL) {
+                fprintf(stderr, "deviceflow: cannot load libcurl: %s\n", dlerror());
+                return -1;
+        }
+        LOAD(lib, curlApi.global_init, "curl_global_init");
+        LOAD(lib, curlApi.easy_init, "curl_easy_init");
+        LOAD(lib, curlApi.easy_setopt, "curl_easy_setopt");
+        LOAD(lib, curlApi.easy_getinfo, "curl_easy_getinfo");
+        LOAD(lib, curlApi.easy_cleanup, "curl_easy_cleanup");
+        LOAD(lib, curlApi.multi_init, "curl_multi_init");
+        LOAD(lib, curlApi.multi_add_handle, "curl_multi_add_handle");
+        LOAD(lib, curlApi.multi_remove_handle, "curl_multi_remove_handle");
+        LOAD(lib, curlApi.multi_setopt, "curl_multi_setopt");
+        LOAD(lib, curlApi.multi_socket_action, "curl_multi_socket_action");
+        LOAD(lib, curlApi.multi_info_read, "curl_multi_info_read");
+        if (curlApi.global_init(CURL_GLOBAL_ALL) != CURLE_OK) {
+                fprintf(stderr, "deviceflow: curl_global_init failed\n");
+                return -1;
+        }
+        /* last, it doubles as the "fully loaded" marker */
+        LOAD(lib, curlApi.multi_cleanup, "curl_multi_cleanup");
+        return 0;
+}
+
+int loadQR(void) {
+        static const char *const names[] = { "libqrencode.so.4", "libqrencode.so.3", "libqrencode.so", NULL };
+        static void *lib;
+
+        if (qrApi.free) return 0;
+        if (lib == NULL && (lib = openLibrary(names)) == NULL) {
+                fprintf(stderr, "deviceflow: cannot load libqrencode: %s\n", dlerror());
+                return -1;
+        }
+        LOAD(lib, qrApi.encodeString, "QRcode_encodeString");
+        LOAD(lib, qrApi.free, "QRcode_free");
+        return 0;
+}
+
+/* only needed for signatures: id tokens before minting an SSH certificate, hop assertions */
+int loadCrypto(void) {
+        static const char *const names[] = { "libcrypto.so.3", "libcrypto.so.1.1", "libcrypto.so", NULL };
+        static void *lib;
+
+        if (cryptoApi.EVP_sha256) return 0;
+        if (lib == NULL && (lib = openLibrary(names)) == NULL) {
+                fprintf(stderr, "deviceflow: cannot load libcrypto: %s\n", dlerror());
+                return -1;
+        }
+        LOAD(lib, cryptoApi.BN_bin2bn, "BN_bin2bn");
+        LOAD(lib, cryptoApi.BN_free, "BN_free");
+        LOAD(lib, cryptoApi.RSA_new, "RSA_new");
+        LOAD(lib, cryptoApi.RSA_set0_key, "RSA_set0_key");
+        LOAD(lib, cryptoApi.RSA_free, "RSA_free");
+        LOAD(lib, cryptoApi.EVP_PKEY_new, "EVP_PKEY_new");
+        LOAD(lib, cryptoApi.EVP_PKEY_assign, "EVP_PKEY_assign");
+        LOAD(lib, cryptoApi.EVP_PKEY_free, "EVP_PKEY_free");
+        LOAD(lib, cryptoApi.EVP_MD_CTX_new, "EVP_MD_CTX_new");
+        LOAD(lib, cryptoApi.EVP_MD_CTX_free, "EVP_MD_CTX_free");
+        LOAD(lib, cryptoApi.EVP_DigestVerifyInit, "EVP_DigestVerifyInit");
+        LOAD(lib, cryptoApi.EVP_DigestVerify, "EVP_DigestVerify");
+        LOAD(lib, cryptoApi.EVP_PKEY_new_raw_private_key, "EVP_PKEY_new_raw_private_key");
+        LOAD(lib, cryptoApi.EVP_PKEY_new_raw_public_key, "EVP_PKEY_new_raw_public_key");
+        LOAD(lib, cryptoApi.EVP_DigestSignInit, "EVP_DigestSignInit");
+        LOAD(lib, cryptoApi.EVP_DigestSign, "EVP_DigestSign");
+        LOAD(lib, cryptoApi.EVP_Digest, "EVP_Digest");
+        /* last, it doubles as the "fully loaded" marker */
+        LOAD(lib, cryptoApi.EVP_sha256, "EVP_sha256");
+        return 0;
+}
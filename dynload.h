@@ -0,0 +1,84 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: function tables for libraries that are only dlopen()ed when a
+ *              login actually needs them, see dynload.c
+*******************************************************************************/
+#ifndef DYNLOAD_H
+#define DYNLOAD_H
+
+#include <curl/curl.h>
+#include <qrencode.h>
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+
+struct CurlApi {
+        CURLcode (*global_init)(long flags);
+        CURL *(*easy_init)(void);
+        CURLcode (*easy_setopt)(CURL *handle, CURLoption option, ...);
+        CURLcode (*easy_getinfo)(CURL *handle, CURLINFO info, ...);
+        void (*easy_cleanup)(CURL *handle);
+        CURLM *(*multi_init)(void);
+        CURLMcode (*multi_add_handle)(CURLM *multi, CURL *handle);
+        CURLMcode (*multi_remove_handle)(CURLM *multi, CURL *handle);
+        CURLMcode (*multi_setopt)(CURLM *multi, CURLMoption option, ...);
+        CURLMcode (*multi_socket_action)(CURLM *multi, curl_socket_t s, int ev_bitmask, int *running);
+        CURLMsg *(*multi_info_read)(CURLM *multi, int *msgs_in_queue);
+        CURLMcode (*multi_cleanup)(CURLM *multi);
+};
+
+struct QRApi {
+        QRcode *(*encodeString)(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive);
+        void (*free)(QRcode *qrcode);
+};
+
+/* just enough libcrypto to check RS256 signatures and sign/check Ed25519 hop assertions */
+struct CryptoApi {
+        BIGNUM *(*BN_bin2bn)(const unsigned char *s, int len, BIGNUM *ret);
+        void (*BN_free)(BIGNUM *a);
+        RSA *(*RSA_new)(void);
+        int (*RSA_set0_key)(RSA *r, BIGNUM *n, BIGNUM *e, BIGNUM *d);
+        void (*RSA_free)(RSA *r);
+        EVP_PKEY *(*EVP_PKEY_new)(void);
+        int (*EVP_PKEY_assign)(EVP_PKEY *pkey, int type, void *key);
+        void (*EVP_PKEY_free)(EVP_PKEY *pkey);
+        EVP_MD_CTX *(*EVP_MD_CTX_new)(void);
+        void (*EVP_MD_CTX_free)(EVP_MD_CTX *ctx);
+        int (*EVP_DigestVerifyInit)(EVP_MD_CTX *ctx, EVP_PKEY_CTX **pctx, const EVP_MD *type, ENGINE *e, EVP_PKEY *pkey);
+        int (*EVP_DigestVerify)(EVP_MD_CTX *ctx, const unsigned char *sig, size_t siglen, const unsigned char *tbs, size_t tbslen);
+        int (*EVP_Digest)(const void *data, size_t count, unsigned char *md, unsigned int *size, const EVP_MD *type, ENGINE *impl);
+        const EVP_MD *(*EVP_sha256)(void);
+        EVP_PKEY *(*EVP_PKEY_new_raw_private_key)(int type, ENGINE *e, const unsigned char *key, size_t keylen);
+        EVP_PKEY *(*EVP_PKEY_new_raw_public_key)(int type, ENGINE *e, const unsigned char *key, size_t keylen);
+        int (*EVP_DigestSignInit)(EVP_MD_CTX *ctx, EVP_PKEY_CTX **pctx, const EVP_MD *type, ENGINE *e, EVP_PKEY *pkey);
+        int (*EVP_DigestSign)(EVP_MD_CTX *ctx, unsigned char *sigret, size_t *siglen, const unsigned char *tbs, size_t tbslen);
+};
+
+extern struct CurlApi curlApi;
+extern struct QRApi qrApi;
+extern struct CryptoApi cryptoApi;
+
+/* return 0 once the library is usable, -1 (and a message on stderr) if it is not installed */
+int loadCurl(void);
+int loadQR(void);
+int loadCrypto(void);
+
+#endif
@@ -0,0 +1,539 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: the device flow as a state machine over curl's multi socket
+ *              interface, see df.h
+ *
+ * curl tells us which sockets to watch (socketCallback) and when it next
+ * needs a kick (timerCallback); each flow adds its own next poll time. The
+ * poll bookkeeping itself is poll.c, shared with the blocking module path.
+ * Every time comes from the engine's dfClock (df_engine_set_clock), the
+ * module's own clock in deviceflow.so, so simulated time drives it too.
+ *
+ * A poll that gets no answer (transport error, HTTP 5xx, no JSON) is retried
+ * with backoff; a URL curl can never use, or too many such polls in a row,
+ * fail the flow with "transport" or "server_error".
+ *
+ * Plain GETs (df_fetch) share the multi handle, so a caller's discovery and
+ * JWKS requests travel alongside its flows' requests.
+*******************************************************************************/
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "deviceflow.h"
+#include "dynload.h"
+#include "df.h"
+
+#define DEFAULT_POLL_INTERVAL 5
+#define DEFAULT_EXPIRES_IN 600
+#define DEFAULT_SCOPE "openid profile offline_access"
+#define REQUEST_TIMEOUT 30
+/* unanswered polls in a row before the flow gives up; the gap doubles each time */
+#define MAX_UNANSWERED 5
+#define MAX_BACKOFF_SHIFT 3
+
+struct df_engine {
+        const struct dfClock * clock;
+        CURLM * multi;
+        struct df_fd * fds;
+        int nfds;
+        int capacity;
+        long long curlTimer;       /* absolute ms, -1 if curl wants no kick */
+        struct df_flow * flows;
+        struct df_fetch * fetches;
+};
+
+/* a response body as it arrives */
+struct Body {
+        char * data;
+        size_t size;
+};
+
+struct df_flow {
+        struct df_engine * engine;
+        struct df_flow * next;
+        int state;
+        CURL * handle;
+        int busy;                  /* a request is in flight */
+        struct Body body;
+        long status;
+        char tokenUrl[512];
+        char clientId[256];
+        char postData[2048];
+        char userCode[128];
+        char deviceCode[1024];
+        char verificationUri[1024];
+        char error[128];
+        char * idToken;
+        char * claims;
+        struct PollState ps;
+        int unanswered;            /* polls in a row without an answer from the IdP */
+        void (*onEvent)(void * arg, struct df_flow * flow, int event);
+        void * arg;
+};
+
+struct df_fetch {
+        struct df_engine * engine;
+        struct df_fetch * next;
+        CURL * handle;
+        struct Body body;
+        long status;
+        long maxAge;               /* seconds, 0 for no-store/no-cache, -1 if not given */
+        int done;
+};
+
+static long long monotonicNow(void * ctx) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* the engine never sleeps, so sleepUntil stays unused */
+static const struct dfClock monotonicClock = { monotonicNow, NULL, NULL };
+
+static long long now(const struct df_engine * e) {
+        return e->clock->now(e->clock->ctx);
+}
+
+static size_t writeBody(void * contents, size_t size, size_t nmemb, void * userp) {
+        struct Body * b = userp;
+        size_t len = size * nmemb;
+        char * p = realloc(b->data, b->size + len + 1);
+        if (p == NULL) return 0;
+        b->data = p;
+        memcpy(b->data + b->size, contents, len);
+        b->size += len;
+        b->data[b->size] = '\0';
+        return len;
+}
+
+/* max-age out of Cache-Control, so a fetch's caller can cache as long as the server allows */
+static size_t headerLine(char * buffer, size_t size, size_t nitems, void * userp) {
+        struct df_fetch * x = userp;
+        size_t len = size * nitems;
+        char line[512];
+
+        if (len < 14 || strncasecmp(buffer, "cache-control:", 14)) return len;
+        snprintf(line, sizeof(line), "%.*s", (int)len, buffer);
+        for (char * p = line; *p; p++) *p = tolower((unsigned char)*p);
+
+        char * age = strstr(line, "max-age=");
+        if (strstr(line, "no-store") || strstr(line, "no-cache")) x->maxAge = 0;
+        else if (age) x->maxAge = atol(age + 8);
+        return len;
+}
+
+static int socketCallback(CURL * easy, curl_socket_t s, int what, void * userp, void * socketp) {
+        struct df_engine * e = userp;
+        int i;
+        for (i = 0; i < e->nfds && e->fds[i].fd != s; i++);
+
+        if (what == CURL_POLL_REMOVE) {
+                if (i < e->nfds) e->fds[i] = e->fds[--e->nfds];
+                return 0;
+        }
+        if (i == e->nfds) {
+                if (e->nfds == e->capacity) {
+                        int cap = e->capacity ? e->capacity * 2 : 8;
+                        struct df_fd * fds = realloc(e->fds, cap * sizeof(*fds));
+                        if (fds == NULL) return -1;
+                        e->fds = fds;
+                        e->capacity = cap;
+                }
+                e->fds[e->nfds++].fd = s;
+        }
+        e->fds[i].events = ((what & CURL_POLL_IN) ? DF_READ : 0) | ((what & CURL_POLL_OUT) ? DF_WRITE : 0);
+        return 0;
+}
+
+/* only note the deadline; calling back into curl from here is not allowed */
+static int timerCallback(CURLM * multi, long timeoutMs, void * userp) {
+        struct df_engine * e = userp;
+        e->curlTimer = timeoutMs < 0 ? -1 : now(e) + timeoutMs;
+        return 0;
+}
+
+struct df_engine * df_engine_new(void) {
+        if (loadCurl() < 0) return NULL;
+        struct df_engine * e = calloc(1, sizeof(*e));
+        if (e == NULL) return NULL;
+
+        e->clock = &monotonicClock;
+        e->curlTimer = -1;
+        e->multi = curlApi.multi_init();
+        if (e->multi == NULL) {
+                free(e);
+                return NULL;
+        }
+        curlApi.multi_setopt(e->multi, CURLMOPT_SOCKETFUNCTION, socketCallback);
+        curlApi.multi_setopt(e->multi, CURLMOPT_SOCKETDATA, e);
+        curlApi.multi_setopt(e->multi, CURLMOPT_TIMERFUNCTION, timerCallback);
+        curlApi.multi_setopt(e->multi, CURLMOPT_TIMERDATA, e);
+        return e;
+}
+
+void df_engine_set_clock(struct df_engine * e, const struct dfClock * clock) {
+        e->clock = clock ? clock : &monotonicClock;
+}
+
+void df_engine_free(struct df_engine * e) {
+        if (e == NULL) return;
+        while (e->flows) df_end(e->flows);
+        while (e->fetches) df_fetch_end(e->fetches);
+        curlApi.multi_cleanup(e->multi);
+        free(e->fds);
+        free(e);
+}
+
+int df_fds(struct df_engine * e, struct df_fd * out, int max) {
+        int n = e->nfds < max ? e->nfds : max;
+        memcpy(out, e->fds, n * sizeof(*out));
+        return n;
+}
+
+long df_timeout(struct df_engine * e) {
+        long long t = now(e), next = e->curlTimer;
+        for (struct df_flow * f = e->flows; f; f = f->next) {
+                if (f->state != DF_PENDING || f->busy) continue;
+                long long due = f->ps.nextPoll < f->ps.deadline ? f->ps.nextPoll : f->ps.deadline;
+                if (next < 0 || due < next) next = due;
+        }
+        if (next < 0) return -1;
+        return next <= t ? 0 : (long)(next - t);
+}
+
+/* what every request on the multi handle sets, flow or fetch */
+static void requestOptions(CURL * handle, const char * url, struct Body * body) {
+        body->size = 0;
+        if (body->data) body->data[0] = '\0';
+        curlApi.easy_setopt(handle, CURLOPT_URL, url);
+        curlApi.easy_setopt(handle, CURLOPT_WRITEFUNCTION, writeBody);
+        curlApi.easy_setopt(handle, CURLOPT_WRITEDATA, (void *)body);
+        curlApi.easy_setopt(handle, CURLOPT_NOSIGNAL, 1L);
+        curlApi.easy_setopt(handle, CURLOPT_TIMEOUT, (long)REQUEST_TIMEOUT);
+}
+
+static void sendRequest(struct df_flow * f, const char * url) {
+        f->status = 0;
+        requestOptions(f->handle, url, &f->body);
+        curlApi.easy_setopt(f->handle, CURLOPT_COPYPOSTFIELDS, f->postData);
+        curlApi.easy_setopt(f->handle, CURLOPT_PRIVATE, (void *)f);
+        if (curlApi.multi_add_handle(f->engine->multi, f->handle) == CURLM_OK) {
+                f->busy = 1;
+        } else {
+                snprintf(f->error, sizeof(f->error), "transport");
+                f->state = DF_FAILED;
+        }
+}
+
+static void startPoll(struct df_flow * f) {
+        if (f->onEvent) f->onEvent(f->arg, f, DF_EVENT_POLL_START);
+        sendRequest(f, f->tokenUrl);
+}
+
+/* the token request carries the device code from now on */
+static void tokenRequest(struct df_flow * f) {
+        snprintf(f->postData, sizeof(f->postData),
+                 "device_code=%s&grant_type=urn:ietf:params:oauth:grant-type:device_code&client_id=%s",
+                 f->deviceCode, f->clientId);
+}
+
+static void authorized(struct df_flow * f) {
+        long interval = getNumberClaim(f->body.data, "interval", DEFAULT_POLL_INTERVAL);
+        long expiresIn = getNumberClaim(f->body.data, "expires_in", DEFAULT_EXPIRES_IN);
+
+        getClaim(f->body.data, "user_code", f->userCode, sizeof(f->userCode));
+        if (!getClaim(f->body.data, "verification_uri_complete", f->verificationUri, sizeof(f->verificationUri)))
+                getClaim(f->body.data, "verification_uri", f->verificationUri, sizeof(f->verificationUri));
+        if (!getClaim(f->body.data, "device_code", f->deviceCode, sizeof(f->deviceCode))) {
+                if (!getClaim(f->body.data, "error", f->error, sizeof(f->error)))
+                        snprintf(f->error, sizeof(f->error), "bad_response");
+                f->state = DF_FAILED;
+                return;
+        }
+        tokenRequest(f);
+        pollBegin(&f->ps, f->ps.sched, now(f->engine), interval, expiresIn);
+        f->ps.nextPoll = f->ps.start + f->ps.interval;     /* nobody has scanned the code yet */
+        f->state = DF_PENDING;
+}
+
+/* curl errors that no retry will fix */
+static int permanentError(CURLcode result) {
+        return result == CURLE_UNSUPPORTED_PROTOCOL || result == CURLE_URL_MALFORMAT;
+}
+
+/* no answer this time: poll again later, a little later each time, or give up */
+static int unanswered(struct df_flow * f, const char * why) {
+        long long t = now(f->engine);
+        int st = pollResult(&f->ps, t, "authorization_pending");
+        if (++f->unanswered >= MAX_UNANSWERED) {
+                snprintf(f->error, sizeof(f->error), "%s", why);
+                return POLL_FAILED;
+        }
+        int shift = f->unanswered - 1 < MAX_BACKOFF_SHIFT ? f->unanswered - 1 : MAX_BACKOFF_SHIFT;
+        long long backoff = t + (f->ps.interval << shift);
+        if (st == POLL_AGAIN && backoff > f->ps.nextPoll && backoff < f->ps.deadline) f->ps.nextPoll = backoff;
+        return st;
+}
+
+static void polled(struct df_flow * f, CURLcode result) {
+        char * token = NULL;
+        int st;
+
+        f->error[0] = '\0';
+        if (permanentError(result)) {
+                snprintf(f->error, sizeof(f->error), "transport");
+                st = POLL_FAILED;
+        } else if (result != CURLE_OK || f->body.data == NULL || f->status == 0) {
+                /* a network hiccup is not an answer */
+                st = unanswered(f, "transport");
+        } else if (getClaim(f->body.data, "error", f->error, sizeof(f->error))) {
+                f->unanswered = 0;
+                st = pollResult(&f->ps, now(f->engine), f->error);
+        } else if (f->status >= 500) {
+                /* a proxy's or an overloaded IdP's error page, not the IdP's verdict */
+                st = unanswered(f, "server_error");
+        } else if ((token = malloc(f->body.size + 1)) != NULL && getClaim(f->body.data, "id_token", token, f->body.size + 1)) {
+                const char * dot1 = strchr(token, '.');
+                const char * dot2 = dot1 ? strchr(dot1 + 1, '.') : NULL;
+                f->claims = dot2 ? base64decode(dot1 + 1, dot2 - dot1 - 1) : NULL;
+                if (f->claims) {
+                        f->idToken = token;
+                        token = NULL;
+                        st = pollResult(&f->ps, now(f->engine), NULL);
+                } else {
+                        snprintf(f->error, sizeof(f->error), "bad_response");
+                        st = POLL_FAILED;
+                }
+        } else {
+                snprintf(f->error, sizeof(f->error), "bad_response");
+                st = POLL_FAILED;
+        }
+        free(token);
+
+        if (st == POLL_DONE) {
+                f->state = DF_APPROVED;
+        } else if (st == POLL_FAILED) {
+                /* still pending but out of time is the same as the IdP saying expired_token */
+                if (!strcmp(f->error, "access_denied")) f->state = DF_DENIED;
+                else if (!strcmp(f->error, "expired_token") || !strcmp(f->error, "authorization_pending") ||
+                         !strcmp(f->error, "slow_down") || !f->error[0]) f->state = DF_EXPIRED;
+                else f->state = DF_FAILED;
+        }
+        if (f->onEvent) f->onEvent(f->arg, f, DF_EVENT_POLL_DONE);
+}
+
+static void finishTransfers(struct df_engine * e) {
+        CURLMsg * msg;
+        int left;
+        while ((msg = curlApi.multi_info_read(e->multi, &left)) != NULL) {
+                if (msg->msg != CURLMSG_DONE) continue;
+                struct df_fetch * x;
+                for (x = e->fetches; x && x->handle != msg->easy_handle; x = x->next);
+                if (x) {
+                        curlApi.easy_getinfo(x->handle, CURLINFO_RESPONSE_CODE, &x->status);
+                        curlApi.multi_remove_handle(e->multi, x->handle);
+                        x->done = 1;
+                        continue;
+                }
+
+                struct df_flow * f = NULL;
+                CURLcode result = msg->data.result;
+                curlApi.easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&f);
+                if (f == NULL) continue;
+                curlApi.easy_getinfo(f->handle, CURLINFO_RESPONSE_CODE, &f->status);
+                curlApi.multi_remove_handle(e->multi, f->handle);
+                f->busy = 0;
+
+                if (f->state == DF_AUTHORIZING) {
+                        if (result == CURLE_OK && f->body.data) {
+                                authorized(f);
+                        } else {
+                                snprintf(f->error, sizeof(f->error), "transport");
+                                f->state = DF_FAILED;
+                        }
+                } else if (f->state == DF_PENDING) {
+                        polled(f, result);
+                }
+        }
+}
+
+int df_step(struct df_engine * e, int fd, int events) {
+        int running = 0;
+
+        if (fd >= 0) {
+                int mask = ((events & DF_READ) ? CURL_CSELECT_IN : 0) | ((events & DF_WRITE) ? CURL_CSELECT_OUT : 0);
+                if (curlApi.multi_socket_action(e->multi, fd, mask, &running) != CURLM_OK) return -1;
+        }
+        if (e->curlTimer >= 0 && e->curlTimer <= now(e)) {
+                e->curlTimer = -1;
+                if (curlApi.multi_socket_action(e->multi, CURL_SOCKET_TIMEOUT, 0, &running) != CURLM_OK) return -1;
+        }
+        finishTransfers(e);
+
+        long long t = now(e);
+        for (struct df_flow * f = e->flows; f; f = f->next) {
+                if (f->state != DF_PENDING || f->busy) continue;
+                if (pollExpired(&f->ps, t)) {
+                        snprintf(f->error, sizeof(f->error), "expired_token");
+                        f->state = DF_EXPIRED;
+                } else if (f->ps.nextPoll <= t) {
+                        startPoll(f);
+                }
+        }
+        return 0;
+}
+
+struct df_flow * df_begin(struct df_engine * e, const struct df_options * o) {
+        struct df_flow * f = calloc(1, sizeof(*f));
+        if (f == NULL) return NULL;
+        f->handle = curlApi.easy_init();
+        /* an empty URL would only ever fail, and look like a pending flow until the deadline */
+        if (f->handle == NULL || !o->token_url || !o->token_url[0] || !o->client_id ||
+            (!o->device_code && (!o->authorize_url || !o->authorize_url[0]))) {
+                if (f->handle) curlApi.easy_cleanup(f->handle);
+                free(f);
+                return NULL;
+        }
+        f->engine = e;
+        f->onEvent = o->on_event;
+        f->arg = o->arg;
+        f->ps.sched = o->scheduler ? o->scheduler : &fixedScheduler;
+        snprintf(f->tokenUrl, sizeof(f->tokenUrl), "%s", o->token_url);
+        snprintf(f->clientId, sizeof(f->clientId), "%s", o->client_id);
+        f->next = e->flows;
+        e->flows = f;
+
+        if (o->device_code) {
+                /* adopt: the code was shown elsewhere, start polling straight away */
+                snprintf(f->deviceCode, sizeof(f->deviceCode), "%s", o->device_code);
+                tokenRequest(f);
+                pollBegin(&f->ps, f->ps.sched, now(f->engine), o->interval > 0 ? o->interval : DEFAULT_POLL_INTERVAL,
+                          o->expires_in > 0 ? o->expires_in : DEFAULT_EXPIRES_IN);
+                f->state = DF_PENDING;
+        } else {
+                snprintf(f->postData, sizeof(f->postData), "client_id=%s&scope=%s", o->client_id,
+                         o->scope ? o->scope : DEFAULT_SCOPE);
+                f->state = DF_AUTHORIZING;
+                sendRequest(f, o->authorize_url);
+        }
+        return f;
+}
+
+void df_continue(struct df_flow * f) {
+        if (f->state != DF_PENDING || f->busy) return;
+        long long t = now(f->engine);
+        if (f->ps.polls == 0) {
+                /* start the clock over, the scheduler counts from here */
+                long long left = f->ps.deadline - t;
+                pollBegin(&f->ps, f->ps.sched, t, f->ps.interval / 1000, left > 0 ? left / 1000 : 0);
+        } else {
+                long long earliest = f->ps.lastPoll + f->ps.minInterval;
+                f->ps.nextPoll = earliest > t ? earliest : t;
+        }
+}
+
+void df_end(struct df_flow * f) {
+        struct df_engine * e = f->engine;
+        for (struct df_flow ** p = &e->flows; *p; p = &(*p)->next) {
+                if (*p == f) {
+                        *p = f->next;
+                        break;
+                }
+        }
+        /* the user never approved: worth as much to a learning scheduler as an approval */
+        if (f->state == DF_PENDING || f->state == DF_EXPIRED || f->state == DF_DENIED) pollGaveUp(&f->ps, now(e));
+        if (f->busy) curlApi.multi_remove_handle(e->multi, f->handle);
+        curlApi.easy_cleanup(f->handle);
+        free(f->body.data);
+        free(f->idToken);
+        free(f->claims);
+        free(f);
+}
+
+int df_state(const struct df_flow * f) { return f->state; }
+const char * df_user_code(const struct df_flow * f) { return f->userCode; }
+const char * df_verification_uri(const struct df_flow * f) { return f->verificationUri; }
+const char * df_error(const struct df_flow * f) { return f->error; }
+long df_http_status(const struct df_flow * f) { return f->status; }
+int df_polls(const struct df_flow * f) { return f->ps.polls; }
+long df_interval(const struct df_flow * f) { return f->ps.interval / 1000; }
+const char * df_result(const struct df_flow * f) { return f->state == DF_APPROVED ? f->claims : NULL; }
+const char * df_id_token(const struct df_flow * f) { return f->state == DF_APPROVED ? f->idToken : NULL; }
+
+const char * df_device_code(const struct df_flow * f) { return f->deviceCode; }
+
+long df_next_poll(const struct df_flow * f) {
+        long long left = f->ps.nextPoll - now(f->engine);
+        return left > 0 ? (long)left : 0;
+}
+
+long df_expires_in(const struct df_flow * f) {
+        long long left = f->ps.deadline - now(f->engine);
+        return f->state == DF_PENDING && left > 0 ? (long)(left / 1000) : 0;
+}
+
+struct df_fetch * df_fetch_begin(struct df_engine * e, const char * url) {
+        struct df_fetch * x = calloc(1, sizeof(*x));
+        if (x == NULL) return NULL;
+        x->handle = curlApi.easy_init();
+        if (x->handle == NULL || !url || !url[0]) {
+                if (x->handle) curlApi.easy_cleanup(x->handle);
+                free(x);
+                return NULL;
+        }
+        x->engine = e;
+        x->maxAge = -1;
+        requestOptions(x->handle, url, &x->body);
+        curlApi.easy_setopt(x->handle, CURLOPT_HTTPGET, 1L);
+        curlApi.easy_setopt(x->handle, CURLOPT_HEADERFUNCTION, headerLine);
+        curlApi.easy_setopt(x->handle, CURLOPT_HEADERDATA, (void *)x);
+        if (curlApi.multi_add_handle(e->multi, x->handle) != CURLM_OK) {
+                curlApi.easy_cleanup(x->handle);
+                free(x);
+                return NULL;
+        }
+        x->next = e->fetches;
+        e->fetches = x;
+        return x;
+}
+
+void df_fetch_end(struct df_fetch * x) {
+        struct df_engine * e = x->engine;
+        for (struct df_fetch ** p = &e->fetches; *p; p = &(*p)->next) {
+                if (*p == x) {
+                        *p = x->next;
+                        break;
+                }
+        }
+        if (!x->done) curlApi.multi_remove_handle(e->multi, x->handle);
+        curlApi.easy_cleanup(x->handle);
+        free(x->body.data);
+        free(x);
+}
+
+int df_fetch_done(const struct df_fetch * x) { return x->done; }
+long df_fetch_status(const struct df_fetch * x) { return x->status; }
+const char * df_fetch_body(const struct df_fetch * x) { return x->body.data ? x->body.data : ""; }
+long df_fetch_max_age(const struct df_fetch * x) { return x->maxAge; }
@@ -0,0 +1,258 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: client side of the fleet state protocol spoken by dfstated
+ *
+ * The daemon opens every connection with "HELLO <nonce>"; the client proves
+ * it holds the shared secret without sending it, then sends requests. One
+ * line per request and per reply:
+ *   AUTH <hex HMAC-SHA256(secret, nonce)>
+ *   GET <key>                      -> REC ... | NONE
+ *   PUT <record>                   -> OK | OLD
+ *   CLAIM <record>                 -> OK (caller owns the flow) | REC ... (someone else does)
+ *   TAKE <key>                     -> REC ... (now a failed tombstone) | NONE, approved records only
+ *   DUMP                           -> REC ... lines, then END
+ *   SYNC <record>                  peer replication, no reply
+ * where <record> is "<key> <version> <state> <expires> <lease> <owner> <data>"
+ * and data runs to the end of the line.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "dynload.h"
+#include "fleet.h"
+
+static const char * const stateNames[] = { "none", "pending", "approved", "failed" };
+
+/* "host:port" -> connected socket with send/receive timeouts, or -1 */
+int fleetConnect(const char * addr, int timeoutMs) {
+        char host[256];
+        const char * colon = strrchr(addr, ':');
+        if (colon == NULL || colon - addr >= (long)sizeof(host)) return -1;
+        memcpy(host, addr, colon - addr);
+        host[colon - addr] = '\0';
+
+        struct addrinfo hints, * res, * ai;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host, colon + 1, &hints, &res) != 0) return -1;
+
+        int fd = -1;
+        for (ai = res; ai && fd < 0; ai = ai->ai_next) {
+                fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+                if (fd < 0) continue;
+                if (connect(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+                        struct pollfd pfd = { fd, POLLOUT, 0 };
+                        int err = 0;
+                        socklen_t len = sizeof(err);
+                        if (errno != EINPROGRESS || poll(&pfd, 1, timeoutMs) != 1 ||
+                            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err) {
+                                close(fd);
+                                fd = -1;
+                        }
+                }
+        }
+        freeaddrinfo(res);
+        if (fd < 0) return -1;
+
+        struct timeval tv = { timeoutMs / 1000, (timeoutMs % 1000) * 1000 };
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        return fd;
+}
+
+int fleetSendAll(int fd, const char * buf, size_t len) {
+        while (len > 0) {
+                ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+                if (n <= 0) return -1;
+                buf += n;
+                len -= n;
+        }
+        return 0;
+}
+
+/* read one '\n' terminated line; the daemon never sends ahead of a request */
+static int readLine(int fd, char * out, size_t outlen) {
+        size_t n = 0;
+        while (n + 1 < outlen) {
+                ssize_t got = recv(fd, out + n, outlen - 1 - n, 0);
+                if (got <= 0) return -1;
+                char * nl = memchr(out + n, '\n', got);
+                n += got;
+                if (nl) {
+                        *nl = '\0';
+                        return 0;
+                }
+        }
+        return -1;
+}
+
+/* hex HMAC-SHA256 of nonce under the shared secret, into out[FLEET_PROOF_LEN + 1] */
+int fleetProof(const char * secret, const char * nonce, char * out) {
+        unsigned char mac[32];
+        size_t maclen = sizeof(mac);
+
+        if (secret == NULL || !secret[0] || loadCrypto() < 0) return -1;
+        EVP_PKEY * key = cryptoApi.EVP_PKEY_new_raw_private_key(EVP_PKEY_HMAC, NULL, (const unsigned char *)secret,
+                                                                strlen(secret));
+        EVP_MD_CTX * ctx = cryptoApi.EVP_MD_CTX_new();
+        int ok = key && ctx && cryptoApi.EVP_DigestSignInit(ctx, NULL, cryptoApi.EVP_sha256(), NULL, key) == 1 &&
+                 cryptoApi.EVP_DigestSign(ctx, mac, &maclen, (const unsigned char *)nonce, strlen(nonce)) == 1 &&
+                 maclen == sizeof(mac);
+        if (ctx) cryptoApi.EVP_MD_CTX_free(ctx);
+        if (key) cryptoApi.EVP_PKEY_free(key);
+        if (!ok) return -1;
+        for (size_t i = 0; i < sizeof(mac); i++) sprintf(out + 2 * i, "%02x", mac[i]);
+        return 0;
+}
+
+/* does proof answer nonce; takes the same time wherever the first wrong byte is */
+int fleetProofMatches(const char * secret, const char * nonce, const char * proof) {
+        char want[FLEET_PROOF_LEN + 1];
+        unsigned char diff = 0;
+
+        if (strlen(proof) != FLEET_PROOF_LEN || fleetProof(secret, nonce, want) < 0) return 0;
+        for (size_t i = 0; i < FLEET_PROOF_LEN; i++) diff |= want[i] ^ proof[i];
+        return diff == 0;
+}
+
+/* answer the daemon's HELLO on a fresh connection */
+int fleetHello(int fd, const char * secret) {
+        char hello[128], auth[FLEET_PROOF_LEN + 8];
+
+        if (readLine(fd, hello, sizeof(hello)) < 0 || strncmp(hello, "HELLO ", 6)) return -1;
+        strcpy(auth, "AUTH ");
+        if (fleetProof(secret, hello + 6, auth + 5) < 0) return -1;
+        strcat(auth, "\n");
+        return fleetSendAll(fd, auth, strlen(auth));
+}
+
+const char * fleetStateName(int state) {
+        return (state >= 0 && state <= FLEET_FAILED) ? stateNames[state] : "none";
+}
+
+int fleetStateFromName(const char * name) {
+        for (int i = 0; i <= FLEET_FAILED; i++)
+                if (!strcmp(name, stateNames[i])) return i;
+        return FLEET_NONE;
+}
+
+int fleetFormat(char * out, size_t outlen, const struct FleetRecord * rec) {
+        int n = snprintf(out, outlen, "%s %lld %s %ld %ld %s %s", rec->key, rec->version,
+                         fleetStateName(rec->state), rec->expires, rec->lease,
+                         rec->owner[0] ? rec->owner : "-", rec->data[0] ? rec->data : "-");
+        if (n < 0 || (size_t)n >= outlen) return -1;
+        /* the protocol is line based; JSON never needs a raw newline */
+        for (char * p = out; *p; p++)
+                if (*p == '\n' || *p == '\r') *p = ' ';
+        return n;
+}
+
+/* parse "<key> <version> <state> <expires> <lease> <owner> <data>" */
+int fleetParse(const char * line, struct FleetRecord * rec) {
+        char state[16];
+        int used = 0;
+
+        memset(rec, 0, sizeof(*rec));
+        if (sscanf(line, "%255s %lld %15s %ld %ld %63s %n", rec->key, &rec->version, state,
+                   &rec->expires, &rec->lease, rec->owner, &used) < 6 || used == 0) {
+                return -1;
+        }
+        rec->state = fleetStateFromName(state);
+        if (!strcmp(rec->owner, "-")) rec->owner[0] = '\0';
+        snprintf(rec->data, sizeof(rec->data), "%s", line + used);
+        if (!strcmp(rec->data, "-")) rec->data[0] = '\0';
+        return 0;
+}
+
+/* one request/reply exchange with the local daemon */
+static int exchange(const char * addr, const char * secret, const char * request, char * reply, size_t replylen) {
+        int fd = fleetConnect(addr, FLEET_TIMEOUT_MS);
+        if (fd < 0) return -1;
+
+        int rc = fleetHello(fd, secret);
+        if (rc == 0) rc = fleetSendAll(fd, request, strlen(request));
+        if (rc == 0) rc = readLine(fd, reply, replylen);
+        close(fd);
+        return rc;
+}
+
+/*
+ * Records belong to a user, a source address and the SSH key the client
+ * proved it holds: several people behind one NAT address share the first two.
+ * -1 if that does not fit, rather than a key that lost its fingerprint.
+ */
+int fleetKey(char * out, size_t outlen, const char * user, const char * rhost, const char * fingerprint) {
+        int n = snprintf(out, outlen, "%s@%s/%s", user, rhost && rhost[0] ? rhost : "local", fingerprint);
+        if (n < 0 || (size_t)n >= outlen) return -1;
+        for (char * p = out; *p; p++)
+                if (*p <= ' ') *p = '_';
+        return 0;
+}
+
+/* 1 and rec filled if the key is known fleet-wide, 0 if not, -1 if the daemon is unreachable */
+int fleetGet(const char * addr, const char * secret, const char * key, struct FleetRecord * rec) {
+        char request[512], reply[FLEET_LINE_MAX];
+        snprintf(request, sizeof(request), "GET %s\n", key);
+        if (exchange(addr, secret, request, reply, sizeof(reply)) < 0) return -1;
+        if (strncmp(reply, "REC ", 4)) return 0;
+        return fleetParse(reply + 4, rec) == 0 ? 1 : -1;
+}
+
+/* like fleetGet for an approved record, which the daemon replaces with a tombstone so nobody gets it twice */
+int fleetTake(const char * addr, const char * secret, const char * key, struct FleetRecord * rec) {
+        char request[512], reply[FLEET_LINE_MAX];
+        snprintf(request, sizeof(request), "TAKE %s\n", key);
+        if (exchange(addr, secret, request, reply, sizeof(reply)) < 0) return -1;
+        if (strncmp(reply, "REC ", 4)) return 0;
+        return fleetParse(reply + 4, rec) == 0 ? 1 : -1;
+}
+
+int fleetPut(const char * addr, const char * secret, const struct FleetRecord * rec) {
+        char request[FLEET_LINE_MAX], reply[64];
+        strcpy(request, "PUT ");
+        int n = fleetFormat(request + 4, sizeof(request) - 6, rec);
+        if (n < 0) return -1;
+        strcpy(request + 4 + n, "\n");
+        if (exchange(addr, secret, request, reply, sizeof(reply)) < 0) return -1;
+        return strcmp(reply, "OK") ? -1 : 0;
+}
+
+/* 1 if we now own the flow, 0 if someone else does (rec replaced by theirs), -1 on error */
+int fleetClaim(const char * addr, const char * secret, struct FleetRecord * rec) {
+        char request[FLEET_LINE_MAX], reply[FLEET_LINE_MAX];
+        strcpy(request, "CLAIM ");
+        int n = fleetFormat(request + 6, sizeof(request) - 8, rec);
+        if (n < 0) return -1;
+        strcpy(request + 6 + n, "\n");
+        if (exchange(addr, secret, request, reply, sizeof(reply)) < 0) return -1;
+        if (!strcmp(reply, "OK")) return 1;
+        if (!strncmp(reply, "REC ", 4) && fleetParse(reply + 4, rec) == 0) return 0;
+        return -1;
+}
@@ -0,0 +1,74 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: records shared between bastions through dfstated, see fleet.c
+*******************************************************************************/
+#ifndef FLEET_H
+#define FLEET_H
+
+#include <stddef.h>
+
+#define FLEET_LINE_MAX 16384
+#define FLEET_TIMEOUT_MS 500
+/* hex HMAC-SHA256 answering the daemon's HELLO nonce */
+#define FLEET_PROOF_LEN 64
+
+enum { FLEET_NONE, FLEET_PENDING, FLEET_APPROVED, FLEET_FAILED };
+
+/*
+ * One device flow or approval for a user+source+SSH key (fleetKey). Times are epoch
+ * seconds, so bastions need synchronized clocks. The newest version wins,
+ * ties go to the lexically larger owner.
+ *
+ * pending:  data is "<device_code> <interval> <verification_uri_complete>";
+ *           the owner polls the IdP and keeps pushing lease forward.
+ * approved: data is the raw id token; every reader checks the IdP's
+ *           signature (verifyIdToken) before trusting it, so the fleet
+ *           carries approvals but cannot make them up. Hop assertions
+ *           (hop.c) are approved records too, consumed with fleetTake.
+ * failed:   a tombstone, e.g. what fleetTake leaves behind.
+ */
+struct FleetRecord {
+        char key[256];
+        long long version;
+        int state;
+        long expires;
+        long lease;
+        char owner[64];
+        char data[FLEET_LINE_MAX - 512];
+};
+
+int fleetConnect(const char * addr, int timeoutMs);
+int fleetSendAll(int fd, const char * buf, size_t len);
+const char * fleetStateName(int state);
+int fleetStateFromName(const char * name);
+int fleetFormat(char * out, size_t outlen, const struct FleetRecord * rec);
+int fleetParse(const char * line, struct FleetRecord * rec);
+int fleetProof(const char * secret, const char * nonce, char * out);
+int fleetProofMatches(const char * secret, const char * nonce, const char * proof);
+int fleetHello(int fd, const char * secret);
+
+int fleetKey(char * out, size_t outlen, const char * user, const char * rhost, const char * fingerprint);
+int fleetGet(const char * addr, const char * secret, const char * key, struct FleetRecord * rec);
+int fleetPut(const char * addr, const char * secret, const struct FleetRecord * rec);
+int fleetClaim(const char * addr, const char * secret, struct FleetRecord * rec);
+int fleetTake(const char * addr, const char * secret, const char * key, struct FleetRecord * rec);
+
+#endif
@@ -0,0 +1,271 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: one device flow for a whole ProxyJump chain
+ *
+ *   ssh -J bastion1,bastion2 target
+ *
+ * bastion1 runs the device flow. It then signs a short-lived assertion for
+ * the next hop with its Ed25519 hop key and publishes it through dfstated
+ * under "hop:<user>:<hop_address>", hop_address being where its outgoing
+ * connections come from. bastion2 sees bastion1 as PAM_RHOST, fetches the
+ * record, checks the signature against its trusted hop keys plus the
+ * audience, user and expiry, and logs the user in on the claims inside. It
+ * can delegate again to the next hop in turn.
+ *
+ * The assertion names the SSH key the user authenticated with on bastion1
+ * (SSH_AUTH_INFO_0, so sshd needs ExposeAuthInfo and publickey before
+ * keyboard-interactive), and bastion2 only honours it for a client that
+ * proved possession of that same key. It is also good for one login:
+ * bastion2 takes it out of dfstated (TAKE) before letting the user in.
+ *
+ * An assertion is base64url(payload) "." base64url(signature), the payload
+ *   {"iss":"<hop_address>","aud":"<audience>","user":"<account>",
+ *    "key":"<ssh public key>","iat":<epoch>,"exp":<epoch>,
+ *    "claims":"<base64url id token claims>"}
+ *
+ * Key files hold base64 raw 32 byte keys: hop_key the private key, hop_trust
+ * one "<public key> [comment]" line per trusted upstream hop.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+#include "deviceflow.h"
+#include "dynload.h"
+#include "fleet.h"
+
+/* long enough for the client to open the next hop, short enough not to matter if copied */
+#define HOP_LIFETIME 60
+#define HOP_SKEW 30
+#define ED25519_KEY_LEN 32
+#define ED25519_SIG_LEN 64
+
+static const char b64url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+/* unpadded base64url; caller frees */
+static char * base64urlEncode(const unsigned char * in, size_t len) {
+        char * out = malloc(len * 4 / 3 + 4), * o = out;
+        if (out == NULL) return NULL;
+        for (size_t i = 0; i < len; i += 3) {
+                unsigned long v = (unsigned long)in[i] << 16;
+                if (i + 1 < len) v |= in[i + 1] << 8;
+                if (i + 2 < len) v |= in[i + 2];
+                *o++ = b64url[(v >> 18) & 63];
+                *o++ = b64url[(v >> 12) & 63];
+                if (i + 1 < len) *o++ = b64url[(v >> 6) & 63];
+                if (i + 2 < len) *o++ = b64url[v & 63];
+        }
+        *o = '\0';
+        return out;
+}
+
+/* a base64 key of exactly ED25519_KEY_LEN bytes from text */
+static int decodeKey(const char * text, unsigned char * key) {
+        int len = 0;
+        size_t n = strcspn(text, " \t\r\n");
+        char * raw = n ? base64decodeLen(text, n, &len) : NULL;
+        int ok = raw && len == ED25519_KEY_LEN;
+        if (ok) memcpy(key, raw, ED25519_KEY_LEN);
+        free(raw);
+        return ok ? 0 : -1;
+}
+
+static int signEd25519(const unsigned char * seed, const char * tbs, unsigned char * sig) {
+        EVP_PKEY * pkey = cryptoApi.EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, NULL, seed, ED25519_KEY_LEN);
+        EVP_MD_CTX * ctx = cryptoApi.EVP_MD_CTX_new();
+        size_t siglen = ED25519_SIG_LEN;
+        int ok = pkey && ctx && cryptoApi.EVP_DigestSignInit(ctx, NULL, NULL, NULL, pkey) == 1 &&
+                 cryptoApi.EVP_DigestSign(ctx, sig, &siglen, (const unsigned char *)tbs, strlen(tbs)) == 1 &&
+                 siglen == ED25519_SIG_LEN;
+        if (ctx) cryptoApi.EVP_MD_CTX_free(ctx);
+        if (pkey) cryptoApi.EVP_PKEY_free(pkey);
+        return ok ? 0 : -1;
+}
+
+static int verifyEd25519(const unsigned char * pub, const char * tbs, size_t tbslen, const unsigned char * sig) {
+        EVP_PKEY * pkey = cryptoApi.EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, pub, ED25519_KEY_LEN);
+        EVP_MD_CTX * ctx = cryptoApi.EVP_MD_CTX_new();
+        int ok = pkey && ctx && cryptoApi.EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, pkey) == 1 &&
+                 cryptoApi.EVP_DigestVerify(ctx, sig, ED25519_SIG_LEN, (const unsigned char *)tbs, tbslen) == 1;
+        if (ctx) cryptoApi.EVP_MD_CTX_free(ctx);
+        if (pkey) cryptoApi.EVP_PKEY_free(pkey);
+        return ok ? 0 : -1;
+}
+
+/* fit to paste into a JSON string as is */
+static int plainText(const char * s) {
+        for (; *s; s++)
+                if (*s == '"' || *s == '\\' || (unsigned char)*s < ' ') return 0;
+        return 1;
+}
+
+/* does any key in the trust file vouch for this signature */
+static int trustedSignature(const char * tbs, size_t tbslen, const unsigned char * sig) {
+        struct stat st;
+        char line[512];
+        unsigned char pub[ED25519_KEY_LEN];
+        int ok = 0;
+
+        FILE * f = fopen(options.hopTrust, "r");
+        if (f == NULL) return 0;
+        if (fstat(fileno(f), &st) < 0 || st.st_uid != 0 || (st.st_mode & 022)) {
+                fclose(f);
+                return 0;
+        }
+        while (!ok && fgets(line, sizeof(line), f)) {
+                if (line[0] == '#' || decodeKey(line, pub) < 0) continue;
+                ok = verifyEd25519(pub, tbs, tbslen, sig) == 0;
+        }
+        fclose(f);
+        return ok;
+}
+
+/* publish an assertion of these (already verified) claims for the next hop */
+int hopDelegate(pam_handle_t * pamh, const char * user, const char * claims) {
+        struct stat st;
+        char line[256];
+        char sshKey[8192];
+        unsigned char seed[ED25519_KEY_LEN], sig[ED25519_SIG_LEN];
+
+        if (!options.hopKey || !options.hopAddress || !options.delegateAudience || !options.fleet) return -1;
+        if (!plainText(user) || !plainText(options.hopAddress) || !plainText(options.delegateAudience)) return -1;
+        /* without a key to bind to, the assertion would be a bearer token */
+        if (authenticatedKey(pamh, sshKey, sizeof(sshKey)) < 0) return -1;
+        if (loadCrypto() < 0) return -1;
+
+        /* the private key is root's alone */
+        FILE * f = fopen(options.hopKey, "r");
+        if (f == NULL) return -1;
+        int ok = fstat(fileno(f), &st) == 0 && st.st_uid == 0 && !(st.st_mode & 077) &&
+                 fgets(line, sizeof(line), f) && decodeKey(line, seed) == 0;
+        fclose(f);
+        if (!ok) {
+                fprintf(stderr, "hop key %s unusable\n", options.hopKey);
+                return -1;
+        }
+
+        time_t now = time(NULL);
+        char * inner = base64urlEncode((const unsigned char *)claims, strlen(claims));
+        size_t plen = (inner ? strlen(inner) : 0) + strlen(user) + strlen(options.hopAddress) +
+                      strlen(options.delegateAudience) + strlen(sshKey) + 128;
+        char * payload = inner ? malloc(plen) : NULL;
+        char * body = NULL, * signature = NULL;
+        int rc = -1;
+        if (payload) {
+                snprintf(payload, plen,
+                         "{\"iss\":\"%s\",\"aud\":\"%s\",\"user\":\"%s\",\"key\":\"%s\",\"iat\":%ld,\"exp\":%ld,\"claims\":\"%s\"}",
+                         options.hopAddress, options.delegateAudience, user, sshKey, (long)now, (long)now + HOP_LIFETIME,
+                         inner);
+                body = base64urlEncode((const unsigned char *)payload, strlen(payload));
+        }
+        if (body && signEd25519(seed, body, sig) == 0) signature = base64urlEncode(sig, sizeof(sig));
+        explicit_bzero(seed, sizeof(seed));
+
+        struct FleetRecord * rec = calloc(1, sizeof(*rec));
+        if (signature && rec && strlen(body) + strlen(signature) + 2 <= sizeof(rec->data)) {
+                fleetInit();
+                snprintf(rec->key, sizeof(rec->key), "hop:%s:%s", user, options.hopAddress);
+                for (char * p = rec->key; *p; p++)
+                        if (*p <= ' ') *p = '_';
+                snprintf(rec->data, sizeof(rec->data), "%s.%s", body, signature);
+                fleetPublish(rec, FLEET_APPROVED, now + HOP_LIFETIME, NULL);
+                rc = 0;
+        }
+        free(rec);
+        free(signature);
+        free(body);
+        free(payload);
+        free(inner);
+        return rc;
+}
+
+/*
+ * Claims (caller frees) if the previous hop vouched for this user and key
+ * within the last HOP_LIFETIME seconds, else NULL and the module runs its own
+ * flow. A good assertion is used up here.
+ */
+char * hopAccept(pam_handle_t * pamh, const char * user, long * expires) {
+        const char * rhost = NULL;
+        struct FleetRecord * rec = NULL, * taken = NULL;
+        char sshKey[8192], bound[8192];
+        char * payload = NULL, * claims = NULL, * inner = NULL;
+        unsigned char * sig = NULL;
+        int siglen = 0;
+
+        if (!options.hopTrust || !options.hopAudience || !options.fleet) return NULL;
+        if (pam_get_item(pamh, PAM_RHOST, (const void **)&rhost) != PAM_SUCCESS || rhost == NULL || !rhost[0])
+                return NULL;
+        if (authenticatedKey(pamh, sshKey, sizeof(sshKey)) < 0) return NULL;
+        if ((rec = calloc(1, sizeof(*rec))) == NULL || (taken = calloc(1, sizeof(*taken))) == NULL) goto out;
+
+        fleetInit();
+        snprintf(rec->key, sizeof(rec->key), "hop:%s:%s", user, rhost);
+        for (char * p = rec->key; *p; p++)
+                if (*p <= ' ') *p = '_';
+        if (fleetGet(options.fleet, fleetSecret, rec->key, rec) != 1 || rec->state != FLEET_APPROVED ||
+            rec->expires <= time(NULL))
+                goto out;
+
+        char * dot = strchr(rec->data, '.');
+        if (dot == NULL || loadCrypto() < 0) goto out;
+        sig = (unsigned char *)base64decodeLen(dot + 1, strlen(dot + 1), &siglen);
+        if (sig == NULL || siglen != ED25519_SIG_LEN || !trustedSignature(rec->data, dot - rec->data, sig)) {
+                fprintf(stderr, "hop assertion from %s: untrusted signature\n", rhost);
+                goto out;
+        }
+
+        payload = base64decode(rec->data, dot - rec->data);
+        size_t len = payload ? strlen(payload) + 1 : 0;
+        inner = payload ? malloc(len) : NULL;
+        char iss[256], aud[256], who[256];
+        time_t now = time(NULL);
+        long exp = payload ? getNumberClaim(payload, "exp", 0) : 0;
+        if (inner == NULL || !getClaim(payload, "iss", iss, sizeof(iss)) || strcmp(iss, rhost) ||
+            !getClaim(payload, "aud", aud, sizeof(aud)) || strcmp(aud, options.hopAudience) ||
+            !getClaim(payload, "user", who, sizeof(who)) || strcmp(who, user) ||
+            !getClaim(payload, "key", bound, sizeof(bound)) || strcmp(bound, sshKey) ||
+            exp + HOP_SKEW < now || getNumberClaim(payload, "iat", 0) > now + HOP_SKEW ||
+            !getClaim(payload, "claims", inner, len)) {
+                fprintf(stderr, "hop assertion from %s: not for %s with this key here, or expired\n", rhost, user);
+                goto out;
+        }
+
+        /* only the first login to take it gets in */
+        if (fleetTake(options.fleet, fleetSecret, rec->key, taken) != 1 || strcmp(taken->data, rec->data)) {
+                fprintf(stderr, "hop assertion from %s: already used\n", rhost);
+                goto out;
+        }
+        claims = base64decode(inner, strlen(inner));
+        if (claims) *expires = getNumberClaim(claims, "exp", now + HOP_LIFETIME);
+
+out:
+        free(inner);
+        free(payload);
+        free(sig);
+        free(taken);
+        free(rec);
+        return claims;
+}
@@ -0,0 +1,148 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: id token validation against the issuer's JWKS
+ *
+ * The login itself trusts the token endpoint's TLS response, which OIDC
+ * allows. Anything that hands out longer-lived proof on the strength of the
+ * token (SSH certificates) checks the signature, issuer, audience and expiry
+ * first. Only RS256 is supported, which is what Okta issues.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "deviceflow.h"
+#include "dynload.h"
+
+/* tolerated clock difference when checking exp */
+#define CLOCK_SKEW 60
+
+/* copy the JWK object whose kid matches into out; JWKs are flat objects */
+static int findKey(const char * jwks, const char * kid, char * out, size_t outlen) {
+        char pattern[300];
+        snprintf(pattern, sizeof(pattern), "\"%s\"", kid);
+
+        for (const char * p = strstr(jwks, pattern); p; p = strstr(p + 1, pattern)) {
+                const char * start = p, * end = p;
+                while (start > jwks && *start != '{') start--;
+                while (*end && *end != '}') end++;
+                if (*start != '{' || *end != '}' || (size_t)(end - start + 2) > outlen) continue;
+
+                memcpy(out, start, end - start + 1);
+                out[end - start + 1] = '\0';
+                char found[256];
+                if (getClaim(out, "kid", found, sizeof(found)) && !strcmp(found, kid)) return 0;
+        }
+        return -1;
+}
+
+static int verifyRS256(const char * jwk, const char * signedPart, size_t signedLen,
+                       const unsigned char * sig, size_t siglen) {
+        char n64[2048], e64[64];
+        if (getClaim(jwk, "n", n64, sizeof(n64)) == NULL || getClaim(jwk, "e", e64, sizeof(e64)) == NULL) return -1;
+
+        int nlen = 0, elen = 0, ok = 0;
+        unsigned char * n = (unsigned char *)base64decodeLen(n64, strlen(n64), &nlen);
+        unsigned char * e = (unsigned char *)base64decodeLen(e64, strlen(e64), &elen);
+        BIGNUM * bn = n ? cryptoApi.BN_bin2bn(n, nlen, NULL) : NULL;
+        BIGNUM * be = e ? cryptoApi.BN_bin2bn(e, elen, NULL) : NULL;
+        RSA * rsa = cryptoApi.RSA_new();
+        EVP_PKEY * pkey = cryptoApi.EVP_PKEY_new();
+        EVP_MD_CTX * ctx = cryptoApi.EVP_MD_CTX_new();
+
+        if (bn && be && rsa && pkey && ctx && cryptoApi.RSA_set0_key(rsa, bn, be, NULL) == 1) {
+                bn = be = NULL;     /* owned by rsa now */
+                if (cryptoApi.EVP_PKEY_assign(pkey, EVP_PKEY_RSA, rsa) == 1) {
+                        rsa = NULL; /* owned by pkey now */
+                        ok = cryptoApi.EVP_DigestVerifyInit(ctx, NULL, cryptoApi.EVP_sha256(), NULL, pkey) == 1 &&
+                             cryptoApi.EVP_DigestVerify(ctx, sig, siglen, (const unsigned char *)signedPart, signedLen) == 1;
+                }
+        }
+
+        if (ctx) cryptoApi.EVP_MD_CTX_free(ctx);
+        if (pkey) cryptoApi.EVP_PKEY_free(pkey);
+        if (rsa) cryptoApi.RSA_free(rsa);
+        if (bn) cryptoApi.BN_free(bn);
+        if (be) cryptoApi.BN_free(be);
+        free(n);
+        free(e);
+        return ok ? 0 : -1;
+}
+
+static int matchesAudience(const char * value, void * arg) {
+        return !strcmp(value, (const char *)arg);
+}
+
+/* returns the token's claims (caller frees) if it is genuine, current and meant for audience */
+char * verifyIdToken(const char * idtoken, const char * audience) {
+        const char * dot1 = strchr(idtoken, '.');
+        const char * dot2 = dot1 ? strchr(dot1 + 1, '.') : NULL;
+        if (dot2 == NULL || loadCrypto() < 0) return NULL;
+
+        char * header = base64decode(idtoken, dot1 - idtoken);
+        char alg[16], kid[256];
+        int ok = header && getClaim(header, "alg", alg, sizeof(alg)) && !strcmp(alg, "RS256") &&
+                 getClaim(header, "kid", kid, sizeof(kid));
+        free(header);
+        if (!ok) {
+                fprintf(stderr, "id token: unsupported header\n");
+                return NULL;
+        }
+
+        char jwk[16384];
+        char * jwks = loadJwks(0);
+        if (jwks == NULL || findKey(jwks, kid, jwk, sizeof(jwk)) < 0) {
+                free(jwks);
+                jwks = loadJwks(1);
+                if (jwks == NULL || findKey(jwks, kid, jwk, sizeof(jwk)) < 0) {
+                        fprintf(stderr, "id token: unknown signing key %s\n", kid);
+                        free(jwks);
+                        return NULL;
+                }
+        }
+        free(jwks);
+
+        int siglen = 0;
+        unsigned char * sig = (unsigned char *)base64decodeLen(dot2 + 1, strlen(dot2 + 1), &siglen);
+        ok = sig && verifyRS256(jwk, idtoken, dot2 - idtoken, sig, siglen) == 0;
+        free(sig);
+        if (!ok) {
+                fprintf(stderr, "id token: bad signature\n");
+                return NULL;
+        }
+
+        char * claims = base64decode(dot1 + 1, dot2 - dot1 - 1);
+        char value[1024];
+        if (claims == NULL) return NULL;
+        ok = getNumberClaim(claims, "exp", 0) + CLOCK_SKEW > time(NULL);
+        if (ok && options.issuer)
+                ok = getClaim(claims, "iss", value, sizeof(value)) && !strcmp(value, options.issuer);
+        if (ok)
+                ok = (getClaim(claims, "aud", value, sizeof(value)) && !strcmp(value, audience)) ||
+                     forEachClaimValue(claims, "aud", matchesAudience, (void *)audience);
+        if (!ok) {
+                fprintf(stderr, "id token: expired or not issued for us\n");
+                free(claims);
+                return NULL;
+        }
+        return claims;
+}
@@ -0,0 +1,232 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: token polling bookkeeping (RFC 8628 section 3.5)
+ *
+ * Pure state, no I/O and no clock of its own: callers pass in "now" from
+ * whatever dfClock they run on, so the PAM module and dfsim share this code.
+ * All times are milliseconds.
+ *
+ * The adaptive scheduler learns when people approve from a histogram shared
+ * by every login on the host (a small mmapped file, updated with atomics). It
+ * skips polls while an approval is unlikely and polls at the IdP's interval
+ * once it is likely, so the same approvals are seen with fewer requests.
+ * Flows that end unapproved are kept as censored samples and the estimate is
+ * Kaplan-Meier, so expired and abandoned logins do not make approvals look
+ * earlier than they are. The learning scheduler fills the histogram but
+ * polls like the fixed one.
+*******************************************************************************/
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "deviceflow.h"
+
+/* slow_down adds this to the interval, per RFC 8628 */
+#define SLOW_DOWN_STEP 5000
+
+static long long fixedNext(void * ctx, const struct PollState * ps, long long now) {
+        return now + ps->interval;
+}
+
+/* poll exactly every interval, what the module always did */
+const struct dfScheduler fixedScheduler = { "fixed", fixedNext, NULL, NULL, NULL };
+
+/* below this many recorded approvals the adaptive scheduler polls like the fixed one */
+#define HIST_MIN_SAMPLES 50
+/* halve the histogram at this many samples, so it follows changing habits */
+#define HIST_DECAY_AT 100000
+/* poll again once an approval in the gap is at least this likely... */
+#define ADAPTIVE_TARGET 0.10
+/* ...but never leave more than this many intervals between polls */
+#define ADAPTIVE_MAX_GAP 4
+
+/* map path, creating it if needed; NULL if it is not root's alone to write */
+struct ApprovalHist * approvalHistOpen(const char * path) {
+        struct stat st;
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) return NULL;
+        if (fstat(fd, &st) < 0 || st.st_uid != 0 || (st.st_mode & 022) ||
+            (st.st_size != sizeof(struct ApprovalHist) && ftruncate(fd, sizeof(struct ApprovalHist)) < 0)) {
+                close(fd);
+                return NULL;
+        }
+        struct ApprovalHist * h = mmap(NULL, sizeof(*h), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (h == MAP_FAILED) return NULL;
+
+        /* a fresh (zeroed) or foreign file starts over */
+        if (memcmp(h->magic, APPROVAL_HIST_MAGIC, sizeof(h->magic)) || h->bucketMs != APPROVAL_HIST_BUCKET_MS) {
+                memset(h, 0, sizeof(*h));
+                h->bucketMs = APPROVAL_HIST_BUCKET_MS;
+                memcpy(h->magic, APPROVAL_HIST_MAGIC, sizeof(h->magic));
+        }
+        return h;
+}
+
+void approvalHistClose(struct ApprovalHist * h) {
+        if (h) munmap(h, sizeof(*h));
+}
+
+/*
+ * Lock free and a little lossy: a decay racing with other updates can drop a
+ * handful of samples, which only nudges an estimate.
+ */
+void approvalHistAdd(struct ApprovalHist * h, long long after, int approved) {
+        uint32_t * counts = approved ? h->counts : h->censored;
+        long long b = after / APPROVAL_HIST_BUCKET_MS;
+        if (b < 0) b = 0;
+        if (b >= APPROVAL_HIST_BUCKETS) b = APPROVAL_HIST_BUCKETS - 1;
+        __atomic_fetch_add(&counts[b], 1, __ATOMIC_RELAXED);
+        if (__atomic_add_fetch(&h->total, 1, __ATOMIC_RELAXED) == HIST_DECAY_AT) {
+                uint32_t kept = 0;
+                for (int i = 0; i < APPROVAL_HIST_BUCKETS; i++) {
+                        uint32_t c = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+                        uint32_t n = __atomic_load_n(&h->censored[i], __ATOMIC_RELAXED);
+                        __atomic_fetch_sub(&h->counts[i], c / 2, __ATOMIC_RELAXED);
+                        __atomic_fetch_sub(&h->censored[i], n / 2, __ATOMIC_RELAXED);
+                        kept += c - c / 2 + n - n / 2;
+                }
+                __atomic_store_n(&h->total, kept, __ATOMIC_RELAXED);
+        }
+}
+
+/* share of flows approved before x ms, spreading each bucket evenly over its second */
+static double approvedBy(const double * cumulative, long long x) {
+        if (x <= 0) return 0;
+        long long b = x / APPROVAL_HIST_BUCKET_MS;
+        if (b >= APPROVAL_HIST_BUCKETS) return cumulative[APPROVAL_HIST_BUCKETS];
+        double part = (double)(x % APPROVAL_HIST_BUCKET_MS) / APPROVAL_HIST_BUCKET_MS;
+        return cumulative[b] + part * (cumulative[b + 1] - cumulative[b]);
+}
+
+/*
+ * With t ms since polling began, poll again at the first point from which
+ * ADAPTIVE_TARGET of the approvals still to come would already have happened.
+ */
+static long long adaptiveNext(void * ctx, const struct PollState * ps, long long now) {
+        const struct ApprovalHist * h = ctx;
+        double cumulative[APPROVAL_HIST_BUCKETS + 1];
+        uint32_t counts[APPROVAL_HIST_BUCKETS], censored[APPROVAL_HIST_BUCKETS];
+        double atRisk = 0, approvals = 0, unapproved = 1;
+
+        for (int i = 0; i < APPROVAL_HIST_BUCKETS; i++) {
+                counts[i] = __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+                censored[i] = __atomic_load_n(&h->censored[i], __ATOMIC_RELAXED);
+                atRisk += counts[i] + censored[i];
+                approvals += counts[i];
+        }
+        if (approvals < HIST_MIN_SAMPLES) return now + ps->minInterval;
+
+        /* Kaplan-Meier: a flow that gave up at t still counts as waiting until t */
+        cumulative[0] = 0;
+        for (int i = 0; i < APPROVAL_HIST_BUCKETS; i++) {
+                if (atRisk > 0) unapproved *= 1.0 - counts[i] / atRisk;
+                atRisk -= counts[i] + censored[i];
+                cumulative[i + 1] = 1.0 - unapproved;
+        }
+
+        long long t = now - ps->start;
+        long long lo = t + ps->minInterval, hi = t + ps->minInterval * ADAPTIVE_MAX_GAP;
+        double seen = approvedBy(cumulative, t);
+        double want = seen + ADAPTIVE_TARGET * (cumulative[APPROVAL_HIST_BUCKETS] - seen);
+
+        if (approvedBy(cumulative, lo) >= want) return ps->start + lo;
+        if (approvedBy(cumulative, hi) < want) return ps->start + hi;
+        while (hi - lo > 1) {
+                long long mid = lo + (hi - lo) / 2;
+                if (approvedBy(cumulative, mid) >= want) hi = mid;
+                else lo = mid;
+        }
+        return ps->start + hi;
+}
+
+static void histApproved(void * ctx, const struct PollState * ps, long long after) {
+        approvalHistAdd(ctx, after, 1);
+}
+
+static void histGaveUp(void * ctx, const struct PollState * ps, long long after) {
+        approvalHistAdd(ctx, after, 0);
+}
+
+/* record approvals, poll exactly like fixedScheduler */
+void learningScheduler(struct dfScheduler * sched, struct ApprovalHist * h) {
+        sched->name = "learn";
+        sched->nextPoll = fixedNext;
+        sched->approved = histApproved;
+        sched->gaveUp = histGaveUp;
+        sched->ctx = h;
+}
+
+void adaptiveScheduler(struct dfScheduler * sched, struct ApprovalHist * h) {
+        learningScheduler(sched, h);
+        sched->name = "adaptive";
+        sched->nextPoll = adaptiveNext;
+}
+
+void pollBegin(struct PollState * ps, const struct dfScheduler * sched, long long now,
+               long intervalSec, long expiresInSec) {
+        memset(ps, 0, sizeof(*ps));
+        ps->sched = sched;
+        ps->start = now;
+        ps->deadline = now + expiresInSec * 1000LL;
+        ps->interval = intervalSec * 1000LL;
+        ps->minInterval = ps->interval;
+        ps->nextPoll = now;         /* the user was just asked to press Enter, so look right away */
+}
+
+int pollExpired(const struct PollState * ps, long long now) {
+        return now >= ps->deadline;
+}
+
+/* record a token response; error is NULL on success, else the OAuth error code */
+int pollResult(struct PollState * ps, long long now, const char * error) {
+        long long previous = ps->polls ? ps->lastPoll : ps->start;
+        ps->polls++;
+        ps->lastPoll = now;
+
+        if (error == NULL) {
+                /* approved somewhere since the last look, call it halfway */
+                if (ps->sched->approved) ps->sched->approved(ps->sched->ctx, ps, (previous + now) / 2 - ps->start);
+                return POLL_DONE;
+        }
+        if (!strcmp(error, "slow_down")) {
+                ps->interval += SLOW_DOWN_STEP;
+                ps->minInterval = ps->interval;
+                ps->slowDowns++;
+        } else if (strcmp(error, "authorization_pending")) {
+                return POLL_FAILED;
+        }
+
+        long long next = ps->sched->nextPoll(ps->sched->ctx, ps, now);
+        /* whatever the policy, never faster than the IdP allows */
+        if (next < now + ps->minInterval) next = now + ps->minInterval;
+        /* and take one last look rather than sleep through the deadline */
+        if (next >= ps->deadline && now + ps->minInterval < ps->deadline) next = now + ps->minInterval;
+        ps->nextPoll = next;
+        return ps->nextPoll >= ps->deadline ? POLL_FAILED : POLL_AGAIN;
+}
+
+/* the flow ended without an approval: expired, denied or the user left */
+void pollGaveUp(const struct PollState * ps, long long now) {
+        if (ps->sched && ps->sched->gaveUp) ps->sched->gaveUp(ps->sched->ctx, ps, now - ps->start);
+}
@@ -15,6 +15,8 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "dynload.h"
+
 /* STDIN read buffer chunk size */
 #define STDIN_CHUNKSIZE 64
 
@@ -698,9 +700,13 @@ char * getQR(char * str)
 
     QRcode *qr;
 
+    if (loadQR() < 0) {
+        return NULL;
+    }
+
     /* Ensure QR Code contains UTF-8 BOM */
     if (str_has_utf8_bom(str)) {
-        qr = QRcode_encodeString(str, options.version,
+        qr = qrApi.encodeString(str, options.version,
                                  get_qr_ec_level(options.ec_level),
                                  get_qr_encode_mode(options.encode_mode), true);
     } else {
@@ -709,7 +715,7 @@ char * getQR(char * str)
         strncpy(str_utf8, utf8_bom, sizeof(str_utf8));
         strncat(str_utf8, str, sizeof(str_utf8));
         str_utf8[strlen(utf8_bom) + strlen(str)] = '\0';
-        qr = QRcode_encodeString(str_utf8, options.version,
+        qr = qrApi.encodeString(str_utf8, options.version,
                                  get_qr_ec_level(options.ec_level),
                                  get_qr_encode_mode(options.encode_mode), true);
     }
@@ -739,7 +745,7 @@ char * getQR(char * str)
 
     /* Clean up */
     if (qr != NULL) {
-        QRcode_free(qr);
+        qrApi.free(qr);
     }
     free(qr_code_text);
 
@@ -0,0 +1,133 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: picks the IdP, client and scopes for a login from the routing
+ *              table compiled by "dfcompile routes"
+ *
+ * Every candidate key is a hash probe and the source address is one walk down
+ * a bit trie, so a lookup costs the same with ten rules or ten thousand.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <grp.h>
+#include <pwd.h>
+#include <arpa/inet.h>
+
+#include "deviceflow.h"
+
+#define MAX_GROUPS 256
+
+struct Routes {
+        struct dfIndex idx;
+        const struct RouteHeader * hdr;
+        const uint32_t * ruleTenant;
+        const struct RouteTenant * tenants;
+        const struct RouteNode * nodes;
+};
+
+static int openRoutes(struct Routes * r, const char * path) {
+        size_t len = 0;
+        if (dfIndexOpen(&r->idx, path) < 0) return -1;
+
+        const struct RouteHeader * hdr = dfIndexTrailer(&r->idx, &len);
+        if (hdr == NULL || len < sizeof(*hdr) || memcmp(hdr->magic, ROUTES_MAGIC, sizeof(hdr->magic)) ||
+            len != sizeof(*hdr) + (size_t)hdr->nrules * 4 + (size_t)hdr->ntenants * sizeof(struct RouteTenant) +
+                   (size_t)hdr->nnodes * sizeof(struct RouteNode) || hdr->nnodes == 0) {
+                dfIndexClose(&r->idx);
+                return -1;
+        }
+        r->hdr = hdr;
+        r->ruleTenant = (const uint32_t *)(hdr + 1);
+        r->tenants = (const struct RouteTenant *)(r->ruleTenant + hdr->nrules);
+        r->nodes = (const struct RouteNode *)(r->tenants + hdr->ntenants);
+        return 0;
+}
+
+static void consider(const struct Routes * r, const char * kind, const char * pattern, size_t len, uint32_t * best) {
+        char key[1024];
+        uint32_t rule;
+        size_t keylen = routeKey(key, sizeof(key), kind, pattern, len);
+        if (keylen && dfIndexLookup(&r->idx, key, keylen, &rule) && rule < *best) *best = rule;
+}
+
+static void considerGroups(const struct Routes * r, const char * user, uint32_t * best) {
+        struct passwd * pw = getpwnam(user);
+        gid_t groups[MAX_GROUPS];
+        int n = MAX_GROUPS;
+
+        if (pw == NULL) return;
+        if (getgrouplist(user, pw->pw_gid, groups, &n) < 0) n = MAX_GROUPS;
+        for (int i = 0; i < n; i++) {
+                struct group * gr = getgrgid(groups[i]);
+                if (gr) consider(r, "group", gr->gr_name, strlen(gr->gr_name), best);
+        }
+}
+
+/* longest walk down the trie, keeping the best rule of every network passed */
+static void considerAddress(const struct Routes * r, const char * rhost, uint32_t * best) {
+        unsigned char addr[16];
+        struct in_addr v4;
+
+        if (inet_pton(AF_INET, rhost, &v4) == 1) {
+                memset(addr, 0, 10);
+                addr[10] = addr[11] = 0xff;
+                memcpy(addr + 12, &v4, 4);
+        } else if (inet_pton(AF_INET6, rhost, addr) != 1) {
+                return;
+        }
+
+        uint32_t node = 0;
+        for (int bit = 0; ; bit++) {
+                const struct RouteNode * n = &r->nodes[node];
+                if (n->rule && n->rule - 1 < *best) *best = n->rule - 1;
+                if (bit == 128) break;
+                node = n->child[(addr[bit / 8] >> (7 - bit % 8)) & 1];
+                if (node == 0 || node >= r->hdr->nnodes) break;
+        }
+}
+
+/* 1 and out filled if a rule matches, 0 if none does, -1 if the table is unusable */
+int routeLookup(const char * path, const char * user, const char * rhost, struct RouteTenant * out) {
+        struct Routes r;
+        uint32_t best = UINT32_MAX;
+        size_t len = strlen(user);
+
+        if (openRoutes(&r, path) < 0) return -1;
+
+        consider(&r, "user", user, len, &best);
+        for (size_t n = 0; n <= len; n++) consider(&r, "prefix", user, n, &best);
+        for (const char * d = strchr(user, '@'); d; d = strchr(d + 1, '.'))
+                consider(&r, "domain", d + 1, strlen(d + 1), &best);
+        considerGroups(&r, user, &best);
+        if (rhost && rhost[0]) considerAddress(&r, rhost, &best);
+
+        int found = 0;
+        if (best < r.hdr->nrules && r.ruleTenant[best] < r.hdr->ntenants) {
+                *out = r.tenants[r.ruleTenant[best]];
+                out->name[sizeof(out->name) - 1] = '\0';
+                out->issuer[sizeof(out->issuer) - 1] = '\0';
+                out->clientId[sizeof(out->clientId) - 1] = '\0';
+                out->scope[sizeof(out->scope) - 1] = '\0';
+                found = 1;
+        }
+        dfIndexClose(&r.idx);
+        return found;
+}
@@ -0,0 +1,270 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: keeps the identity from a successful device flow for the rest
+ *              of the login session, so sudo/su/account stacks can reuse it
+ *
+ * sshd may run pam_sm_authenticate in a throwaway process and only carries the
+ * PAM environment back, and the audit session id does not exist until
+ * pam_loginuid runs in the session stack. So authentication writes
+ *   SESSION_DIR/pending/<random handle>
+ * and exports the handle in DEVICEFLOW_HANDLE. open_session then moves the
+ * record to
+ *   SESSION_DIR/sessions/<audit session id>
+ * which anything later in that session (it inherits the session id, and only
+ * root can change it) can check with a single file read. The handle is taken
+ * out of the PAM environment once used, so it never reaches the user's shell.
+ *
+ * The move waits until pam_loginuid has made this a session of PAM_USER's
+ * (/proc/self/loginuid is their uid). Before that, e.g. in sshd's setcred,
+ * the session id may still be that of whoever started sshd.
+ *
+ * Remote logins never use the session record: an sshd started from an admin's
+ * shell hands that shell's session id to every connection it accepts. They
+ * only see what their own PAM handle carries.
+ *
+ * A record is "<expiry epoch>\n<login account>\n<id token claims>".
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+#include "deviceflow.h"
+
+/* a pending record nobody claimed within this long is swept */
+#define PENDING_TTL 600
+
+static void freeData(pam_handle_t *pamh, void *data, int error_status) {
+        free(data);
+}
+
+/* "4294967295" means no audit session, in which case nothing is cached */
+static int auditSession(char * out, size_t len) {
+        FILE * f = fopen("/proc/self/sessionid", "r");
+        unsigned long id;
+
+        if (f == NULL) return -1;
+        int n = fscanf(f, "%lu", &id);
+        fclose(f);
+        if (n != 1 || id == 4294967295UL) return -1;
+        snprintf(out, len, "%lu", id);
+        return 0;
+}
+
+static void makeDirs(void) {
+        char path[1024];
+        mkdir(SESSION_DIR, 0700);
+        snprintf(path, sizeof(path), "%s/pending", SESSION_DIR);
+        mkdir(path, 0700);
+        snprintf(path, sizeof(path), "%s/sessions", SESSION_DIR);
+        mkdir(path, 0700);
+}
+
+/* only trust records root wrote */
+static char * readRecord(const char * path) {
+        struct stat st;
+        FILE * f = fopen(path, "r");
+        if (f == NULL) return NULL;
+
+        if (fstat(fileno(f), &st) < 0 || st.st_uid != 0 || (st.st_mode & 077)) {
+                fclose(f);
+                return NULL;
+        }
+        char * record = calloc(1, st.st_size + 1);
+        if (record) fread(record, 1, st.st_size, f);
+        fclose(f);
+        return record;
+}
+
+static int writeRecord(const char * path, const char * record) {
+        char tmp[1024];
+        snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+
+        int fd = mkstemp(tmp);
+        if (fd < 0) return -1;
+        size_t len = strlen(record);
+        int ok = write(fd, record, len) == (ssize_t)len;
+        ok = (close(fd) == 0) && ok;
+        if (!ok || rename(tmp, path) < 0) {
+                unlink(tmp);
+                return -1;
+        }
+        return 0;
+}
+
+static void sweepPending(void) {
+        char dir[1024], path[1300];
+        snprintf(dir, sizeof(dir), "%s/pending", SESSION_DIR);
+
+        DIR * d = opendir(dir);
+        if (d == NULL) return;
+        struct dirent * e;
+        struct stat st;
+        time_t now = time(NULL);
+        while ((e = readdir(d)) != NULL) {
+                if (e->d_name[0] == '.') continue;
+                snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+                if (stat(path, &st) == 0 && st.st_mtime + PENDING_TTL < now) unlink(path);
+        }
+        closedir(d);
+}
+
+/* record from this handle, or from the file the handle's DEVICEFLOW_HANDLE names */
+static char * loginRecord(pam_handle_t * pamh) {
+        const void * data = NULL;
+        if (pam_get_data(pamh, "deviceflow_identity", &data) == PAM_SUCCESS && data)
+                return strdup(data);
+
+        const char * handle = pam_getenv(pamh, "DEVICEFLOW_HANDLE");
+        if (handle == NULL || strspn(handle, "0123456789abcdef") != strlen(handle)) return NULL;
+
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/pending/%s", SESSION_DIR, handle);
+        char * record = readRecord(path);
+        unlink(path);
+        /* sshd copies the PAM environment into the session, the handle has no business there */
+        pam_putenv(pamh, "DEVICEFLOW_HANDLE");
+        return record;
+}
+
+int saveLoginIdentity(pam_handle_t * pamh, const char * account, const char * claims, long expires) {
+        size_t len = strlen(account) + strlen(claims) + 32;
+        char * record = malloc(len);
+        if (record == NULL) return -1;
+        snprintf(record, len, "%ld\n%s\n%s", expires, account, claims);
+
+        /* same process (su, sudo, login) */
+        if (pam_set_data(pamh, "deviceflow_identity", strdup(record), freeData) != PAM_SUCCESS) {
+                free(record);
+                return -1;
+        }
+
+        /* sshd, where the session stack runs in a different process */
+        unsigned char rnd[16];
+        char handle[33], path[1024], who[256], env[sizeof(who) + 32];
+        if (getrandom(rnd, sizeof(rnd), 0) != sizeof(rnd)) {
+                free(record);
+                return -1;
+        }
+        for (int i = 0; i < 16; i++) sprintf(handle + 2 * i, "%02x", rnd[i]);
+
+        makeDirs();
+        sweepPending();
+        snprintf(path, sizeof(path), "%s/pending/%s", SESSION_DIR, handle);
+        if (writeRecord(path, record) == 0) {
+                snprintf(env, sizeof(env), "DEVICEFLOW_HANDLE=%s", handle);
+                pam_putenv(pamh, env);
+        }
+        free(record);
+
+        if (getClaim(claims, "preferred_username", who, sizeof(who)) ||
+            getClaim(claims, "sub", who, sizeof(who))) {
+                int n = snprintf(env, sizeof(env), "DEVICEFLOW_USER=%s", who);
+                if (n > 0 && (size_t)n < sizeof(env)) pam_putenv(pamh, env);
+        }
+        snprintf(env, sizeof(env), "DEVICEFLOW_EXPIRES=%ld", expires);
+        pam_putenv(pamh, env);
+        return 0;
+}
+
+/* has pam_loginuid made this process's session PAM_USER's own yet? */
+static int ownSession(pam_handle_t * pamh) {
+        const char * user = NULL;
+        unsigned long uid;
+
+        if (pam_get_item(pamh, PAM_USER, (const void **)&user) != PAM_SUCCESS || user == NULL) return 0;
+        struct passwd * pw = getpwnam(user);
+        FILE * f = fopen("/proc/self/loginuid", "r");
+        if (f == NULL) return 0;
+        int n = fscanf(f, "%lu", &uid);
+        fclose(f);
+        return n == 1 && pw && uid == pw->pw_uid;
+}
+
+int bindSessionIdentity(pam_handle_t * pamh) {
+        char sid[32], path[1024];
+        /* leave the handle for a later call that runs in the right session */
+        if (!ownSession(pamh) || auditSession(sid, sizeof(sid)) < 0) return -1;
+
+        snprintf(path, sizeof(path), "%s/sessions/%s", SESSION_DIR, sid);
+        char * record = loginRecord(pamh);
+        if (record == NULL) return -1;
+
+        makeDirs();
+        int rc = writeRecord(path, record);
+        free(record);
+        return rc;
+}
+
+void dropSessionIdentity(pam_handle_t * pamh) {
+        char sid[32], path[1024];
+        if (!ownSession(pamh) || auditSession(sid, sizeof(sid)) < 0) return;
+        snprintf(path, sizeof(path), "%s/sessions/%s", SESSION_DIR, sid);
+        unlink(path);
+}
+
+/* a login arriving over the network, as opposed to sudo/su inside a session */
+static int remoteLogin(pam_handle_t * pamh) {
+        const char * service = NULL, * rhost = NULL;
+        if (pam_get_item(pamh, PAM_SERVICE, (const void **)&service) == PAM_SUCCESS && service &&
+            !strcmp(service, "sshd"))
+                return 1;
+        return pam_get_item(pamh, PAM_RHOST, (const void **)&rhost) == PAM_SUCCESS && rhost && rhost[0];
+}
+
+/*
+ * Accept account if this session holds an unexpired identity for it. Acting as
+ * a different account (sudo to root) additionally needs the principal policy.
+ */
+int cachedIdentityAllows(pam_handle_t * pamh, const char * account) {
+        char sid[32], path[1024];
+        char * record = NULL;
+        const void * data = NULL;
+
+        if (pam_get_data(pamh, "deviceflow_identity", &data) == PAM_SUCCESS && data) {
+                record = strdup(data);
+        } else if (!remoteLogin(pamh) && auditSession(sid, sizeof(sid)) == 0) {
+                snprintf(path, sizeof(path), "%s/sessions/%s", SESSION_DIR, sid);
+                record = readRecord(path);
+        }
+        if (record == NULL) return 0;
+
+        int allowed = 0;
+        char * login = strchr(record, '\n');
+        char * claims = login ? strchr(login + 1, '\n') : NULL;
+        if (claims && strtol(record, NULL, 10) > time(NULL)) {
+                *claims++ = '\0';
+                login++;
+                if (!strcmp(login, account)) allowed = 1;
+                else if (options.principals) allowed = authorizePrincipal(claims, account);
+        }
+        free(record);
+        return allowed;
+}
@@ -0,0 +1,323 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: short-lived OpenSSH user certificates after a device flow
+ *
+ * With cert_ca=<CA private key>, a login whose id token verifies gets a
+ * certificate for the public key the client presented, principal PAM_USER,
+ * key id "deviceflow:<IdP identity>", valid for cert_lifetime seconds.
+ *
+ * Only a key the client proved it holds is certified: the one in
+ * SSH_AUTH_INFO_0, which sshd fills in (ExposeAuthInfo) when publickey
+ * already ran (AuthenticationMethods publickey,keyboard-interactive). The
+ * certificate only works from the address the login came from
+ * (source-address=PAM_RHOST). Signing is left to ssh-keygen.
+ *
+ * sshd trusts the CA through TrustedUserCAKeys and checks the certificate's
+ * signature, principal, validity and source address in the publickey step.
+ * When SSH_AUTH_INFO_0 then shows that step used a certificate from cert_ca,
+ * keyboard-interactive succeeds at once (certifiedLogin): until it expires a
+ * certificate stands for a recent device flow, with no IdP traffic.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include <security/pam_appl.h>
+
+#include "deviceflow.h"
+#include "dynload.h"
+
+#define SSH_KEYGEN "/usr/bin/ssh-keygen"
+
+/*
+ * "type base64 [comment]" -> "type base64"; -1 if it does not look like an
+ * OpenSSH public key. Certificates are refused: they are not keys to sign.
+ */
+static int cleanPublicKey(const char * in, char * out, size_t outlen) {
+        const char * p = in;
+        while (*p == ' ') p++;
+        const char * type = p;
+        while (*p && (isalnum((unsigned char)*p) || strchr("@.-", *p))) p++;
+        if (p == type || *p != ' ') return -1;
+
+        p++;
+        const char * blob = p;
+        while (*p && (isalnum((unsigned char)*p) || *p == '+' || *p == '/')) p++;
+        while (*p == '=') p++;
+        if (p - blob < 32 || (*p && *p != ' ' && *p != '\n')) return -1;
+
+        if ((size_t)(p - type) + 1 > outlen) return -1;
+        memcpy(out, type, p - type);
+        out[p - type] = '\0';
+        if (strstr(out, "-cert-")) return -1;
+        return strncmp(out, "ssh-", 4) && strncmp(out, "ecdsa-", 6) && strncmp(out, "sk-", 3) ? -1 : 0;
+}
+
+/* the key publickey auth already proved possession of, if sshd tells us (ExposeAuthInfo) */
+int authenticatedKey(pam_handle_t * pamh, char * out, size_t outlen) {
+        const char * info = pam_getenv(pamh, "SSH_AUTH_INFO_0");
+        for (const char * line = info; line && *line; ) {
+                if (!strncmp(line, "publickey ", 10) && cleanPublicKey(line + 10, out, outlen) == 0) return 0;
+                line = strchr(line, '\n');
+                if (line) line++;
+        }
+        return -1;
+}
+
+/* "type base64" -> "SHA256:...", as ssh-keygen -l and sshd's log show it */
+int sshKeyFingerprint(const char * key, char * out, size_t outlen) {
+        static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        const char * blob = strchr(key, ' ');
+        unsigned char md[32];
+        unsigned int mdlen = 0;
+        int len = 0;
+
+        if (!blob || outlen < 7 + 43 + 1 || loadCrypto() < 0) return -1;
+        unsigned char * raw = (unsigned char *)base64decodeLen(blob + 1, strcspn(blob + 1, " \r\n"), &len);
+        if (!raw) return -1;
+        int ok = len > 0 && cryptoApi.EVP_Digest(raw, len, md, &mdlen, cryptoApi.EVP_sha256(), NULL) == 1 && mdlen == sizeof(md);
+        free(raw);
+        if (!ok) return -1;
+
+        char * o = out + sprintf(out, "SHA256:");
+        for (int i = 0; i < 32; i += 3) {
+                unsigned long v = (unsigned long)md[i] << 16 | (i + 1 < 32 ? md[i + 1] << 8 : 0) | (i + 2 < 32 ? md[i + 2] : 0);
+                int chars = i + 2 < 32 ? 4 : i + 1 < 32 ? 3 : 2;
+                for (int k = 0; k < chars; k++) *o++ = b64[v >> (18 - 6 * k) & 63];
+        }
+        *o = '\0';
+        return 0;
+}
+
+/* reads SSH wire format (RFC 4251 5) out of a decoded key blob */
+struct Wire {
+        const unsigned char * p;
+        size_t left;
+};
+
+static int wireString(struct Wire * w, const unsigned char ** s, size_t * len) {
+        if (w->left < 4) return -1;
+        size_t n = (size_t)w->p[0] << 24 | w->p[1] << 16 | w->p[2] << 8 | w->p[3];
+        if (n > w->left - 4) return -1;
+        if (s) *s = w->p + 4;
+        if (len) *len = n;
+        w->p += 4 + n;
+        w->left -= 4 + n;
+        return 0;
+}
+
+static int wireUint64(struct Wire * w, unsigned long long * v) {
+        if (w->left < 8) return -1;
+        *v = 0;
+        for (int i = 0; i < 8; i++) *v = *v << 8 | w->p[i];
+        w->p += 8;
+        w->left -= 8;
+        return 0;
+}
+
+/* public key fields between the nonce and the serial of a certificate (PROTOCOL.certkeys) */
+static int certKeyFields(const char * type) {
+        static const struct { const char * prefix; int fields; } kinds[] = {
+                { "ssh-rsa-", 2 }, { "ssh-dss-", 4 }, { "ecdsa-", 2 }, { "ssh-ed25519-", 1 },
+                { "sk-ecdsa-", 3 }, { "sk-ssh-ed25519-", 2 },
+        };
+        for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+                if (!strncmp(type, kinds[i].prefix, strlen(kinds[i].prefix))) return kinds[i].fields;
+        return -1;
+}
+
+/* the CA's public key blob from cert_ca.pub; caller frees */
+static unsigned char * caKey(int * len) {
+        char path[1024], line[8192];
+        struct stat st;
+
+        snprintf(path, sizeof(path), "%s.pub", options.certCa);
+        FILE * f = fopen(path, "r");
+        if (f == NULL) return NULL;
+        /* whoever can replace it could vouch for anyone */
+        int ok = fstat(fileno(f), &st) == 0 && st.st_uid == 0 && !(st.st_mode & 022) && fgets(line, sizeof(line), f);
+        fclose(f);
+        char * blob = ok ? strchr(line, ' ') : NULL;
+        if (blob == NULL) return NULL;
+        blob++;
+        return (unsigned char *)base64decodeLen(blob, strcspn(blob, " \r\n"), len);
+}
+
+/* is "type base64" a user certificate from our CA for user, valid now? */
+static int ourCertificate(const char * key, const char * user, const unsigned char * ca, int caLen) {
+        const char * blob = strchr(key, ' ');
+        if (blob == NULL || !strstr(key, "-cert-v01@openssh.com ")) return 0;
+        int len = 0, ok = 0;
+        unsigned char * raw = (unsigned char *)base64decodeLen(blob + 1, strcspn(blob + 1, " \r\n"), &len);
+        if (raw == NULL) return 0;
+
+        struct Wire w = { raw, len };
+        const unsigned char * s, * principals, * signer;
+        size_t n, principalsLen, signerLen;
+        unsigned long long serial, validAfter, validBefore;
+        char type[64];
+        int fields = -1;
+        if (wireString(&w, &s, &n) == 0 && n < sizeof(type)) {
+                memcpy(type, s, n);
+                type[n] = '\0';
+                fields = certKeyFields(type);
+        }
+        int parsed = fields > 0 && wireString(&w, NULL, NULL) == 0;      /* nonce */
+        for (int i = 0; parsed && i < fields; i++) parsed = wireString(&w, NULL, NULL) == 0;
+        parsed = parsed && wireUint64(&w, &serial) == 0 && w.left >= 4;
+        /* type 1 is a user certificate, 2 a host certificate */
+        parsed = parsed && w.p[0] == 0 && w.p[1] == 0 && w.p[2] == 0 && w.p[3] == 1;
+        if (parsed) {
+                w.p += 4;
+                w.left -= 4;
+        }
+        parsed = parsed && wireString(&w, NULL, NULL) == 0 &&                   /* key id */
+                 wireString(&w, &principals, &principalsLen) == 0 &&
+                 wireUint64(&w, &validAfter) == 0 && wireUint64(&w, &validBefore) == 0 &&
+                 wireString(&w, NULL, NULL) == 0 && wireString(&w, NULL, NULL) == 0 &&     /* options, extensions */
+                 wireString(&w, NULL, NULL) == 0 &&                             /* reserved */
+                 wireString(&w, &signer, &signerLen) == 0;
+
+        unsigned long long now = time(NULL);
+        if (parsed && signerLen == (size_t)caLen && !memcmp(signer, ca, caLen) && validAfter <= now && now < validBefore) {
+                struct Wire p = { principals, principalsLen };
+                while (!ok && wireString(&p, &s, &n) == 0)
+                        ok = n == strlen(user) && !memcmp(s, user, n);
+        }
+        free(raw);
+        return ok;
+}
+
+/*
+ * 1 if publickey already logged user in with a certificate cert_ca signed.
+ * sshd has checked it by then; this only decides the certificate is ours.
+ */
+int certifiedLogin(pam_handle_t * pamh, const char * user) {
+        if (options.certCa == NULL) return 0;
+        const char * info = pam_getenv(pamh, "SSH_AUTH_INFO_0");
+        int caLen = 0, ok = 0;
+        unsigned char * ca = info ? caKey(&caLen) : NULL;
+        for (const char * line = info; ca && !ok && line && *line; ) {
+                if (!strncmp(line, "publickey ", 10)) ok = ourCertificate(line + 10, user, ca, caLen);
+                line = strchr(line, '\n');
+                if (line) line++;
+        }
+        free(ca);
+        return ok;
+}
+
+static int runKeygen(char * const argv[]) {
+        pid_t pid = fork();
+        if (pid < 0) return -1;
+        if (pid == 0) {
+                int devnull = open("/dev/null", O_RDWR);
+                dup2(devnull, 0);
+                dup2(devnull, 1);
+                dup2(devnull, 2);
+                char * envp[] = { "PATH=/usr/bin:/bin", NULL };
+                execve(SSH_KEYGEN, argv, envp);
+                _exit(127);
+        }
+        int status;
+        while (waitpid(pid, &status, 0) < 0) {
+                if (errno != EINTR) return -1;
+        }
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+int issueCertificate(pam_handle_t * pamh, const char * user, const char * idtoken) {
+        char * claims = verifyIdToken(idtoken, options.clientId);
+        if (claims == NULL) return -1;
+
+        const char * rhost = NULL;
+        unsigned char addr[sizeof(struct in6_addr)];
+        char who[256], identity[300], pubkey[8192], source[300];
+        if (getClaim(claims, "preferred_username", who, sizeof(who)) == NULL &&
+            getClaim(claims, "sub", who, sizeof(who)) == NULL) {
+                strcpy(who, "unknown");
+        }
+        free(claims);
+        snprintf(identity, sizeof(identity), "deviceflow:%s", who);
+        if (authenticatedKey(pamh, pubkey, sizeof(pubkey)) < 0) return -1;
+        /* a host name here would be whatever the client's reverse DNS says */
+        if (pam_get_item(pamh, PAM_RHOST, (const void **)&rhost) != PAM_SUCCESS || rhost == NULL ||
+            (inet_pton(AF_INET, rhost, addr) != 1 && inet_pton(AF_INET6, rhost, addr) != 1)) {
+                return -1;
+        }
+        snprintf(source, sizeof(source), "source-address=%s", rhost);
+
+        char dir[] = "/tmp/deviceflow.XXXXXX";
+        if (mkdtemp(dir) == NULL) return -1;
+
+        char keyPath[64], certPath[64], validity[64], serial[32];
+        snprintf(keyPath, sizeof(keyPath), "%s/key.pub", dir);
+        snprintf(certPath, sizeof(certPath), "%s/key-cert.pub", dir);
+        /* a little slack in the past for clients whose clocks run slow */
+        snprintf(validity, sizeof(validity), "-5m:+%lds", options.certLifetime);
+        snprintf(serial, sizeof(serial), "%lld", (long long)time(NULL));
+
+        int rc = -1;
+        FILE * f = fopen(keyPath, "w");
+        if (f) {
+                fprintf(f, "%s\n", pubkey);
+                if (fclose(f) == 0) {
+                        char * argv[] = { "ssh-keygen", "-q", "-s", (char *)options.certCa, "-I", identity,
+                                          "-n", (char *)user, "-V", validity, "-z", serial, "-O", source, keyPath, NULL };
+                        rc = runKeygen(argv);
+                }
+        }
+
+        char cert[16384], message[17000];
+        size_t len = 0;
+        if (rc == 0 && (f = fopen(certPath, "r")) != NULL) {
+                len = fread(cert, 1, sizeof(cert) - 1, f);
+                fclose(f);
+        }
+        cert[len] = '\0';
+        if (rc == 0 && len > 0) {
+                /* drop ssh-keygen's comment, it is our temporary file name */
+                char * space = strchr(cert, ' ');
+                if (space) space = strchr(space + 1, ' ');
+                if (space) *space = '\0';
+                cert[strcspn(cert, "\n")] = '\0';
+                snprintf(message, sizeof(message),
+                         "\nSSH certificate for %s, valid %ld minutes. Save this line as <your key>-cert.pub\n"
+                         "next to the private key to log in without a device flow until it expires:\n\n%s\n",
+                         user, options.certLifetime / 60, cert);
+                convInfo(pamh, message);
+        } else {
+                rc = -1;
+                fprintf(stderr, "could not sign certificate with %s\n", options.certCa);
+        }
+
+        unlink(certPath);
+        unlink(keyPath);
+        rmdir(dir);
+        return rc;
+}
@@ -0,0 +1,202 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: a pending login gives up when the SSH client or sshd does
+ *
+ * The client connection is a loopback TCP pair named by SSH_CONNECTION, its
+ * far end held by a child that exits on cue. Like login_test this skips
+ * unless run as root.
+*******************************************************************************/
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+#include "deviceflow.h"
+#include "tests/check.h"
+#include "tests/fakepam.h"
+#include "tests/idp.h"
+
+static int converse(int n, const struct pam_message ** msg, struct pam_response ** resp, void * appdata) {
+        *resp = calloc(n, sizeof(**resp));
+        if (*resp == NULL) return PAM_BUF_ERR;
+        for (int i = 0; i < n; i++)
+                if (msg[i]->msg_style == PAM_PROMPT_ECHO_ON) (*resp)[i].resp = strdup("");
+        return PAM_SUCCESS;
+}
+
+static const struct pam_conv conv = { converse, NULL };
+static char issuer[128], issuerArg[160], cacheArg[600];
+static int listener = -1;
+static volatile sig_atomic_t terms;
+
+static void countTerm(int sig) {
+        terms++;
+}
+
+static long long nowMs(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * A connected pair: *near is the "sshd" end kept here, the returned fd the
+ * "client" end, whose port goes into SSH_CONNECTION when it is the client.
+ */
+static int connection(int * near, int * port) {
+        struct sockaddr_in sin;
+        socklen_t len = sizeof(sin);
+        if (listener < 0) {
+                listener = socket(AF_INET, SOCK_STREAM, 0);
+                memset(&sin, 0, sizeof(sin));
+                sin.sin_family = AF_INET;
+                sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                if (bind(listener, (struct sockaddr *)&sin, sizeof(sin)) < 0 || listen(listener, 4) < 0) return -1;
+        }
+        getsockname(listener, (struct sockaddr *)&sin, &len);
+        int far = socket(AF_INET, SOCK_STREAM, 0);
+        if (far < 0 || connect(far, (struct sockaddr *)&sin, sizeof(sin)) < 0) return -1;
+        len = sizeof(sin);
+        getsockname(far, (struct sockaddr *)&sin, &len);
+        *port = ntohs(sin.sin_port);
+        *near = accept(listener, NULL, NULL);
+        return far;
+}
+
+/* a child that holds fd for ms and then exits, closing it; fd is closed here */
+static pid_t closeLater(int fd, int ms) {
+        pid_t pid = fork();
+        if (pid == 0) {
+                usleep(ms * 1000);
+                _exit(0);
+        }
+        close(fd);
+        return pid;
+}
+
+/* a child that sends us sig after ms */
+static pid_t signalLater(int sig, int ms) {
+        pid_t parent = getpid(), pid = fork();
+        if (pid == 0) {
+                usleep(ms * 1000);
+                kill(parent, sig);
+                _exit(0);
+        }
+        return pid;
+}
+
+static void clientAt(int port) {
+        char conn[64];
+        snprintf(conn, sizeof(conn), "127.0.0.1 %d 127.0.0.1 22", port);
+        fakePamEnv("SSH_CONNECTION", conn);
+}
+
+/* one login whose token endpoint answers replies in turn; its PAM result and how long it took */
+static int login(const struct IdpReply * replies, int n, long long * took) {
+        static char discovery[1024];
+        snprintf(discovery, sizeof(discovery),
+                 "{\"issuer\":\"%s\",\"device_authorization_endpoint\":\"%s/auth\",\"token_endpoint\":\"%s/token\"}",
+                 issuer, issuer, issuer);
+        idpReset("{\"device_code\":\"dc\",\"user_code\":\"A\",\"verification_uri\":\"https://idp.test/a\","
+                 "\"interval\":1,\"expires_in\":60}", replies, n);
+        idpRoute("/.well-known/openid-configuration", "Cache-Control: max-age=600\r\n", discovery);
+
+        pid_t idp = fork();
+        if (idp == 0) idpServe();
+        const char * argv[] = { issuerArg, cacheArg };
+        long long start = nowMs();
+        int rc = pam_sm_authenticate(NULL, 0, 2, argv);
+        *took = nowMs() - start;
+        kill(idp, SIGKILL);
+        waitpid(idp, NULL, 0);
+        return rc;
+}
+
+int main(void) {
+        if (geteuid() != 0 || getenv("TEST_DIR") == NULL) {
+                printf("skip: needs root and tests/run.sh\n");
+                return TEST_SKIP;
+        }
+        if (idpStart() < 0) {
+                printf("skip: no loopback socket\n");
+                return TEST_SKIP;
+        }
+        snprintf(issuer, sizeof(issuer), "http://127.0.0.1:%d", idpPort);
+        snprintf(issuerArg, sizeof(issuerArg), "issuer=%s", issuer);
+        snprintf(cacheArg, sizeof(cacheArg), "cache_dir=%s/abort-cache", getenv("TEST_DIR"));
+        fakePamItem(PAM_USER, "alice");
+        fakePamItem(PAM_CONV, (const char *)&conv);
+
+        const struct IdpReply pending[] = { { 400, "{\"error\":\"authorization_pending\"}" } };
+        int near, port;
+        long long took;
+
+        /* the client hangs up a second into a flow nobody approves */
+        int far = connection(&near, &port);
+        if (far < 0) {
+                printf("skip: no loopback connection\n");
+                return TEST_SKIP;
+        }
+        clientAt(port);
+        pid_t client = closeLater(far, 1000);
+        int rc = login(pending, 1, &took);
+        waitpid(client, NULL, 0);
+        CHECK(rc == PAM_ABORT, "a client hangup aborts the login");
+        CHECK(took < 5000, "within a poll or so, not at expires_in");
+        close(near);
+
+        /* LoginGraceTime: sshd's SIGALRM, or a SIGTERM, does the same, and sshd gets the signal back */
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = countTerm;
+        sigaction(SIGTERM, &sa, NULL);
+        fakePamEnv("SSH_CONNECTION", NULL);
+        pid_t killer = signalLater(SIGTERM, 1000);
+        rc = login(pending, 1, &took);
+        waitpid(killer, NULL, 0);
+        CHECK(rc == PAM_ABORT && took < 5000, "a SIGTERM aborts the login");
+        CHECK(terms == 1, "and is raised again for sshd's own handler");
+
+        /* some other connection to the client's address closing is not the client leaving */
+        int otherNear, otherPort;
+        int other = connection(&otherNear, &otherPort);
+        far = connection(&near, &port);
+        clientAt(port);
+        client = closeLater(other, 500);
+        const struct IdpReply denied[] = { { 400, "{\"error\":\"authorization_pending\"}" },
+                                           { 400, "{\"error\":\"access_denied\"}" } };
+        rc = login(denied, 2, &took);
+        waitpid(client, NULL, 0);
+        CHECK(rc == PAM_AUTH_ERR, "another socket closing leaves the flow to finish");
+        close(far);
+        close(near);
+        close(otherNear);
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,137 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: the approval histogram and the schedulers that learn from it
+ *
+ * The histogram file must be root owned, so that part skips unless run as
+ * root under tests/run.sh.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "deviceflow.h"
+#include "tests/check.h"
+
+static long histApprovals(const struct ApprovalHist * h) {
+        long n = 0;
+        for (int i = 0; i < APPROVAL_HIST_BUCKETS; i++) n += h->counts[i];
+        return n;
+}
+
+static long histCensored(const struct ApprovalHist * h) {
+        long n = 0;
+        for (int i = 0; i < APPROVAL_HIST_BUCKETS; i++) n += h->censored[i];
+        return n;
+}
+
+static void learning(void) {
+        static struct ApprovalHist hist;
+        struct dfScheduler learn;
+        struct PollState a, b;
+
+        learningScheduler(&learn, &hist);
+        pollBegin(&a, &learn, 0, 5, 600);
+        pollBegin(&b, &fixedScheduler, 0, 5, 600);
+        for (long long t = 0; t < 60000; t += 5000) {
+                pollResult(&a, t, "authorization_pending");
+                pollResult(&b, t, "authorization_pending");
+        }
+        CHECK(a.nextPoll == b.nextPoll, "learn polls like fixed");
+        pollResult(&a, 60000, NULL);
+        CHECK(histApprovals(&hist) == 1 && hist.counts[57] == 1, "learn records the approval halfway since the last poll");
+
+        pollBegin(&a, &learn, 0, 5, 600);
+        pollGaveUp(&a, 30000);
+        CHECK(histCensored(&hist) == 1 && hist.censored[30] == 1, "an abandoned flow is recorded as censored");
+        pollGaveUp(&b, 30000);
+        CHECK(histCensored(&hist) == 1, "fixed records nothing");
+}
+
+static void adaptive(void) {
+        static struct ApprovalHist hist, quiet;
+        struct dfScheduler sched;
+        struct PollState ps;
+
+        adaptiveScheduler(&sched, &hist);
+        pollBegin(&ps, &sched, 0, 5, 600);
+        pollResult(&ps, 0, "authorization_pending");
+        CHECK(ps.nextPoll == 5000, "an empty histogram polls every interval");
+
+        /* everyone approves about a minute in */
+        for (int i = 0; i < 200; i++) approvalHistAdd(&hist, 60000 + i * 10, 1);
+        pollBegin(&ps, &sched, 0, 5, 600);
+        pollResult(&ps, 0, "authorization_pending");
+        CHECK(ps.nextPoll == 20000, "early on it waits the longest gap");
+        pollResult(&ps, 55000, "authorization_pending");
+        CHECK(ps.nextPoll > 60000 && ps.nextPoll <= 61000, "it looks again just after the usual approval");
+        pollResult(&ps, 57000, "slow_down");
+        CHECK(ps.nextPoll >= 67000, "never faster than the IdP allows");
+
+        /* lots of flows that never got an approval are not approvals */
+        adaptiveScheduler(&sched, &quiet);
+        for (int i = 0; i < 400; i++) approvalHistAdd(&quiet, 60000, 0);
+        for (int i = 0; i < 10; i++) approvalHistAdd(&quiet, 60000, 1);
+        pollBegin(&ps, &sched, 0, 5, 600);
+        pollResult(&ps, 0, "authorization_pending");
+        CHECK(ps.nextPoll == 5000, "censored samples do not make a histogram usable");
+}
+
+static void histFile(void) {
+        char path[512];
+        snprintf(path, sizeof(path), "%s/approval.hist", getenv("TEST_DIR"));
+
+        struct ApprovalHist * h = approvalHistOpen(path);
+        CHECK(h != NULL && histApprovals(h) == 0 && !memcmp(h->magic, APPROVAL_HIST_MAGIC, sizeof(h->magic)),
+              "a new file starts empty");
+        if (h == NULL) return;
+        approvalHistAdd(h, 12345, 1);
+        approvalHistAdd(h, -5, 0);
+        approvalHistAdd(h, 3600000, 1);
+        CHECK(h->counts[12] == 1 && h->censored[0] == 1 && h->counts[APPROVAL_HIST_BUCKETS - 1] == 1,
+              "samples land in their bucket, the ends clamped");
+        approvalHistClose(h);
+
+        h = approvalHistOpen(path);
+        CHECK(h && histApprovals(h) == 2 && h->total == 3, "and are there when the file is mapped again");
+        h->bucketMs = 500;
+        approvalHistClose(h);
+        h = approvalHistOpen(path);
+        CHECK(h && histApprovals(h) == 0 && h->bucketMs == APPROVAL_HIST_BUCKET_MS, "another layout starts over");
+
+        for (int i = 0; i < 99999; i++) approvalHistAdd(h, 30000, 1);
+        CHECK(h->counts[30] == 99999, "no decay before the limit");
+        approvalHistAdd(h, 30000, 0);
+        CHECK(h->counts[30] == 50000 && h->censored[30] == 1 && h->total == 50001, "at the limit everything halves");
+        approvalHistClose(h);
+
+        chmod(path, 0666);
+        CHECK(approvalHistOpen(path) == NULL, "a file others can write is not used");
+}
+
+int main(void) {
+        learning();
+        adaptive();
+        if (geteuid() == 0 && getenv("TEST_DIR")) histFile();
+        else printf("skip: histogram file needs root and tests/run.sh\n");
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,40 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: the little the tests need to report, see run.sh
+ *
+ * Each test prints one "ok" or "FAIL" line per check and exits non-zero if
+ * anything failed, or with TEST_SKIP if it cannot run here.
+*******************************************************************************/
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+
+#define TEST_SKIP 77
+
+static int failures;
+
+#define CHECK(cond, what) do { \
+        if (cond) printf("ok   %s\n", what); \
+        else { printf("FAIL %s (%s:%d)\n", what, __FILE__, __LINE__); failures++; } \
+} while (0)
+
+#endif
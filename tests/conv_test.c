@@ -0,0 +1,102 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: conv.c puts queued info messages and a prompt in one exchange
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+#include "deviceflow.h"
+#include "tests/check.h"
+#include "tests/fakepam.h"
+
+static int calls, lastN, lastStyles[16], convResult;
+static char lastText[1024];
+
+/* records what one exchange carried; answers every prompt with "yes" */
+static int converse(int n, const struct pam_message ** msg, struct pam_response ** resp, void * appdata) {
+        calls++;
+        lastN = n;
+        lastText[0] = '\0';
+        for (int i = 0; i < n && i < 16; i++) {
+                lastStyles[i] = msg[i]->msg_style;
+                strncat(lastText, msg[i]->msg, sizeof(lastText) - strlen(lastText) - 2);
+                strcat(lastText, "|");
+        }
+        if (convResult != PAM_SUCCESS) return convResult;
+        *resp = calloc(n, sizeof(**resp));
+        if (*resp == NULL) return PAM_BUF_ERR;
+        for (int i = 0; i < n; i++)
+                if (msg[i]->msg_style == PAM_PROMPT_ECHO_ON) (*resp)[i].resp = strdup("yes");
+        return PAM_SUCCESS;
+}
+
+static const struct pam_conv conv = { converse, NULL };
+
+int main(void) {
+        char * answer;
+        fakePamItem(PAM_CONV, (const char *)&conv);
+
+        CHECK(convFlush(NULL) == PAM_SUCCESS && calls == 0, "nothing queued, no exchange");
+
+        convInfo(NULL, "qr");
+        convInfo(NULL, "Please login at x");
+        CHECK(calls == 0, "info messages wait for a prompt");
+        int rc = convPrompt(NULL, PAM_PROMPT_ECHO_ON, "Press Enter", &answer);
+        CHECK(rc == PAM_SUCCESS && calls == 1 && lastN == 3, "and go out with it in one exchange");
+        CHECK(!strcmp(lastText, "qr|Please login at x|Press Enter|") && lastStyles[0] == PAM_TEXT_INFO &&
+              lastStyles[2] == PAM_PROMPT_ECHO_ON, "in order, the prompt last");
+        CHECK(answer && !strcmp(answer, "yes"), "the prompt's reply comes back");
+        free(answer);
+
+        rc = convPrompt(NULL, PAM_PROMPT_ECHO_ON, "again", &answer);
+        CHECK(rc == PAM_SUCCESS && lastN == 1, "the queue was emptied");
+        free(answer);
+
+        convInfo(NULL, "Welcome");
+        CHECK(convFlush(NULL) == PAM_SUCCESS && calls == 3 && lastN == 1 && lastStyles[0] == PAM_TEXT_INFO,
+              "a flush delivers what is left");
+
+        calls = 0;
+        char line[16];
+        for (int i = 0; i < 9; i++) {
+                snprintf(line, sizeof(line), "%d", i);
+                convInfo(NULL, line);
+        }
+        CHECK(calls == 1 && lastN == 8, "a full queue goes out on its own");
+        convFlush(NULL);
+        CHECK(calls == 2 && !strcmp(lastText, "8|"), "keeping the overflow");
+
+        convResult = PAM_CONV_ERR;
+        convInfo(NULL, "lost");
+        rc = convPrompt(NULL, PAM_PROMPT_ECHO_ON, "p", &answer);
+        CHECK(rc == PAM_CONV_ERR && answer == NULL, "a failed exchange is reported without a reply");
+        convResult = PAM_SUCCESS;
+        CHECK(convFlush(NULL) == PAM_SUCCESS && calls == 3, "and its messages are not sent twice");
+
+        fakePamItem(PAM_CONV, NULL);
+        convInfo(NULL, "nobody");
+        CHECK(convFlush(NULL) == PAM_CONV_ERR, "no conversation function is a conv error");
+        return failures ? 1 : 0;
+}
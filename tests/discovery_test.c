@@ -0,0 +1,183 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: the discovery and JWKS cache and its Cache-Control handling
+ *
+ * Cache files only count when root owns them, so this skips unless run as
+ * root. The IdP (idp.c) runs in a child while the module fetches.
+*******************************************************************************/
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+#include "deviceflow.h"
+#include "df.h"
+#include "dynload.h"
+#include "tests/check.h"
+#include "tests/fakepam.h"
+#include "tests/idp.h"
+
+static char issuer[128], issuerArg[160], cacheArg[600], cacheDir[512], doc[1024];
+
+/* seconds from now until the cached kind expires (negative once stale), MISSING if it cannot be read */
+#define MISSING LONG_MIN
+
+static long cachedFor(const char * kind, char * body, size_t len) {
+        char path[1024];
+        time_t expires = 0;
+        cachePath(path, sizeof(path), kind);
+        char * cached = readCache(path, &expires);
+        if (cached == NULL) return MISSING;
+        if (body) snprintf(body, len, "%s", cached);
+        free(cached);
+        return (long)(expires - time(NULL));
+}
+
+static void forget(const char * kind) {
+        char path[1024];
+        cachePath(path, sizeof(path), kind);
+        unlink(path);
+}
+
+static void files(void) {
+        char path[1024], body[64];
+        options.issuer = "https://idp.test";
+        cachePath(path, sizeof(path), "discovery");
+
+        writeCache(path, "one", 120);
+        long left = cachedFor("discovery", body, sizeof(body));
+        CHECK(!strcmp(body, "one") && left >= 119 && left <= 120, "max-age sets the expiry");
+        writeCache(path, "two", -1);
+        left = cachedFor("discovery", body, sizeof(body));
+        CHECK(!strcmp(body, "two") && left >= 3599 && left <= 3600, "no max-age caches for an hour");
+        writeCache(path, "three", 0);
+        CHECK(cachedFor("discovery", body, sizeof(body)) != MISSING && !strcmp(body, "two"), "no-store writes nothing");
+
+        options.issuer = "https://other.test";
+        char other[1024];
+        cachePath(other, sizeof(other), "discovery");
+        rename(path, other);
+        CHECK(cachedFor("discovery", NULL, 0) == MISSING, "another issuer's file under our name is not ours");
+        options.issuer = "https://idp.test";
+        rename(other, path);
+
+        chmod(path, 0666);
+        CHECK(cachedFor("discovery", NULL, 0) == MISSING, "a writable cache file is ignored");
+        chmod(path, 0644);
+        if (chown(path, 65534, 65534) == 0) CHECK(cachedFor("discovery", NULL, 0) == MISSING, "so is one root does not own");
+        unlink(path);
+}
+
+/* serve discovery with these headers in a child while resolveEndpoints runs */
+static int resolve(const char * headers, const char * body) {
+        idpReset("{}", (const struct IdpReply[]){ { 400, "{}" } }, 1);
+        idpRoute("/.well-known/openid-configuration", headers, body);
+        pid_t idp = fork();
+        if (idp == 0) idpServe();
+        loginEngine = df_engine_new();
+        int rc = resolveEndpoints();
+        df_engine_free(loginEngine);
+        loginEngine = NULL;
+        kill(idp, SIGKILL);
+        waitpid(idp, NULL, 0);
+        return rc;
+}
+
+static void cold(void) {
+        options.issuer = issuer;
+        forget("discovery");
+        CHECK(resolve("Cache-Control: public, max-age=120\r\n", doc) == 0, "a cold cache is filled from the IdP");
+        long left = cachedFor("discovery", NULL, 0);
+        CHECK(left >= 119 && left <= 120, "for the IdP's max-age");
+        CHECK(resolve("Cache-Control: max-age=5\r\n", "{}") == 0 && cachedFor("discovery", NULL, 0) > 100,
+              "a cached document is used without asking");
+
+        forget("discovery");
+        CHECK(resolve("Cache-Control: no-store\r\n", doc) == 0 && cachedFor("discovery", NULL, 0) == MISSING,
+              "no-store is used but not kept");
+        CHECK(resolve("Cache-Control: no-cache, max-age=60\r\n", doc) == 0 && cachedFor("discovery", NULL, 0) == MISSING,
+              "no-cache wins over max-age");
+        CHECK(resolve(NULL, "{\"issuer\":\"https://evil.test\",\"device_authorization_endpoint\":\"x\",\"token_endpoint\":\"y\"}") < 0 &&
+              cachedFor("discovery", NULL, 0) == MISSING, "a document for another issuer is neither used nor cached");
+        loginEngine = NULL;
+        CHECK(resolveEndpoints() < 0, "without an engine only the cache counts");
+}
+
+/* stale metadata is refetched next to the authorize request of a login */
+static void stale(void) {
+        char path[1024], body[1024];
+        cachePath(path, sizeof(path), "discovery");
+        FILE * f = fopen(path, "w");
+        if (f) {
+                fprintf(f, "%ld\n%s\n%s", (long)time(NULL) - 60, issuer, doc);
+                fclose(f);
+        }
+        long left = cachedFor("discovery", NULL, 0);
+        CHECK(left != MISSING && left <= -59, "a stale document is still read");
+
+        idpReset("{\"error\":\"invalid_client\"}", (const struct IdpReply[]){ { 400, "{}" } }, 1);
+        idpRoute("/.well-known/openid-configuration", "Cache-Control: max-age=600\r\n", doc);
+        pid_t idp = fork();
+        if (idp == 0) idpServe();
+        const char * argv[] = { issuerArg, cacheArg };
+        int rc = pam_sm_authenticate(NULL, 0, 2, argv);
+        kill(idp, SIGKILL);
+        waitpid(idp, NULL, 0);
+
+        left = cachedFor("discovery", body, sizeof(body));
+        CHECK(rc == PAM_AUTHINFO_UNAVAIL, "the login itself fails at authorize");
+        CHECK(left >= 599 && left <= 600 && !strcmp(body, doc), "but the stale document was revalidated meanwhile");
+}
+
+int main(void) {
+        if (geteuid() != 0 || getenv("TEST_DIR") == NULL) {
+                printf("skip: needs root and tests/run.sh\n");
+                return TEST_SKIP;
+        }
+        if (idpStart() < 0) {
+                printf("skip: no loopback socket\n");
+                return TEST_SKIP;
+        }
+        snprintf(issuer, sizeof(issuer), "http://127.0.0.1:%d", idpPort);
+        snprintf(issuerArg, sizeof(issuerArg), "issuer=%s", issuer);
+        snprintf(cacheDir, sizeof(cacheDir), "%s/discovery-cache", getenv("TEST_DIR"));
+        snprintf(cacheArg, sizeof(cacheArg), "cache_dir=%s", cacheDir);
+        snprintf(doc, sizeof(doc),
+                 "{\"issuer\":\"%s\",\"device_authorization_endpoint\":\"%s/auth\",\"token_endpoint\":\"%s/token\"}",
+                 issuer, issuer, issuer);
+        options.cacheDir = cacheDir;
+        if (loadCurl() < 0) {
+                printf("skip: no libcurl\n");
+                return TEST_SKIP;
+        }
+        files();
+        cold();
+        stale();
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,84 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: libraries are mapped when a login needs them and not before
+ *
+ * Reads /proc/self/maps, so the test binary itself must not link libcurl or
+ * libcrypto; run.sh only adds -ldl -lm.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+#include "deviceflow.h"
+#include "dynload.h"
+#include "tests/check.h"
+#include "tests/fakepam.h"
+
+static int mapped(const char * lib) {
+        char line[1024];
+        int found = 0;
+        FILE * f = fopen("/proc/self/maps", "r");
+        if (f == NULL) return -1;
+        while (!found && fgets(line, sizeof(line), f)) found = strstr(line, lib) != NULL;
+        fclose(f);
+        return found;
+}
+
+int main(void) {
+        if (mapped("libc") <= 0) {
+                printf("skip: no /proc/self/maps\n");
+                return TEST_SKIP;
+        }
+        if (mapped("libcurl") || mapped("libcrypto")) {
+                printf("skip: the test binary already maps libcurl or libcrypto\n");
+                return TEST_SKIP;
+        }
+        fakePamItem(PAM_USER, "alice");
+
+        const char * sessionArgs[] = { "session_cache" };
+        pam_sm_acct_mgmt(NULL, 0, 1, sessionArgs);
+        pam_sm_open_session(NULL, 0, 1, sessionArgs);
+        pam_sm_close_session(NULL, 0, 1, sessionArgs);
+        const char * noRoutes[] = { "routes=/nonexistent/routes.idx" };
+        CHECK(pam_sm_authenticate(NULL, 0, 1, noRoutes) == PAM_AUTHINFO_UNAVAIL, "a login that stops before the flow");
+        CHECK(!mapped("libcurl") && !mapped("libcrypto") && !mapped("libqrencode"), "maps none of the libraries");
+
+        if (loadCrypto() == 0) {
+                CHECK(mapped("libcrypto") && !mapped("libcurl"), "libcrypto comes alone");
+                CHECK(cryptoApi.EVP_sha256 != NULL, "with every symbol");
+        }
+
+        if (loadCurl() < 0) {
+                printf("skip: libcurl is not installed\n");
+                return failures ? 1 : TEST_SKIP;
+        }
+        CHECK(mapped("libcurl") && curlApi.multi_cleanup != NULL, "loadCurl maps libcurl");
+        void * init = (void *)curlApi.easy_init;
+        CHECK(loadCurl() == 0 && (void *)curlApi.easy_init == init, "loading again is a no-op");
+
+        int qr = loadQR();
+        CHECK(qr == 0 ? qrApi.free != NULL : qrApi.free == NULL && loadQR() < 0,
+              "libqrencode loads, or fails every time without a partial table");
+        return failures ? 1 : 0;
+}
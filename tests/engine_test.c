@@ -0,0 +1,298 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: df engine state transitions against a scripted IdP
+ *
+ * The IdP (idp.c) is served from the same loop that drives the engine. The engine runs on a
+ * simulated clock like dfsim's: it follows real time while a request is on
+ * the wire and jumps to the next timer when nothing is, so a ten minute
+ * flow takes a fraction of a second.
+*******************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "deviceflow.h"
+#include "df.h"
+#include "tests/check.h"
+#include "tests/idp.h"
+
+#define ID_TOKEN "{\"id_token\":\"eyJhbGciOiJSUzI1NiJ9.eyJzdWIiOiJhbGljZSJ9.c2ln\"}"
+
+static long long simTime = 1000000;
+
+static long long simNow(void * ctx) {
+        return simTime;
+}
+
+static long long idpSimNow(void) {
+        return simTime;
+}
+
+static const struct dfClock simClock = { simNow, NULL, NULL };
+
+static long long realNow(void) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * Drives e and the IdP until f has its device code (UNTIL_PENDING) or is done
+ * (UNTIL_DONE) and the n fetches in x are done, or limit simulated ms have
+ * passed; the state f ends in, -1 without f.
+ */
+enum { UNTIL_PENDING, UNTIL_DONE };
+
+static int busy(struct df_flow * f, int until, struct df_fetch * const * x, int n) {
+        if (f && (df_state(f) == DF_AUTHORIZING || (until == UNTIL_DONE && df_state(f) == DF_PENDING))) return 1;
+        for (int i = 0; i < n; i++)
+                if (!df_fetch_done(x[i])) return 1;
+        return 0;
+}
+
+static int drive(struct df_engine * e, struct df_flow * f, int until, struct df_fetch * const * x, int nx, long long limit) {
+        long long stop = simTime + limit;
+        while (busy(f, until, x, nx) && simTime < stop) {
+                struct pollfd fds[32];
+                struct df_fd dfds[16];
+                int n = df_fds(e, dfds, 16), nfds = 0, wire = n || idpBusy();
+                for (int i = 0; i < n; i++)
+                        fds[nfds++] = (struct pollfd){ dfds[i].fd,
+                                                      ((dfds[i].events & DF_READ) ? POLLIN : 0) |
+                                                      ((dfds[i].events & DF_WRITE) ? POLLOUT : 0), 0 };
+                nfds += idpFds(fds + nfds, 32 - nfds);
+
+                long t = df_timeout(e);
+                if (t < 0 && !wire) break;
+                long long before = realNow();
+                int ready = poll(fds, nfds, wire ? (t >= 0 && t < 100 ? t : 100) : (t < 5 ? t : 5));
+                if (ready < 0 && errno != EINTR) break;
+                /* on the wire real time counts; otherwise skip straight to the next timer */
+                simTime += wire ? realNow() - before : t;
+
+                for (int i = 0; ready > 0 && i < nfds; i++) {
+                        if (!fds[i].revents) continue;
+                        if (i < n) {
+                                int ev = ((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) ? DF_READ : 0) |
+                                         ((fds[i].revents & POLLOUT) ? DF_WRITE : 0);
+                                df_step(e, fds[i].fd, ev);
+                        } else {
+                                idpEvent(&fds[i]);
+                        }
+                }
+                df_step(e, -1, 0);
+        }
+        return f ? df_state(f) : -1;
+}
+
+static int run(struct df_engine * e, struct df_flow * f, int until, long long limit) {
+        return drive(e, f, until, NULL, 0, limit);
+}
+
+static struct df_flow * begin(struct df_engine * e, const char * tokenPath) {
+        static char authUrl[128], tokenUrl[128];
+        snprintf(authUrl, sizeof(authUrl), "http://127.0.0.1:%d/auth", idpPort);
+        snprintf(tokenUrl, sizeof(tokenUrl), "http://127.0.0.1:%d%s", idpPort, tokenPath);
+        struct df_options o = { .authorize_url = authUrl, .token_url = tokenUrl, .client_id = "0oatest" };
+        return df_begin(e, &o);
+}
+
+static const char * authorizeOk =
+        "{\"device_code\":\"dc1\",\"user_code\":\"WDJB-MJHT\",\"verification_uri\":\"https://idp.test/activate\","
+        "\"interval\":5,\"expires_in\":600}";
+static const struct IdpReply pending = { 400, "{\"error\":\"authorization_pending\"}" };
+
+static void approved(struct df_engine * e) {
+        const struct IdpReply replies[] = { pending, pending, { 400, "{\"error\":\"slow_down\"}" }, pending,
+                                         { 200, ID_TOKEN } };
+        idpReset(authorizeOk, replies, 5);
+        struct df_flow * f = begin(e, "/token");
+        CHECK(f && df_state(f) == DF_AUTHORIZING, "a new flow is authorizing");
+
+        CHECK(run(e, f, UNTIL_PENDING, 60000) == DF_PENDING && idpAuthRequests == 1 &&
+              !strcmp(df_user_code(f), "WDJB-MJHT") && !strcmp(df_verification_uri(f), "https://idp.test/activate"), "pending with the user code");
+        CHECK(df_polls(f) == 0 && df_next_poll(f) >= 4900, "first poll waits an interval");
+
+        long long start = simTime;
+        CHECK(run(e, f, UNTIL_DONE, 600000) == DF_APPROVED, "approved");
+        CHECK(idpTokenRequests == 5 && df_polls(f) == 5, "one token request per poll");
+        CHECK(strstr(idpLastTokenBody, "device_code=dc1") &&
+              strstr(idpLastTokenBody, "grant_type=urn:ietf:params:oauth:grant-type:device_code"),
+              "token request carries the device code");
+        CHECK(idpTokenAt[0] - start >= 4900 && idpTokenAt[1] - idpTokenAt[0] >= 5000 && idpTokenAt[2] - idpTokenAt[1] >= 5000,
+              "polls an interval apart");
+        CHECK(df_interval(f) == 10 && idpTokenAt[3] - idpTokenAt[2] >= 10000 && idpTokenAt[4] - idpTokenAt[3] >= 10000,
+              "slow_down adds five seconds for good");
+        CHECK(df_result(f) && strstr(df_result(f), "\"sub\":\"alice\""), "claims from the id token");
+        CHECK(df_id_token(f) && !strncmp(df_id_token(f), "eyJhbGciOiJSUzI1NiJ9.", 21), "id token kept");
+        df_end(f);
+}
+
+static void denied(struct df_engine * e) {
+        const struct IdpReply replies[] = { pending, { 400, "{\"error\":\"access_denied\"}" } };
+        idpReset(authorizeOk, replies, 2);
+        struct df_flow * f = begin(e, "/token");
+        CHECK(run(e, f, UNTIL_DONE, 600000) == DF_DENIED && !strcmp(df_error(f), "access_denied") && idpTokenRequests == 2,
+              "access_denied ends the flow as denied");
+        df_end(f);
+}
+
+static void expired(struct df_engine * e) {
+        idpReset("{\"device_code\":\"dc2\",\"user_code\":\"A\",\"verification_uri\":\"https://idp.test/a\","
+                 "\"interval\":5,\"expires_in\":30}",
+                 &pending, 1);
+        struct df_flow * f = begin(e, "/token");
+        long long start = simTime;
+        CHECK(run(e, f, UNTIL_DONE, 600000) == DF_EXPIRED, "a flow nobody approves expires");
+        /* poll.c gives up once the next poll would land past the deadline */
+        CHECK(simTime - start >= 25000 && simTime - start <= 30000 && idpTokenRequests <= 6,
+              "and stops polling by expires_in");
+        df_end(f);
+}
+
+static void serverErrors(struct df_engine * e) {
+        const struct IdpReply replies[] = { { 502, "<html>bad gateway</html>" }, { 502, "<html>bad gateway</html>" },
+                                         { 503, "" }, { 200, ID_TOKEN } };
+        idpReset(authorizeOk, replies, 4);
+        struct df_flow * f = begin(e, "/token");
+        CHECK(run(e, f, UNTIL_DONE, 600000) == DF_APPROVED && idpTokenRequests == 4, "5xx pages are retried, not fatal");
+        CHECK(idpTokenAt[1] - idpTokenAt[0] >= 5000 && idpTokenAt[2] - idpTokenAt[1] >= 10000 && idpTokenAt[3] - idpTokenAt[2] >= 20000,
+              "retries back off");
+        df_end(f);
+
+        idpReset(authorizeOk, replies, 1);
+        f = begin(e, "/token");
+        CHECK(run(e, f, UNTIL_DONE, 600000) == DF_FAILED && !strcmp(df_error(f), "server_error") && idpTokenRequests == 5,
+              "an IdP that keeps failing is given up on");
+        df_end(f);
+
+        /* an OAuth error in between starts the count over */
+        const struct IdpReply mixed[] = { { 502, "" }, { 502, "" }, { 502, "" }, { 502, "" }, pending,
+                                       { 502, "" }, { 502, "" }, { 200, ID_TOKEN } };
+        idpReset(authorizeOk, mixed, 8);
+        f = begin(e, "/token");
+        CHECK(run(e, f, UNTIL_DONE, 600000) == DF_APPROVED, "an answer resets the failure count");
+        df_end(f);
+}
+
+static void transport(struct df_engine * e) {
+        /* nothing listens on the port of a socket we bound and closed */
+        struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        socklen_t len = sizeof(sa);
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        bind(s, (struct sockaddr *)&sa, sizeof(sa));
+        getsockname(s, (struct sockaddr *)&sa, &len);
+        close(s);
+
+        char url[128];
+        snprintf(url, sizeof(url), "http://127.0.0.1:%d/token", ntohs(sa.sin_port));
+        struct df_options o = { .token_url = url, .client_id = "0oatest", .device_code = "dc3", .interval = 5 };
+        idpReset(authorizeOk, &pending, 1);
+        struct df_flow * f = df_begin(e, &o);
+        CHECK(f && df_state(f) == DF_PENDING && idpAuthRequests == 0, "adopting a device code skips authorize");
+        CHECK(run(e, f, UNTIL_DONE, 600000) == DF_FAILED && !strcmp(df_error(f), "transport") && df_polls(f) == 5,
+              "an unreachable token endpoint is retried, then given up on");
+        df_end(f);
+
+        o.token_url = "htp://127.0.0.1/token";
+        f = df_begin(e, &o);
+        long long start = simTime;
+        CHECK(run(e, f, UNTIL_DONE, 600000) == DF_FAILED && !strcmp(df_error(f), "transport") &&
+              simTime - start < 2 * 5000,
+              "a URL curl cannot use fails at once");
+        df_end(f);
+}
+
+static void refused(struct df_engine * e) {
+        struct df_options o = { .authorize_url = "http://127.0.0.1/auth", .token_url = "", .client_id = "x" };
+        CHECK(df_begin(e, &o) == NULL, "no flow without a token URL");
+        o.token_url = "http://127.0.0.1/token";
+        o.authorize_url = NULL;
+        CHECK(df_begin(e, &o) == NULL, "no flow without an authorize URL or device code");
+
+        idpReset("{\"error\":\"invalid_client\"}", &pending, 1);
+        struct df_flow * f = begin(e, "/token");
+        CHECK(run(e, f, UNTIL_DONE, 600000) == DF_FAILED && !strcmp(df_error(f), "invalid_client") && idpTokenRequests == 0,
+              "an authorize error fails the flow");
+        df_end(f);
+}
+
+/* discovery and JWKS ride the engine's handle next to the authorize request */
+static void fetches(struct df_engine * e) {
+        char disc[128], keys[128], fresh[128], missing[128];
+        idpReset("{\"device_code\":\"dc4\",\"user_code\":\"B\",\"verification_uri\":\"https://idp.test/b\","
+                 "\"verification_uri_complete\":\"https://idp.test/b?user_code=B\",\"interval\":5,\"expires_in\":300}",
+                 &pending, 1);
+        idpRoute("/.well-known/openid-configuration", "Cache-Control: public, max-age=120\r\n", "{\"issuer\":\"x\"}");
+        idpRoute("/keys", "cache-control: no-store\r\n", "{\"keys\":[]}");
+        idpRoute("/fresh", NULL, "{}");
+        snprintf(disc, sizeof(disc), "http://127.0.0.1:%d/.well-known/openid-configuration", idpPort);
+        snprintf(keys, sizeof(keys), "http://127.0.0.1:%d/keys", idpPort);
+        snprintf(fresh, sizeof(fresh), "http://127.0.0.1:%d/fresh", idpPort);
+        snprintf(missing, sizeof(missing), "http://127.0.0.1:%d/missing", idpPort);
+
+        struct df_flow * f = begin(e, "/token");
+        struct df_fetch * x[] = { df_fetch_begin(e, disc), df_fetch_begin(e, keys), df_fetch_begin(e, fresh),
+                                  df_fetch_begin(e, missing) };
+        CHECK(x[0] && x[1] && x[2] && x[3] && !df_fetch_done(x[0]) && !df_fetch_body(x[0])[0], "fetches start");
+        CHECK(drive(e, f, UNTIL_PENDING, x, 4, 60000) == DF_PENDING && idpAuthRequests == 1 && idpGets == 4,
+              "fetches and authorize complete together");
+        CHECK(df_fetch_status(x[0]) == 200 && !strcmp(df_fetch_body(x[0]), "{\"issuer\":\"x\"}"), "fetch body");
+        CHECK(df_fetch_max_age(x[0]) == 120, "max-age is read");
+        CHECK(df_fetch_max_age(x[1]) == 0, "no-store means do not cache");
+        CHECK(df_fetch_max_age(x[2]) == -1, "no Cache-Control, no max-age");
+        CHECK(df_fetch_status(x[3]) == 404, "error statuses are reported");
+        CHECK(!strcmp(df_device_code(f), "dc4") && !strcmp(df_verification_uri(f), "https://idp.test/b?user_code=B"),
+              "verification_uri_complete is preferred");
+        CHECK(df_expires_in(f) > 290 && df_expires_in(f) <= 300, "expires_in counts down from the response");
+        for (int i = 0; i < 4; i++) df_fetch_end(x[i]);
+        CHECK(df_fetch_begin(e, "") == NULL, "no fetch without a URL");
+
+        /* one still in flight is ended with the engine */
+        CHECK(df_fetch_begin(e, disc) != NULL, "a fetch can be left to df_engine_free");
+        df_end(f);
+}
+
+int main(void) {
+        struct df_engine * e = df_engine_new();
+        if (e == NULL || idpStart() < 0) {
+                printf("skip: no libcurl or no loopback socket\n");
+                return TEST_SKIP;
+        }
+        df_engine_set_clock(e, &simClock);
+        idpClock = idpSimNow;
+        approved(e);
+        denied(e);
+        expired(e);
+        serverErrors(e);
+        transport(e);
+        refused(e);
+        fetches(e);
+        df_engine_free(e);
+        return failures != 0;
+}
@@ -0,0 +1,125 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: just enough libpam for the module code under test
+ *
+ * Items and environment are plain tables the tests fill in with
+ * fakePamItem/fakePamEnv; there is one login at a time.
+*******************************************************************************/
+#include <stdlib.h>
+#include <string.h>
+
+#include <security/pam_appl.h>
+
+#include "tests/fakepam.h"
+
+#define MAX_ITEMS 16
+#define MAX_ENTRIES 16
+
+static const char * items[MAX_ITEMS];
+static char * env[MAX_ENTRIES];
+static struct {
+        const char * name;
+        void * data;
+        void (*cleanup)(pam_handle_t * pamh, void * data, int status);
+} moduleData[MAX_ENTRIES];
+
+void fakePamItem(int item, const char * value) {
+        if (item >= 0 && item < MAX_ITEMS) items[item] = value;
+}
+
+void fakePamEnv(const char * name, const char * value) {
+        size_t n = strlen(name);
+        for (int i = 0; i < MAX_ENTRIES; i++) {
+                if (env[i] && !strncmp(env[i], name, n) && env[i][n] == '=') {
+                        free(env[i]);
+                        env[i] = NULL;
+                }
+        }
+        if (value == NULL) return;
+        for (int i = 0; i < MAX_ENTRIES; i++) {
+                if (env[i] == NULL) {
+                        env[i] = malloc(n + strlen(value) + 2);
+                        if (env[i]) strcat(strcat(strcpy(env[i], name), "="), value);
+                        return;
+                }
+        }
+}
+
+void fakePamDropData(void) {
+        for (int i = 0; i < MAX_ENTRIES; i++) {
+                if (moduleData[i].name && moduleData[i].cleanup) moduleData[i].cleanup(NULL, moduleData[i].data, PAM_SUCCESS);
+                moduleData[i].name = NULL;
+        }
+}
+
+int pam_get_item(const pam_handle_t * pamh, int item, const void ** out) {
+        if (item < 0 || item >= MAX_ITEMS) return PAM_SYSTEM_ERR;
+        *out = items[item];
+        return PAM_SUCCESS;
+}
+
+int pam_get_user(pam_handle_t * pamh, const char ** user, const char * prompt) {
+        *user = items[PAM_USER];
+        return *user ? PAM_SUCCESS : PAM_USER_UNKNOWN;
+}
+
+const char * pam_getenv(pam_handle_t * pamh, const char * name) {
+        size_t n = strlen(name);
+        for (int i = 0; i < MAX_ENTRIES; i++)
+                if (env[i] && !strncmp(env[i], name, n) && env[i][n] == '=') return env[i] + n + 1;
+        return NULL;
+}
+
+int pam_putenv(pam_handle_t * pamh, const char * entry) {
+        char name[256];
+        const char * eq = strchr(entry, '=');
+        size_t n = eq ? (size_t)(eq - entry) : strlen(entry);
+        if (n >= sizeof(name)) return PAM_BUF_ERR;
+        memcpy(name, entry, n);
+        name[n] = '\0';
+        fakePamEnv(name, eq ? eq + 1 : NULL);
+        return PAM_SUCCESS;
+}
+
+int pam_set_data(pam_handle_t * pamh, const char * name, void * data,
+                 void (*cleanup)(pam_handle_t * pamh, void * data, int status)) {
+        for (int i = 0; i < MAX_ENTRIES; i++) {
+                if (moduleData[i].name == NULL || !strcmp(moduleData[i].name, name)) {
+                        if (moduleData[i].name && moduleData[i].cleanup)
+                                moduleData[i].cleanup(pamh, moduleData[i].data, PAM_SUCCESS);
+                        moduleData[i].name = name;
+                        moduleData[i].data = data;
+                        moduleData[i].cleanup = cleanup;
+                        return PAM_SUCCESS;
+                }
+        }
+        return PAM_BUF_ERR;
+}
+
+int pam_get_data(const pam_handle_t * pamh, const char * name, const void ** data) {
+        for (int i = 0; i < MAX_ENTRIES && moduleData[i].name; i++) {
+                if (!strcmp(moduleData[i].name, name)) {
+                        *data = moduleData[i].data;
+                        return PAM_SUCCESS;
+                }
+        }
+        return PAM_NO_MODULE_DATA;
+}
@@ -0,0 +1,122 @@
+#!/bin/sh
+#
+# Three dfstated daemons on localhost, full mesh, plus two bad peers: one
+# port nobody listens on and one that accepts but never says HELLO. A write
+# to any daemon must answer at once and show up on the other two.
+#
+#   CC=gcc CFLAGS=... tests/fleet.sh
+#
+set -e
+cd "$(dirname "$0")/.."
+work=$(mktemp -d)
+pids=
+cleanup() {
+        [ -n "$pids" ] && kill $pids 2>/dev/null
+        rm -rf "$work"
+}
+trap cleanup EXIT
+
+${CC:-cc} -std=gnu11 $CFLAGS -o "$work/dfstated" dfstated.c fleet.c dfindex.c dynload.c -ldl
+echo fleet-test-secret > "$work/secret"
+
+base=${FLEET_TEST_PORT:-17070}
+a=127.0.0.1:$base b=127.0.0.1:$((base + 1)) c=127.0.0.1:$((base + 2))
+dead=127.0.0.1:$((base + 3)) silent=127.0.0.1:$((base + 4))
+
+# accepts connections and then says nothing
+python3 -c '
+import socket, sys, time
+s = socket.socket(); s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+s.bind(("127.0.0.1", int(sys.argv[1]))); s.listen(64)
+held = []
+while True: held.append(s.accept())
+' $((base + 4)) &
+pids="$pids $!"
+
+start() {
+        self=$1
+        shift
+        peers=
+        for p in "$@"; do peers="$peers -p $p"; done
+        "$work/dfstated" -k "$work/secret" -l "$self" $peers -p $dead -p $silent 2>>"$work/log" &
+        pids="$pids $!"
+}
+start $a $b $c
+start $b $a $c
+start $c $a $b
+sleep 1
+
+# fleet <addr> <command> ... prints the reply and the seconds it took
+fleet() {
+        python3 - "$work/secret" "$@" <<'EOF'
+import hashlib, hmac, socket, sys, time
+secret = open(sys.argv[1]).read().strip().encode()
+host, port = sys.argv[2].rsplit(":", 1)
+t = time.time()
+s = socket.create_connection((host, int(port)), timeout=5)
+f = s.makefile("rwb")
+nonce = f.readline().split()[1]
+f.write(b"AUTH " + hmac.new(secret, nonce, hashlib.sha256).hexdigest().encode() + b"\n")
+f.write(" ".join(sys.argv[3:]).encode() + b"\n")
+f.flush()
+print(f.readline().decode().strip(), "%.2f" % (time.time() - t))
+EOF
+}
+
+fail=0
+check() {
+        case "$2" in
+        $1) echo "ok   $3" ;;
+        *) echo "FAIL $3: got '$2'"; fail=1 ;;
+        esac
+}
+now=$(date +%s)
+
+for i in 1 2 3 4 5; do
+        out=$(fleet $a PUT "k$i" "$((now * 1000 + i))" approved $((now + 60)) 0 a "token$i")
+        check "OK 0.[0-4]*" "$out" "put $i on a answers promptly"
+done
+out=$(fleet $b PUT kb "$((now * 1000))" approved $((now + 60)) 0 b tokenb)
+check "OK 0.[0-4]*" "$out" "put on b answers promptly"
+sleep 1
+
+for i in 1 2 3 4 5; do
+        check "REC k$i * token$i *" "$(fleet $c GET k$i)" "k$i replicated to c"
+done
+check "REC kb * tokenb *" "$(fleet $a GET kb)" "kb replicated to a"
+check "REC kb * tokenb *" "$(fleet $c GET kb)" "kb replicated to c"
+
+# an older version loses everywhere
+check "OLD *" "$(fleet $c PUT k1 1 failed $((now + 60)) 0 c stale)" "older write refused"
+
+# an approved record can be taken once, fleet-wide
+check "REC k2 * token2 *" "$(fleet $b TAKE k2)" "take returns the record"
+check "NONE *" "$(fleet $b TAKE k2)" "second take on the same daemon gets nothing"
+sleep 1
+check "NONE *" "$(fleet $c TAKE k2)" "take replicated to c"
+
+# a restarted daemon pulls what it missed from a peer
+kill ${pids##* }
+wait ${pids##* } 2>/dev/null || true
+pids=${pids% *}
+fleet $a PUT late "$((now * 1000 + 9))" approved $((now + 60)) 0 a tokenlate >/dev/null
+start $c $a $b
+sleep 3
+check "REC late * tokenlate *" "$(fleet $c GET late)" "restarted c caught up"
+
+# wrong secret gets nowhere
+out=$(python3 - "$c" <<'EOF' 2>&1 || true
+import socket, sys
+host, port = sys.argv[1].rsplit(":", 1)
+s = socket.create_connection((host, int(port)), timeout=5)
+f = s.makefile("rwb")
+f.readline()
+f.write(b"AUTH " + b"0" * 64 + b"\nGET k1\n")
+f.flush()
+print(f.readline().decode().strip() or "closed")
+EOF
+)
+check "closed" "$out" "bad proof is dropped"
+
+[ $fail = 0 ] && echo "fleet: all passed"
+exit $fail
@@ -0,0 +1,118 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: which fleet record a login shares (fleetRecord, fleetKey)
+ *
+ * Two people behind one NAT address must not share a record, and a login
+ * without an authenticated SSH key must not get one. Keys are made with
+ * ssh-keygen(1), which also checks our fingerprints.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <security/pam_appl.h>
+
+#include "deviceflow.h"
+#include "fleet.h"
+#include "tests/check.h"
+#include "tests/fakepam.h"
+
+static char dir[512];
+
+static int run(const char * cmd) {
+        char line[2048];
+        snprintf(line, sizeof(line), "cd %s && (%s) >/dev/null 2>&1", dir, cmd);
+        return system(line);
+}
+
+/* first line of dir/name, without the newline */
+static void slurp(const char * name, char * out, size_t outlen) {
+        char path[600];
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        FILE * f = fopen(path, "r");
+        out[0] = '\0';
+        if (f) {
+                if (fgets(out, outlen, f) == NULL) out[0] = '\0';
+                fclose(f);
+        }
+        out[strcspn(out, "\n")] = '\0';
+}
+
+/* the key of the record a login with this SSH_AUTH_INFO_0 would share, or "" */
+static const char * recordKey(const char * authInfo) {
+        static char key[256];
+        fakePamEnv("SSH_AUTH_INFO_0", authInfo);
+        struct FleetRecord * rec = fleetRecord(NULL, "alice");
+        snprintf(key, sizeof(key), "%s", rec ? rec->key : "");
+        free(rec);
+        return key;
+}
+
+int main(void) {
+        char alice[8192], bob[8192], fp[64], want[128], info[16384], aliceKey[256];
+
+        if (getenv("TEST_DIR") == NULL) {
+                printf("skip: needs tests/run.sh\n");
+                return TEST_SKIP;
+        }
+        snprintf(dir, sizeof(dir), "%s/fleetkey", getenv("TEST_DIR"));
+        if (mkdir(dir, 0700) < 0 ||
+            run("ssh-keygen -q -t ed25519 -N '' -f alice && ssh-keygen -q -t rsa -b 2048 -N '' -f bob &&"
+                "ssh-keygen -l -E sha256 -f alice.pub | cut -d' ' -f2 > alice.fp &&"
+                "ssh-keygen -l -E sha256 -f bob.pub | cut -d' ' -f2 > bob.fp")) {
+                printf("skip: ssh-keygen failed\n");
+                return TEST_SKIP;
+        }
+        slurp("alice.pub", alice, sizeof(alice));
+        slurp("bob.pub", bob, sizeof(bob));
+
+        slurp("alice.fp", want, sizeof(want));
+        CHECK(sshKeyFingerprint(alice, fp, sizeof(fp)) == 0 && !strcmp(fp, want), "ed25519 fingerprint is ssh-keygen's");
+        slurp("bob.fp", want, sizeof(want));
+        CHECK(sshKeyFingerprint(bob, fp, sizeof(fp)) == 0 && !strcmp(fp, want), "rsa fingerprint is ssh-keygen's");
+        CHECK(sshKeyFingerprint("ssh-ed25519", fp, sizeof(fp)) < 0, "no blob, no fingerprint");
+        CHECK(sshKeyFingerprint(alice, fp, 20) < 0, "short buffer refused");
+
+        fakePamItem(PAM_RHOST, "198.51.100.7");
+        snprintf(info, sizeof(info), "publickey %s", alice);
+        snprintf(aliceKey, sizeof(aliceKey), "%s", recordKey(info));
+        slurp("alice.fp", want, sizeof(want));
+        CHECK(!strncmp(aliceKey, "alice@198.51.100.7/", 19) && !strcmp(aliceKey + 19, want), "record is user@rhost/fingerprint");
+        CHECK(!strcmp(recordKey(info), aliceKey), "same key, same record");
+
+        snprintf(info, sizeof(info), "publickey %s", bob);
+        CHECK(recordKey(info)[0] && strcmp(recordKey(info), aliceKey), "another key behind the same address, another record");
+        CHECK(!recordKey(NULL)[0], "no SSH_AUTH_INFO_0, no record");
+        CHECK(!recordKey("keyboard-interactive\n")[0], "no publickey method, no record");
+        snprintf(info, sizeof(info), "password\npublickey %s", alice);
+        CHECK(!strcmp(recordKey(info), aliceKey), "publickey found among other methods");
+
+        fakePamItem(PAM_RHOST, NULL);
+        snprintf(info, sizeof(info), "publickey %s", alice);
+        CHECK(!strncmp(recordKey(info), "alice@local/SHA256:", 19), "no rhost is local");
+
+        char small[24];
+        CHECK(fleetKey(small, sizeof(small), "alice", "198.51.100.7", fp) < 0, "a key that loses its fingerprint is refused");
+        CHECK(fleetKey(small, sizeof(small), "a b", "h", "SHA256:x") == 0 && !strcmp(small, "a_b@h/SHA256:x"), "blanks are replaced");
+
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,158 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: following another bastion's flow on a simulated clock
+ *
+ * followFleetFlow against a real dfstated, with dfclock jumping a second per
+ * wait: deadlines and leases come from dfclock, and only what dfstated
+ * stores is an epoch. A thirty second flow takes a few round trips.
+*******************************************************************************/
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "deviceflow.h"
+#include "fleet.h"
+#include "tests/check.h"
+
+static long long simTime = 5000000;
+
+static long long simNow(void * ctx) {
+        return simTime;
+}
+
+static int simSleep(void * ctx, long long when) {
+        if (when > simTime) simTime = when;
+        return 0;
+}
+
+static struct dfClock simClock = { simNow, simSleep, NULL };
+static char addr[64], secretPath[600];
+
+/* what another bastion left in dfstated for key */
+static void publish(const char * key, int state, long expires, long lease, const char * data) {
+        struct FleetRecord rec;
+        memset(&rec, 0, sizeof(rec));
+        snprintf(rec.key, sizeof(rec.key), "%s", key);
+        rec.version = (long long)time(NULL) * 1000;
+        rec.state = state;
+        rec.expires = expires;
+        rec.lease = lease;
+        snprintf(rec.owner, sizeof(rec.owner), "other:1");
+        snprintf(rec.data, sizeof(rec.data), "%s", data);
+        fleetPut(options.fleet, fleetSecret, &rec);
+}
+
+static int follow(const char * key, long expires, char * devicecode, long * interval, char * url) {
+        struct FleetRecord rec;
+        char * claims = NULL;
+        time_t tokenExpires = 0;
+        memset(&rec, 0, sizeof(rec));
+        snprintf(rec.key, sizeof(rec.key), "%s", key);
+        int rc = followFleetFlow(&rec, fromEpoch(expires), devicecode, interval, url, &claims, &tokenExpires);
+        free(claims);
+        return rc;
+}
+
+static pid_t startDaemon(void) {
+        struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        socklen_t len = sizeof(sa);
+        int s = socket(AF_INET, SOCK_STREAM, 0);
+        if (s < 0 || bind(s, (struct sockaddr *)&sa, sizeof(sa)) < 0 || getsockname(s, (struct sockaddr *)&sa, &len) < 0)
+                return -1;
+        close(s);
+        snprintf(addr, sizeof(addr), "127.0.0.1:%d", ntohs(sa.sin_port));
+
+        pid_t pid = fork();
+        if (pid == 0) {
+                execl(getenv("DFSTATED"), "dfstated", "-k", secretPath, "-l", addr, (char *)NULL);
+                _exit(127);
+        }
+        struct FleetRecord rec;
+        for (int i = 0; i < 100 && fleetGet(addr, fleetSecret, "nobody", &rec) < 0; i++) usleep(20000);
+        return pid;
+}
+
+int main(void) {
+        char devicecode[1024] = "", url[1024] = "";
+        long interval = 0;
+        struct FleetRecord rec;
+
+        if (getenv("DFSTATED") == NULL || getenv("TEST_DIR") == NULL) {
+                printf("skip: needs tests/run.sh\n");
+                return TEST_SKIP;
+        }
+        snprintf(secretPath, sizeof(secretPath), "%s/follow.secret", getenv("TEST_DIR"));
+        FILE * f = fopen(secretPath, "w");
+        if (f == NULL || fputs("follow-test-secret\n", f) < 0 || fclose(f) != 0) return 1;
+        options.fleetSecret = secretPath;
+        fleetInit();
+        pid_t daemon = startDaemon();
+        if (daemon < 0 || fleetGet(addr, fleetSecret, "nobody", &rec) < 0) {
+                printf("skip: dfstated did not come up\n");
+                if (daemon > 0) kill(daemon, SIGTERM);
+                return TEST_SKIP;
+        }
+        options.fleet = addr;
+        dfclock = &simClock;
+        anchorClock();
+
+        time_t wall = time(NULL);
+        long long start = simTime;
+        CHECK(toEpoch(start) == wall && fromEpoch(wall + 90) == start + 90000, "epochs convert around the anchor");
+
+        /* the owner's lease ran out: carry on with its device code, under our own lease */
+        publish("takeover", FLEET_PENDING, wall + 600, wall - 1, "dc9 5 https://idp.test/x");
+        interval = 5;       /* read from the record when following began */
+        CHECK(follow("takeover", wall + 600, devicecode, &interval, url) == FOLLOW_OWNER, "a lapsed lease is taken over");
+        CHECK(!strcmp(devicecode, "dc9") && interval == 5 && !strcmp(url, "https://idp.test/x"), "with the owner's flow");
+        CHECK(simTime - start == 1000, "at the first look");
+        CHECK(fleetGet(addr, fleetSecret, "takeover", &rec) == 1 && strcmp(rec.owner, "other:1") &&
+              rec.lease == toEpoch(simTime + 15000) && rec.expires == wall + 600,
+              "the new lease is two intervals and change past dfclock's now");
+
+        /* a live owner that never finishes: follow until the device code expires, on dfclock */
+        start = simTime;
+        wall = time(NULL);
+        publish("expiry", FLEET_PENDING, toEpoch(simTime) + 30, wall + 3600, "dc10 5 https://idp.test/y");
+        CHECK(follow("expiry", toEpoch(simTime) + 30, devicecode, &interval, url) == FOLLOW_GONE,
+              "a flow nobody finishes is given up");
+        CHECK(simTime - start >= 29000 && simTime - start <= 31000, "at its deadline on dfclock");
+        CHECK(time(NULL) - wall < 5, "without waiting for the wall clock");
+
+        start = simTime;
+        publish("failed", FLEET_FAILED, toEpoch(simTime) + 10, 0, "-");
+        CHECK(follow("failed", toEpoch(simTime) + 600, devicecode, &interval, url) == FOLLOW_GONE &&
+              simTime - start == 1000, "a failed flow ends following at once");
+
+        publish("forged", FLEET_APPROVED, toEpoch(simTime) + 300, 0, "eyJhbGciOiJub25lIn0.eyJzdWIiOiJhbGljZSJ9.");
+        CHECK(follow("forged", toEpoch(simTime) + 600, devicecode, &interval, url) == FOLLOW_GONE,
+              "an approval that does not verify is not followed");
+
+        kill(daemon, SIGTERM);
+        waitpid(daemon, NULL, 0);
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,166 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: hop assertions from hopDelegate through dfstated to hopAccept
+ *
+ * Both ends run in this process against a dfstated of our own on
+ * 127.0.0.1:$FLEET_TEST_PORT + 10. Key files must be root owned, so this
+ * skips unless run as root.
+*******************************************************************************/
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <security/pam_appl.h>
+
+#include "deviceflow.h"
+#include "fleet.h"
+#include "tests/check.h"
+#include "tests/fakepam.h"
+
+#define CLAIMS "{\"iss\":\"https://idp.test\",\"sub\":\"00u1\",\"exp\":4102444800}"
+#define ALICE_KEY "publickey ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIAlicesKeyAlicesKeyAlicesKeyAlicesKey0"
+#define OTHER_KEY "publickey ssh-ed25519 AAAAC3NzaC1lZDI1NTE5AAAAIMallorysKeyMallorysKeyMallorysKeyMal"
+
+static char dir[512], path[5][600];
+enum { HOP_KEY, TRUST, STRANGER_KEY, STRANGER_TRUST, SECRET };
+
+static int run(const char * cmd) {
+        char line[2048];
+        snprintf(line, sizeof(line), "cd %s && (%s) >/dev/null 2>&1", dir, cmd);
+        return system(line);
+}
+
+/* accept as user with the client's key; 1 if let in */
+static int accepted(const char * user, const char * info) {
+        long expires = 0;
+        fakePamEnv("SSH_AUTH_INFO_0", info);
+        char * claims = hopAccept(NULL, user, &expires);
+        int ok = claims && !strcmp(claims, CLAIMS) && expires == 4102444800L;
+        free(claims);
+        return ok;
+}
+
+static int delegate(const char * user) {
+        usleep(2000); /* record versions are milliseconds */
+        fakePamEnv("SSH_AUTH_INFO_0", ALICE_KEY);
+        return hopDelegate(NULL, user, CLAIMS);
+}
+
+int main(void) {
+        char listen[64], cmd[1024];
+        const char * port = getenv("FLEET_TEST_PORT");
+
+        if (geteuid() != 0 || getenv("TEST_DIR") == NULL || getenv("DFSTATED") == NULL) {
+                printf("skip: needs root and tests/run.sh\n");
+                return TEST_SKIP;
+        }
+        snprintf(dir, sizeof(dir), "%s/hop", getenv("TEST_DIR"));
+        const char * names[] = { "hop.key", "trust", "stranger.key", "stranger.trust", "secret" };
+        for (int i = 0; i < 5; i++) snprintf(path[i], sizeof(path[i]), "%s/%s", dir, names[i]);
+        if (mkdir(dir, 0700) < 0 ||
+            run("for k in hop stranger; do"
+                "  openssl genpkey -algorithm ed25519 -out $k.pem &&"
+                "  openssl pkey -in $k.pem -outform DER | tail -c 32 | base64 > $k.key &&"
+                "  openssl pkey -in $k.pem -pubout -outform DER | tail -c 32 | base64 > $k.pub || exit 1;"
+                "done;"
+                "chmod 600 hop.key stranger.key && mv stranger.pub stranger.trust && mv hop.pub trust &&"
+                "chmod 644 trust stranger.trust && echo hop-test-secret > secret")) {
+                printf("skip: cannot make Ed25519 keys with openssl\n");
+                return TEST_SKIP;
+        }
+
+        snprintf(listen, sizeof(listen), "127.0.0.1:%d", (port ? atoi(port) : 17070) + 10);
+        pid_t daemon = fork();
+        if (daemon == 0) {
+                execl(getenv("DFSTATED"), "dfstated", "-k", path[SECRET], "-l", listen, (char *)NULL);
+                _exit(127);
+        }
+        usleep(300000);
+
+        options.fleet = listen;
+        options.fleetSecret = path[SECRET];
+        options.hopKey = path[HOP_KEY];
+        options.hopAddress = "127.0.0.1";
+        options.delegateAudience = "bastion2";
+        options.hopTrust = path[TRUST];
+        options.hopAudience = "bastion2";
+        fakePamItem(PAM_RHOST, "127.0.0.1");
+
+        /* what is refused on the way out */
+        fakePamEnv("SSH_AUTH_INFO_0", NULL);
+        CHECK(hopDelegate(NULL, "alice", CLAIMS) < 0, "no delegation without an authenticated SSH key");
+        fakePamEnv("SSH_AUTH_INFO_0", ALICE_KEY);
+        CHECK(hopDelegate(NULL, "alice\",\"user\":\"root", CLAIMS) < 0, "no delegation for a user name with quotes");
+
+        CHECK(delegate("alice") == 0, "assertion published");
+        CHECK(!accepted("alice", OTHER_KEY), "refused for another SSH key");
+        CHECK(!accepted("alice", NULL), "refused without an authenticated SSH key");
+        CHECK(!accepted("bob", ALICE_KEY), "refused for another user");
+        options.hopAudience = "bastion3";
+        CHECK(!accepted("alice", ALICE_KEY), "refused for another audience");
+        options.hopAudience = "bastion2";
+        options.hopTrust = path[STRANGER_TRUST];
+        CHECK(!accepted("alice", ALICE_KEY), "refused when its signer is not trusted");
+        options.hopTrust = path[TRUST];
+        fakePamItem(PAM_RHOST, "127.0.0.2");
+        CHECK(!accepted("alice", ALICE_KEY), "refused from another upstream address");
+        fakePamItem(PAM_RHOST, "127.0.0.1");
+
+        /* the failed attempts above must not have used it up */
+        CHECK(accepted("alice", ALICE_KEY), "accepted for the bound key, user and audience");
+        CHECK(!accepted("alice", ALICE_KEY), "refused the second time");
+
+        /* a stranger's key signing for this address */
+        options.hopKey = path[STRANGER_KEY];
+        CHECK(delegate("alice") == 0, "forged assertion published");
+        CHECK(!accepted("alice", ALICE_KEY), "forged assertion refused");
+        options.hopKey = path[HOP_KEY];
+
+        /* a genuine assertion with its payload changed in dfstated */
+        struct FleetRecord * rec = calloc(1, sizeof(*rec));
+        CHECK(delegate("alice") == 0, "assertion published again");
+        fleetInit();
+        CHECK(fleetGet(options.fleet, fleetSecret, "hop:alice:127.0.0.1", rec) == 1, "record in dfstated");
+        rec->data[10] = rec->data[10] == 'A' ? 'B' : 'A';
+        rec->version++;
+        CHECK(fleetPut(options.fleet, fleetSecret, rec) == 0, "record altered");
+        CHECK(!accepted("alice", ALICE_KEY), "altered assertion refused");
+        char * dot = strchr(rec->data, '.');
+        if (dot) dot[5] = dot[5] == 'A' ? 'B' : 'A';
+        rec->data[10] = rec->data[10] == 'A' ? 'B' : 'A';
+        rec->version++;
+        fleetPut(options.fleet, fleetSecret, rec);
+        CHECK(!accepted("alice", ALICE_KEY), "altered signature refused");
+        free(rec);
+
+        snprintf(cmd, sizeof(cmd), "chmod 666 %s", path[TRUST]);
+        system(cmd);
+        CHECK(delegate("alice") == 0 && !accepted("alice", ALICE_KEY), "world-writable trust file ignored");
+
+        kill(daemon, SIGTERM);
+        waitpid(daemon, NULL, 0);
+        return failures != 0;
+}
@@ -0,0 +1,171 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: a scripted IdP on a loopback socket
+ *
+ * A few lines of HTTP/1.1, one request per connection, served from whatever
+ * loop the test runs: the one driving an engine (idpFds/idpEvent) or, for a
+ * module that blocks, a child process (idpServe).
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "tests/idp.h"
+
+#define MAX_CONNS 8
+#define MAX_SCRIPT 8
+#define MAX_ROUTES 8
+
+int idpPort;
+int idpAuthRequests, idpTokenRequests, idpGets;
+long long idpTokenAt[IDP_MAX_REQUESTS];
+char idpLastTokenBody[1024];
+long long (*idpClock)(void);
+
+static int listener = -1;
+static struct { int fd; char buf[4096]; size_t len; } conns[MAX_CONNS];
+static const char * authBody;
+static struct IdpReply script[MAX_SCRIPT];
+static int scriptLen;
+static struct { const char * path; const char * headers; const char * body; } routes[MAX_ROUTES];
+static int nroutes;
+
+void idpReset(const char * auth, const struct IdpReply * replies, int n) {
+        authBody = auth;
+        memcpy(script, replies, n * sizeof(*replies));
+        scriptLen = n;
+        idpAuthRequests = idpTokenRequests = idpGets = 0;
+        idpLastTokenBody[0] = '\0';
+        nroutes = 0;
+}
+
+void idpRoute(const char * path, const char * headers, const char * body) {
+        if (nroutes == MAX_ROUTES) return;
+        routes[nroutes].path = path;
+        routes[nroutes].headers = headers;
+        routes[nroutes++].body = body;
+}
+
+int idpStart(void) {
+        struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+        socklen_t len = sizeof(sa);
+        listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (listener < 0 || bind(listener, (struct sockaddr *)&sa, sizeof(sa)) < 0 || listen(listener, 16) < 0 ||
+            getsockname(listener, (struct sockaddr *)&sa, &len) < 0)
+                return -1;
+        idpPort = ntohs(sa.sin_port);
+        for (int i = 0; i < MAX_CONNS; i++) conns[i].fd = -1;
+        return 0;
+}
+
+static void reply(int fd, int status, const char * headers, const char * body) {
+        char head[512];
+        int n = snprintf(head, sizeof(head),
+                         "HTTP/1.1 %d Scripted\r\nContent-Type: application/json\r\nContent-Length: %zu\r\n"
+                         "%sConnection: close\r\n\r\n",
+                         status, strlen(body), headers ? headers : "");
+        if (write(fd, head, n) < 0 || write(fd, body, strlen(body)) < 0) perror("idp write");
+}
+
+/* answers the request in c once all of it is in */
+static int served(int c) {
+        char * end = strstr(conns[c].buf, "\r\n\r\n");
+        char * cl = strstr(conns[c].buf, "Content-Length:");
+        if (end == NULL || (cl && (size_t)(end + 4 - conns[c].buf) + atol(cl + 15) > conns[c].len)) return 0;
+
+        if (!strncmp(conns[c].buf, "GET ", 4)) {
+                const char * path = conns[c].buf + 4;
+                size_t len = strcspn(path, " ");
+                idpGets++;
+                for (int i = 0; i < nroutes; i++) {
+                        if (strlen(routes[i].path) == len && !strncmp(routes[i].path, path, len)) {
+                                reply(conns[c].fd, 200, routes[i].headers, routes[i].body);
+                                return 1;
+                        }
+                }
+                reply(conns[c].fd, 404, NULL, "{}");
+        } else if (!strncmp(conns[c].buf, "POST /auth ", 11)) {
+                idpAuthRequests++;
+                reply(conns[c].fd, 200, NULL, authBody);
+        } else {
+                const struct IdpReply * r = &script[idpTokenRequests < scriptLen ? idpTokenRequests : scriptLen - 1];
+                if (idpTokenRequests < IDP_MAX_REQUESTS) idpTokenAt[idpTokenRequests] = idpClock ? idpClock() : 0;
+                idpTokenRequests++;
+                snprintf(idpLastTokenBody, sizeof(idpLastTokenBody), "%s", end + 4);
+                reply(conns[c].fd, r->status, NULL, r->body);
+        }
+        return 1;
+}
+
+int idpFds(struct pollfd * out, int max) {
+        int n = 0;
+        if (n < max) out[n++] = (struct pollfd){ listener, POLLIN, 0 };
+        for (int i = 0; i < MAX_CONNS && n < max; i++)
+                if (conns[i].fd >= 0) out[n++] = (struct pollfd){ conns[i].fd, POLLIN, 0 };
+        return n;
+}
+
+int idpBusy(void) {
+        for (int i = 0; i < MAX_CONNS; i++)
+                if (conns[i].fd >= 0) return 1;
+        return 0;
+}
+
+void idpEvent(const struct pollfd * p) {
+        if (p->fd == listener) {
+                int fd = accept(listener, NULL, NULL);
+                for (int i = 0; fd >= 0 && i < MAX_CONNS; i++) {
+                        if (conns[i].fd < 0) {
+                                conns[i].fd = fd;
+                                conns[i].len = 0;
+                                conns[i].buf[0] = '\0';
+                                return;
+                        }
+                }
+                if (fd >= 0) close(fd);
+                return;
+        }
+        for (int i = 0; i < MAX_CONNS; i++) {
+                if (conns[i].fd != p->fd) continue;
+                ssize_t n = read(p->fd, conns[i].buf + conns[i].len, sizeof(conns[i].buf) - 1 - conns[i].len);
+                if (n > 0) {
+                        conns[i].len += n;
+                        conns[i].buf[conns[i].len] = '\0';
+                }
+                if (n <= 0 || served(i)) {
+                        close(conns[i].fd);
+                        conns[i].fd = -1;
+                }
+        }
+}
+
+void idpServe(void) {
+        for (;;) {
+                struct pollfd fds[MAX_CONNS + 1];
+                int n = idpFds(fds, MAX_CONNS + 1);
+                if (poll(fds, n, -1) < 0) continue;
+                for (int i = 0; i < n; i++)
+                        if (fds[i].revents) idpEvent(&fds[i]);
+        }
+}
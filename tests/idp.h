@@ -0,0 +1,54 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: a scripted IdP on a loopback socket, see idp.c
+*******************************************************************************/
+#ifndef IDP_H
+#define IDP_H
+
+#include <poll.h>
+
+#define IDP_MAX_REQUESTS 32
+
+struct IdpReply {
+        int status;
+        const char * body;
+};
+
+extern int idpPort;
+extern int idpAuthRequests, idpTokenRequests, idpGets;
+/* when each token request came in, by idpClock */
+extern long long idpTokenAt[IDP_MAX_REQUESTS];
+extern char idpLastTokenBody[1024];
+extern long long (*idpClock)(void);
+
+int idpStart(void);
+/* POST /auth answers auth; token requests get replies in turn, the last one repeating */
+void idpReset(const char * auth, const struct IdpReply * replies, int n);
+/* GET path answers body, with headers ("Name: value\r\n"...) added; anything else is a 404 */
+void idpRoute(const char * path, const char * headers, const char * body);
+/* the sockets to watch, all POLLIN; then idpEvent for each one that is ready */
+int idpFds(struct pollfd * out, int max);
+int idpBusy(void);                 /* a connection is open */
+void idpEvent(const struct pollfd * p);
+/* serve until killed, for a module under test in another process */
+void idpServe(void);
+
+#endif
@@ -0,0 +1,184 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: verifyIdToken against tokens signed here with openssl(1)
+ *
+ * The JWKS goes into the module's cache for a made-up issuer, so nothing is
+ * fetched. The cache must be root owned, so this skips unless run as root.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "deviceflow.h"
+#include "tests/check.h"
+
+#define ISSUER "https://idp.test/oauth2/default"
+#define AUDIENCE "0oatestclient"
+
+static const char b64url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+static char dir[512];
+
+static void encode(const unsigned char * in, size_t len, char * out) {
+        for (size_t i = 0; i < len; i += 3) {
+                unsigned long v = (unsigned long)in[i] << 16;
+                if (i + 1 < len) v |= in[i + 1] << 8;
+                if (i + 2 < len) v |= in[i + 2];
+                *out++ = b64url[(v >> 18) & 63];
+                *out++ = b64url[(v >> 12) & 63];
+                if (i + 1 < len) *out++ = b64url[(v >> 6) & 63];
+                if (i + 2 < len) *out++ = b64url[v & 63];
+        }
+        *out = '\0';
+}
+
+static int run(const char * cmd) {
+        char line[2048];
+        snprintf(line, sizeof(line), "cd %s && %s >/dev/null 2>&1", dir, cmd);
+        return system(line);
+}
+
+/* header.claims.signature, signed with key (a PEM file in dir); caller frees */
+static char * token(const char * key, const char * header, const char * claims) {
+        char * out = malloc(16384), path[600];
+        unsigned char sig[1024];
+        encode((const unsigned char *)header, strlen(header), out);
+        strcat(out, ".");
+        encode((const unsigned char *)claims, strlen(claims), out + strlen(out));
+
+        snprintf(path, sizeof(path), "%s/tbs", dir);
+        FILE * f = fopen(path, "w");
+        fputs(out, f);
+        fclose(f);
+        char cmd[256];
+        snprintf(cmd, sizeof(cmd), "openssl dgst -sha256 -sign %s -out sig tbs", key);
+        size_t n = 0;
+        snprintf(path, sizeof(path), "%s/sig", dir);
+        if (run(cmd) == 0 && (f = fopen(path, "r")) != NULL) {
+                n = fread(sig, 1, sizeof(sig), f);
+                fclose(f);
+        }
+        strcat(out, ".");
+        encode(sig, n, out + strlen(out));
+        return out;
+}
+
+/* the JWKS for rsa.pem under kid k1 */
+static int writeJwks(void) {
+        char cmd[600], hex[2048], jwks[4096], n64[1024];
+        unsigned char n[512];
+        size_t len = 0;
+
+        snprintf(cmd, sizeof(cmd), "openssl rsa -in %s/rsa.pem -noout -modulus", dir);
+        FILE * p = popen(cmd, "r");
+        int ok = p && fgets(hex, sizeof(hex), p) && !strncmp(hex, "Modulus=", 8);
+        if (p) pclose(p);
+        if (!ok) return -1;
+        for (const char * h = hex + 8; h[0] && h[1] && h[0] != '\n' && len < sizeof(n); h += 2)
+                sscanf(h, "%2hhx", &n[len++]);
+        encode(n, len, n64);
+        snprintf(jwks, sizeof(jwks),
+                 "{\"keys\":[{\"kty\":\"RSA\",\"alg\":\"RS256\",\"kid\":\"k0\",\"use\":\"sig\",\"n\":\"AQAB\",\"e\":\"AQAB\"},"
+                 "{\"kty\":\"RSA\",\"alg\":\"RS256\",\"kid\":\"k1\",\"use\":\"sig\",\"n\":\"%s\",\"e\":\"AQAB\"}]}",
+                 n64);
+
+        char path[1024];
+        cachePath(path, sizeof(path), "jwks");
+        writeCache(path, jwks, 3600);
+        return access(path, R_OK);
+}
+
+/* does the module accept it; frees tok */
+static int accepted(char * tok) {
+        char * claims = verifyIdToken(tok, AUDIENCE);
+        int ok = claims != NULL;
+        free(claims);
+        free(tok);
+        return ok;
+}
+
+int main(void) {
+        char claims[1024], cache[600], other[1024];
+        const char * rs256 = "{\"alg\":\"RS256\",\"kid\":\"k1\"}";
+        long now = time(NULL);
+
+        if (geteuid() != 0 || getenv("TEST_DIR") == NULL) {
+                printf("skip: needs root and tests/run.sh\n");
+                return TEST_SKIP;
+        }
+        snprintf(dir, sizeof(dir), "%s/jwt", getenv("TEST_DIR"));
+        snprintf(cache, sizeof(cache), "%s/cache", dir);
+        if (mkdir(dir, 0700) < 0 || run("openssl genrsa -out rsa.pem 2048") || run("openssl genrsa -out other.pem 2048")) {
+                printf("skip: cannot make RSA keys with openssl\n");
+                return TEST_SKIP;
+        }
+        options.issuer = ISSUER;
+        options.cacheDir = cache;
+        CHECK(writeJwks() == 0, "JWKS cached");
+
+        snprintf(claims, sizeof(claims), "{\"iss\":\"%s\",\"aud\":\"%s\",\"sub\":\"00u1\",\"exp\":%ld}", ISSUER,
+                 AUDIENCE, now + 300);
+        char * good = token("rsa.pem", rs256, claims);
+        char * c = verifyIdToken(good, AUDIENCE);
+        CHECK(c && strstr(c, "\"sub\":\"00u1\""), "good token verifies and yields its claims");
+        free(c);
+
+        CHECK(!accepted(token("other.pem", rs256, claims)), "signed by another key under the same kid");
+        CHECK(!accepted(token("rsa.pem", "{\"alg\":\"RS256\",\"kid\":\"k9\"}", claims)), "unknown kid");
+        CHECK(!accepted(token("rsa.pem", "{\"alg\":\"RS256\",\"kid\":\"k0\"}", claims)), "another kid's key");
+        CHECK(!accepted(token("rsa.pem", "{\"alg\":\"none\",\"kid\":\"k1\"}", claims)), "alg none");
+        CHECK(!accepted(token("rsa.pem", "{\"alg\":\"HS256\",\"kid\":\"k1\"}", claims)), "alg HS256");
+
+        /* someone else's claims under a genuine signature */
+        snprintf(other, sizeof(other), "{\"iss\":\"%s\",\"aud\":\"%s\",\"sub\":\"00u2\",\"exp\":%ld}", ISSUER,
+                 AUDIENCE, now + 300);
+        char * evil = token("rsa.pem", rs256, other);
+        char * swapped = malloc(strlen(good) + strlen(evil) + 1);
+        const char * goodSig = strrchr(good, '.');
+        strcpy(swapped, evil);
+        strcpy(strrchr(swapped, '.'), goodSig);
+        CHECK(!accepted(swapped), "claims swapped under another token's signature");
+        free(evil);
+
+        char * cut = strdup(good);
+        cut[strlen(cut) - 8] = '\0';
+        CHECK(!accepted(cut), "truncated signature");
+        cut = strdup(good);
+        strrchr(cut, '.')[1] = '\0';
+        CHECK(!accepted(cut), "empty signature");
+        cut = strdup(good);
+        *strrchr(cut, '.') = '\0';
+        CHECK(!accepted(cut), "no signature part");
+
+        snprintf(other, sizeof(other), "{\"iss\":\"%s\",\"aud\":\"%s\",\"exp\":%ld}", ISSUER, AUDIENCE, now - 600);
+        CHECK(!accepted(token("rsa.pem", rs256, other)), "expired");
+        snprintf(other, sizeof(other), "{\"iss\":\"https://evil.test\",\"aud\":\"%s\",\"exp\":%ld}", AUDIENCE, now + 300);
+        CHECK(!accepted(token("rsa.pem", rs256, other)), "another issuer");
+        snprintf(other, sizeof(other), "{\"iss\":\"%s\",\"aud\":\"0oaother\",\"exp\":%ld}", ISSUER, now + 300);
+        CHECK(!accepted(token("rsa.pem", rs256, other)), "another audience");
+        snprintf(other, sizeof(other), "{\"iss\":\"%s\",\"aud\":[\"api\",\"%s\"],\"exp\":%ld}", ISSUER, AUDIENCE, now + 300);
+        CHECK(accepted(token("rsa.pem", rs256, other)), "audience in a list");
+
+        free(good);
+        return failures != 0;
+}
@@ -0,0 +1,142 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: pam_sm_authenticate end to end against a scripted IdP
+ *
+ * The IdP (idp.c) runs in a child process, since the module blocks until
+ * the flow is over. Metadata is cached in root-owned files only, so this
+ * skips unless run as root.
+*******************************************************************************/
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+#include "deviceflow.h"
+#include "tests/check.h"
+#include "tests/fakepam.h"
+#include "tests/idp.h"
+
+static char shown[65536];
+static int exchanges;
+
+/* a client that reads everything and presses Enter */
+static int converse(int n, const struct pam_message ** msg, struct pam_response ** resp, void * appdata) {
+        *resp = calloc(n, sizeof(**resp));
+        if (*resp == NULL) return PAM_BUF_ERR;
+        exchanges++;
+        for (int i = 0; i < n; i++) {
+                strncat(shown, msg[i]->msg, sizeof(shown) - strlen(shown) - 1);
+                if (msg[i]->msg_style == PAM_PROMPT_ECHO_ON) (*resp)[i].resp = strdup("");
+        }
+        return PAM_SUCCESS;
+}
+
+static const struct pam_conv conv = { converse, NULL };
+static char issuer[128], issuerArg[160], cacheArg[600], cacheDir[512], idToken[1024];
+
+/* {"id_token": ...} for alice from our issuer, unsigned: nothing here checks the signature */
+static void makeIdToken(void) {
+        static const char b64[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        char claims[256], payload[400];
+        int len = snprintf(claims, sizeof(claims), "{\"sub\":\"alice\",\"name\":\"Alice\",\"iss\":\"%s\"}", issuer);
+        char * o = payload;
+        for (int i = 0; i < len; i += 3) {
+                unsigned long v = (unsigned char)claims[i] << 16 | (i + 1 < len ? (unsigned char)claims[i + 1] << 8 : 0) |
+                                  (i + 2 < len ? (unsigned char)claims[i + 2] : 0);
+                int chars = i + 2 < len ? 4 : i + 1 < len ? 3 : 2;
+                for (int k = 0; k < chars; k++) *o++ = b64[v >> (18 - 6 * k) & 63];
+        }
+        *o = '\0';
+        snprintf(idToken, sizeof(idToken), "{\"id_token\":\"eyJhbGciOiJSUzI1NiJ9.%s.c2ln\"}", payload);
+}
+
+/* run one login against an IdP serving this script; its PAM result */
+static int login(const char * auth, const struct IdpReply * replies, int n) {
+        static char discovery[1024];
+        snprintf(discovery, sizeof(discovery),
+                 "{\"issuer\":\"%s\",\"device_authorization_endpoint\":\"%s/auth\",\"token_endpoint\":\"%s/token\"}",
+                 issuer, issuer, issuer);
+        idpReset(auth, replies, n);
+        idpRoute("/.well-known/openid-configuration", "Cache-Control: max-age=600\r\n", discovery);
+
+        pid_t idp = fork();
+        if (idp == 0) idpServe();
+        const char * argv[] = { issuerArg, cacheArg };
+        shown[0] = '\0';
+        exchanges = 0;
+        int rc = pam_sm_authenticate(NULL, 0, 2, argv);
+        kill(idp, SIGKILL);
+        waitpid(idp, NULL, 0);
+        return rc;
+}
+
+static int cached(const char * kind) {
+        char path[1024];
+        struct stat st;
+        cachePath(path, sizeof(path), kind);
+        return stat(path, &st) == 0;
+}
+
+int main(void) {
+        if (geteuid() != 0 || getenv("TEST_DIR") == NULL) {
+                printf("skip: needs root and tests/run.sh\n");
+                return TEST_SKIP;
+        }
+        if (idpStart() < 0) {
+                printf("skip: no loopback socket\n");
+                return TEST_SKIP;
+        }
+        snprintf(issuer, sizeof(issuer), "http://127.0.0.1:%d", idpPort);
+        snprintf(issuerArg, sizeof(issuerArg), "issuer=%s", issuer);
+        snprintf(cacheDir, sizeof(cacheDir), "%s/login-cache", getenv("TEST_DIR"));
+        snprintf(cacheArg, sizeof(cacheArg), "cache_dir=%s", cacheDir);
+        fakePamItem(PAM_USER, "alice");
+        fakePamItem(PAM_CONV, (const char *)&conv);
+        makeIdToken();
+
+        /* no verification_uri_complete: the engine falls back to verification_uri, and so does the module */
+        const struct IdpReply approve[] = { { 400, "{\"error\":\"authorization_pending\"}" }, { 200, idToken } };
+        int rc = login("{\"device_code\":\"dc1\",\"user_code\":\"WDJB-MJHT\","
+                       "\"verification_uri\":\"https://idp.test/activate\",\"interval\":1,\"expires_in\":60}",
+                       approve, 2);
+        CHECK(rc == PAM_SUCCESS, "approved login succeeds");
+        CHECK(strstr(shown, "Please login at https://idp.test/activate ") != NULL, "verification_uri is shown");
+        CHECK(strstr(shown, "Welcome, Alice") != NULL, "welcome from the id token");
+        CHECK(exchanges == 2, "one exchange for the login prompt, one for the welcome");
+        CHECK(cached("discovery"), "discovery went through the login's engine into the cache");
+
+        const struct IdpReply never[] = { { 400, "{\"error\":\"authorization_pending\"}" } };
+        rc = login("{\"error\":\"invalid_client\"}", never, 1);
+        CHECK(rc == PAM_AUTHINFO_UNAVAIL && !strstr(shown, "Please login"), "an authorize error is no prompt");
+
+        rc = login("{\"device_code\":\"dc2\",\"user_code\":\"A\",\"verification_uri\":\"https://idp.test/a\","
+                   "\"verification_uri_complete\":\"https://idp.test/a?user_code=A\",\"interval\":1,\"expires_in\":60}",
+                   (const struct IdpReply[]){ { 400, "{\"error\":\"access_denied\"}" } }, 1);
+        CHECK(rc == PAM_AUTH_ERR && strstr(shown, "Please login at https://idp.test/a?user_code=A "),
+              "verification_uri_complete is preferred, a denial fails the login");
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: poll.c state transitions, on made-up times as dfsim runs them
+*******************************************************************************/
+#include <string.h>
+
+#include "deviceflow.h"
+#include "tests/check.h"
+
+static void fixedPolling(void) {
+        struct PollState ps;
+
+        pollBegin(&ps, &fixedScheduler, 1000, 5, 60);
+        CHECK(ps.nextPoll == 1000, "first poll right after Enter");
+        CHECK(pollResult(&ps, 1000, "authorization_pending") == POLL_AGAIN && ps.nextPoll == 6000,
+              "pending polls again one interval later");
+        CHECK(pollResult(&ps, 6000, "slow_down") == POLL_AGAIN && ps.interval == 10000 && ps.nextPoll == 16000,
+              "slow_down adds five seconds");
+        CHECK(pollResult(&ps, 16000, "authorization_pending") == POLL_AGAIN && ps.nextPoll == 26000,
+              "the longer interval sticks");
+        CHECK(pollResult(&ps, 56000, "authorization_pending") == POLL_FAILED, "no poll left before the deadline");
+        CHECK(pollExpired(&ps, 61000), "expired at the deadline");
+
+        pollBegin(&ps, &fixedScheduler, 0, 5, 60);
+        CHECK(pollResult(&ps, 0, "access_denied") == POLL_FAILED, "access_denied ends the flow");
+        pollBegin(&ps, &fixedScheduler, 0, 5, 60);
+        CHECK(pollResult(&ps, 0, NULL) == POLL_DONE && ps.polls == 1, "a token ends it too");
+
+        /* a deadline between two intervals still gets a last look */
+        pollBegin(&ps, &fixedScheduler, 0, 5, 12);
+        pollResult(&ps, 0, "authorization_pending");
+        pollResult(&ps, 5000, "authorization_pending");
+        CHECK(ps.nextPoll == 10000, "last look before the deadline");
+}
+
+int main(void) {
+        fixedPolling();
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,118 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: dfcompile'd principal rules read back through
+ *              authorizePrincipal, as the module checks id token claims
+ *
+ * The index files must be root owned, so this skips unless run as root.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "deviceflow.h"
+#include "tests/check.h"
+
+static char routesIdx[512], principalsIdx[512];
+
+/* writes text to dir/name and compiles it, returns dfcompile's exit status */
+static int compile(const char * kind, const char * name, const char * text, char * idx, size_t idxlen) {
+        char src[512], cmd[2048];
+        snprintf(src, sizeof(src), "%s/%s", getenv("TEST_DIR"), name);
+        snprintf(idx, idxlen, "%s.idx", src);
+        FILE * f = fopen(src, "w");
+        if (f == NULL) return -1;
+        fputs(text, f);
+        fclose(f);
+        snprintf(cmd, sizeof(cmd), "\"%s\" %s %s %s >/dev/null 2>&1", getenv("DFCOMPILE"), kind, src, idx);
+        return system(cmd);
+}
+
+static void principals(void) {
+        CHECK(compile("principals", "principals",
+                      "*        groups              SRE  # on call\n"
+                      "alice    preferred_username  alice@example.com\n"
+                      "issuer   https://bank.example/oauth2\n"
+                      "deploy   groups              dev#ops\n"
+                      "*        email               carol@bank.example\n"
+                      "issuer   *\n"
+                      "bob      sub                 00u123\n"
+                      "issuer   groups              Auditors\n"
+                      "issuer   sub                 00u9 00u10\n",
+                      principalsIdx, sizeof(principalsIdx)) == 0, "principals compile");
+        options.principals = principalsIdx;
+        options.routes = NULL;
+
+        const char * bank = "{\"iss\":\"https://bank.example/oauth2\",";
+        const char * retail = "{\"iss\":\"https://retail.example/oauth2\",";
+        char claims[1024];
+
+#define ALLOWED(prefix, rest, account) \
+        (snprintf(claims, sizeof(claims), "%s%s", prefix, rest), authorizePrincipal(claims, account))
+
+        CHECK(ALLOWED(retail, "\"groups\":[\"SRE\"]}", "anyone"), "unscoped group rule, comment stripped");
+        CHECK(!ALLOWED(retail, "\"groups\":[\"SRE  # on call\"]}", "anyone"), "comment is not part of the value");
+        CHECK(ALLOWED(retail, "\"preferred_username\":\"alice@example.com\"}", "alice"), "unscoped user rule");
+        CHECK(!ALLOWED(retail, "\"preferred_username\":\"alice@example.com\"}", "root"), "user rule names one account");
+        CHECK(ALLOWED(retail, "\"sub\":\"00u123\"}", "bob"), "rule after \"issuer *\" is unscoped again");
+        CHECK(ALLOWED(bank, "\"groups\":[\"x\",\"dev#ops\"]}", "deploy"), "scoped rule for its issuer, '#' in value");
+        CHECK(!ALLOWED(retail, "\"groups\":[\"dev#ops\"]}", "deploy"), "scoped rule refuses another issuer");
+        CHECK(!ALLOWED("{", "\"groups\":[\"dev#ops\"]}", "deploy"), "scoped rule refuses a token without iss");
+        CHECK(ALLOWED(bank, "\"email\":\"carol@bank.example\",\"email_verified\":true}", "carol"), "verified email");
+        CHECK(!ALLOWED(bank, "\"email\":\"carol@bank.example\",\"email_verified\":false}", "carol"),
+              "unverified email is ignored");
+        CHECK(!ALLOWED(bank, "\"email\":\"carol@bank.example\"}", "carol"), "email without email_verified is ignored");
+
+        CHECK(ALLOWED(retail, "\"groups\":[\"Auditors\"]}", "issuer"), "a rule for an account named issuer");
+        CHECK(ALLOWED(retail, "\"sub\":\"00u9 00u10\"}", "issuer"), "and it keeps its whole value");
+        CHECK(ALLOWED(retail, "\"sub\":\"00u123\"}", "bob"), "such a rule does not rescope the rules before it");
+
+        CHECK(compile("routes", "principals-routes", "tenant bank https://bank.example/oauth2 0oabank\n",
+                      routesIdx, sizeof(routesIdx)) == 0, "routes compile");
+        options.routes = routesIdx;
+        CHECK(!ALLOWED(retail, "\"groups\":[\"SRE\"]}", "anyone"), "unscoped rules do not count under routes=");
+        CHECK(ALLOWED(bank, "\"groups\":[\"dev#ops\"]}", "deploy"), "scoped rules still count under routes=");
+        options.routes = NULL;
+
+        /* the index is root's alone, or no rule in it counts */
+        chmod(principalsIdx, 0666);
+        CHECK(!ALLOWED(retail, "\"groups\":[\"SRE\"]}", "anyone"), "an index others can write allows nobody");
+        options.principals = "/nonexistent/principals.idx";
+        CHECK(!ALLOWED(retail, "\"groups\":[\"SRE\"]}", "anyone"), "neither does a missing one");
+        options.principals = NULL;
+#undef ALLOWED
+
+        char bad[512];
+        CHECK(compile("principals", "principals-bad", "alice nickname alice\n", bad, sizeof(bad)) != 0,
+              "unknown claim is refused");
+        CHECK(compile("principals", "principals-badissuer", "issuer http://plain.example\n", bad, sizeof(bad)) != 0,
+              "non-https issuer is refused");
+}
+
+int main(void) {
+        if (geteuid() != 0 || getenv("TEST_DIR") == NULL || getenv("DFCOMPILE") == NULL) {
+                printf("skip: needs root and tests/run.sh\n");
+                return TEST_SKIP;
+        }
+        principals();
+        return failures != 0;
+}
@@ -0,0 +1,100 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: dfcompile output read back through route.c, as the module
+ *              sees it at login
+ *
+ * The index files must be root owned, so this skips unless run as root.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "deviceflow.h"
+#include "tests/check.h"
+
+static char routesIdx[512];
+
+/* writes text to dir/name and compiles it, returns dfcompile's exit status */
+static int compile(const char * kind, const char * name, const char * text, char * idx, size_t idxlen) {
+        char src[512], cmd[2048];
+        snprintf(src, sizeof(src), "%s/%s", getenv("TEST_DIR"), name);
+        snprintf(idx, idxlen, "%s.idx", src);
+        FILE * f = fopen(src, "w");
+        if (f == NULL) return -1;
+        fputs(text, f);
+        fclose(f);
+        snprintf(cmd, sizeof(cmd), "\"%s\" %s %s %s >/dev/null 2>&1", getenv("DFCOMPILE"), kind, src, idx);
+        return system(cmd);
+}
+
+static const char * routeFor(const char * user, const char * rhost) {
+        static struct RouteTenant t;
+        int rc = routeLookup(routesIdx, user, rhost, &t);
+        return rc == 1 ? t.name : rc == 0 ? "(none)" : "(error)";
+}
+
+static void routes(void) {
+        CHECK(compile("routes", "routes",
+                      "tenant retail https://retail.example/oauth2 0oaretail openid profile\n"
+                      "tenant bank https://bank.example/oauth2 0oabank\n"
+                      "tenant ops https://ops.example/oauth2 0oaops\n"
+                      "user alice bank\n"
+                      "user svc-* retail\n"
+                      "domain bank.example.com bank\n"
+                      "network 10.20.0.0/16 ops\n"
+                      "group root ops\n"
+                      "user alice ops\n"
+                      "user * retail\n",
+                      routesIdx, sizeof(routesIdx)) == 0, "routes compile");
+
+        CHECK(!strcmp(routeFor("alice", "10.20.1.1"), "bank"), "exact user beats a later network rule");
+        CHECK(!strcmp(routeFor("svc-backup", NULL), "retail"), "prefix rule");
+        CHECK(!strcmp(routeFor("bob@bank.example.com", NULL), "bank"), "domain rule");
+        CHECK(!strcmp(routeFor("bob@eu.bank.example.com", NULL), "bank"), "domain rule covers subdomains");
+        CHECK(!strcmp(routeFor("bob@notbank.example.com", NULL), "retail"), "domain must match whole labels");
+        CHECK(!strcmp(routeFor("bob", "10.20.255.7"), "ops"), "network rule");
+        CHECK(!strcmp(routeFor("bob", "10.21.0.1"), "retail"), "outside the network falls through");
+        CHECK(!strcmp(routeFor("root", NULL), "ops"), "local group rule");
+        CHECK(!strcmp(routeFor("nobody-here", NULL), "retail"), "catch-all");
+
+        struct RouteTenant t;
+        CHECK(routeLookup(routesIdx, "svc-x", NULL, &t) == 1 && !strcmp(t.issuer, "https://retail.example/oauth2")
+              && !strcmp(t.clientId, "0oaretail") && !strcmp(t.scope, "openid profile"),
+              "tenant fields survive the round trip");
+
+        char none[512];
+        CHECK(compile("routes", "routes-narrow", "tenant bank https://bank.example/oauth2 0oabank\nuser alice bank\n",
+                      none, sizeof(none)) == 0, "narrow routes compile");
+        CHECK(routeLookup(none, "bob", NULL, &t) == 0, "no rule matches");
+        CHECK(routeLookup("/nonexistent/routes.idx", "bob", NULL, &t) == -1, "missing table is an error");
+        CHECK(compile("routes", "routes-bad", "user alice nosuchtenant\n", none, sizeof(none)) != 0,
+              "rule before its tenant is refused");
+}
+
+int main(void) {
+        if (geteuid() != 0 || getenv("TEST_DIR") == NULL || getenv("DFCOMPILE") == NULL) {
+                printf("skip: needs root and tests/run.sh\n");
+                return TEST_SKIP;
+        }
+        routes();
+        return failures != 0;
+}
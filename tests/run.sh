@@ -0,0 +1,41 @@
+#!/bin/sh
+#
+# Builds the module sources into one archive, links every tests/*_test.c
+# against it (plus the helpers in tests/), runs them and then fleet.sh.
+#
+#   CC=gcc CFLAGS=... tests/run.sh
+#
+set -e
+cd "$(dirname "$0")/.."
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+CC=${CC:-cc}
+
+# the session cache goes somewhere of our own
+for f in deviceflow qr dfindex session dynload fleet jwt sshcert poll conv route hop engine claims; do
+        $CC -std=gnu11 $CFLAGS -DSESSION_DIR="\"$work/run\"" -c -o "$work/$f.o" $f.c
+done
+ar rcs "$work/module.a" "$work"/*.o
+$CC -std=gnu11 $CFLAGS -o "$work/dfcompile" dfcompile.c dfindex.c
+$CC -std=gnu11 $CFLAGS -o "$work/dfstated" dfstated.c fleet.c dfindex.c dynload.c -ldl
+helpers=$(ls tests/*.c | grep -v '_test\.c$' || true)
+
+export DFCOMPILE="$work/dfcompile" DFSTATED="$work/dfstated" TEST_DIR="$work"
+status=0
+for t in tests/*_test.c; do
+        name=$(basename "$t" .c)
+        echo "== $name"
+        $CC -std=gnu11 $CFLAGS -I. -o "$work/$name" "$t" $helpers "$work/module.a" -ldl -lm
+        rc=0
+        "$work/$name" || rc=$?
+        case $rc in
+        0) ;;
+        77) echo "skip $name" ;;
+        *) status=1 ;;
+        esac
+done
+echo "== fleet"
+tests/fleet.sh || status=1
+
+[ $status = 0 ] && echo "all tests passed"
+exit $status
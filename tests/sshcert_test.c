@@ -0,0 +1,124 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: which SSH_AUTH_INFO_0 keys sshcert.c certifies or lets in
+ *
+ * Keys and certificates are made with ssh-keygen(1). cert_ca.pub must be
+ * root owned, so this skips unless run as root.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "deviceflow.h"
+#include "tests/check.h"
+#include "tests/fakepam.h"
+
+static char dir[512];
+
+static int run(const char * cmd) {
+        char line[2048];
+        snprintf(line, sizeof(line), "cd %s && (%s) >/dev/null 2>&1", dir, cmd);
+        return system(line);
+}
+
+/* "publickey <contents of dir/name>" for SSH_AUTH_INFO_0 */
+static const char * info(const char * name) {
+        static char out[16384];
+        char path[600], line[16000] = "";
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        FILE * f = fopen(path, "r");
+        if (f) {
+                if (fgets(line, sizeof(line), f) == NULL) line[0] = '\0';
+                fclose(f);
+        }
+        line[strcspn(line, "\n")] = '\0';
+        snprintf(out, sizeof(out), "publickey %s", line);
+        return out;
+}
+
+static int certified(const char * name, const char * user) {
+        fakePamEnv("SSH_AUTH_INFO_0", info(name));
+        return certifiedLogin(NULL, user);
+}
+
+int main(void) {
+        char ca[600], key[8192], both[32768];
+
+        if (geteuid() != 0 || getenv("TEST_DIR") == NULL) {
+                printf("skip: needs root and tests/run.sh\n");
+                return TEST_SKIP;
+        }
+        snprintf(dir, sizeof(dir), "%s/sshcert", getenv("TEST_DIR"));
+        if (mkdir(dir, 0700) < 0 ||
+            run("ssh-keygen -q -t ed25519 -N '' -f ca && ssh-keygen -q -t ed25519 -N '' -f other_ca &&"
+                "ssh-keygen -q -t ed25519 -N '' -f user && ssh-keygen -q -t rsa -b 2048 -N '' -f rsa_user &&"
+                "cp user.pub good.pub && ssh-keygen -q -s ca -I t -n alice -V -5m:+1h good.pub &&"
+                "cp rsa_user.pub rsa.pub && ssh-keygen -q -s ca -I t -n alice,bob -V -5m:+1h rsa.pub &&"
+                "cp user.pub stranger.pub && ssh-keygen -q -s other_ca -I t -n alice -V -5m:+1h stranger.pub &&"
+                "cp user.pub old.pub && ssh-keygen -q -s ca -I t -n alice -V 20200101:20200102 old.pub &&"
+                "cp user.pub later.pub && ssh-keygen -q -s ca -I t -n alice -V +1d:+2d later.pub &&"
+                "cp user.pub host.pub && ssh-keygen -q -s ca -I t -h -n alice -V -5m:+1h host.pub")) {
+                printf("skip: cannot make keys with ssh-keygen\n");
+                return TEST_SKIP;
+        }
+        snprintf(ca, sizeof(ca), "%s/ca", dir);
+        options.certCa = ca;
+
+        CHECK(certified("good-cert.pub", "alice"), "our certificate for alice lets alice in");
+        CHECK(certified("rsa-cert.pub", "bob"), "RSA certificate, second principal");
+        CHECK(!certified("good-cert.pub", "bob"), "not for an account it does not name");
+        CHECK(!certified("good-cert.pub", "alic"), "principal must match whole");
+        CHECK(!certified("stranger-cert.pub", "alice"), "not a certificate from another CA");
+        CHECK(!certified("old-cert.pub", "alice"), "not an expired certificate");
+        CHECK(!certified("later-cert.pub", "alice"), "not a certificate that is not valid yet");
+        CHECK(!certified("host-cert.pub", "alice"), "not a host certificate");
+        CHECK(!certified("user.pub", "alice"), "not a plain key");
+        fakePamEnv("SSH_AUTH_INFO_0", NULL);
+        CHECK(!certifiedLogin(NULL, "alice"), "not without SSH_AUTH_INFO_0");
+
+        /* a damaged blob must not be read past its end */
+        snprintf(both, sizeof(both), "%s", info("good-cert.pub"));
+        both[strlen("publickey ssh-ed25519-cert-v01@openssh.com ") + 200] = '\0';
+        fakePamEnv("SSH_AUTH_INFO_0", both);
+        CHECK(!certifiedLogin(NULL, "alice"), "not a truncated certificate");
+
+        snprintf(both, sizeof(both), "%s\n", info("user.pub"));
+        strcat(both, info("good-cert.pub"));
+        fakePamEnv("SSH_AUTH_INFO_0", both);
+        CHECK(certifiedLogin(NULL, "alice"), "found on a later publickey line");
+
+        options.certCa = NULL;
+        CHECK(!certified("good-cert.pub", "alice"), "nothing without cert_ca");
+        options.certCa = ca;
+        run("chmod 666 ca.pub");
+        CHECK(!certified("good-cert.pub", "alice"), "a writable cert_ca.pub is not trusted");
+        run("chmod 644 ca.pub");
+
+        /* only plain keys are ever signed */
+        fakePamEnv("SSH_AUTH_INFO_0", info("good-cert.pub"));
+        CHECK(authenticatedKey(NULL, key, sizeof(key)) < 0, "a certificate is not a key to certify");
+        fakePamEnv("SSH_AUTH_INFO_0", both);
+        CHECK(authenticatedKey(NULL, key, sizeof(key)) == 0 && !strncmp(key, "ssh-ed25519 ", 12) &&
+              !strncmp(key, info("user.pub") + 10, strlen(key)), "the plain key next to it is");
+        return failures != 0;
+}
@@ -0,0 +1,92 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: every probe trace.h documents is in the binary, and each login
+ *              gets its own correlation id
+ *
+ * The probe check reads this binary's .note.stapsdt with readelf, so it only
+ * runs where <sys/sdt.h> made the probes real.
+*******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <security/pam_appl.h>
+#include <security/pam_modules.h>
+
+#include "deviceflow.h"
+#include "trace.h"
+#include "tests/check.h"
+#include "tests/fakepam.h"
+
+#ifdef HAVE_SDT
+static const char * const probes[] = {
+        "routed", "authorize_start", "authorize_done", "qr_rendered", "prompt_delivered",
+        "poll_start", "poll_done", "token_decoded", "verdict", NULL,
+};
+
+/* "Provider: deviceflow" then "Name: <probe>" per note, as readelf -n prints them */
+static void notes(void) {
+        char line[512], listed[4096] = "", provider[64] = "", self[1024], cmd[1100];
+        ssize_t len = readlink("/proc/self/exe", self, sizeof(self) - 1);
+        if (len < 0) return;
+        self[len] = '\0';
+        snprintf(cmd, sizeof(cmd), "readelf -n '%s' 2>/dev/null", self);
+        FILE * p = popen(cmd, "r");
+        if (p == NULL) return;
+        while (fgets(line, sizeof(line), p)) {
+                char word[64];
+                if (sscanf(line, " Provider: %63s", word) == 1) snprintf(provider, sizeof(provider), "%s", word);
+                else if (sscanf(line, " Name: %63s", word) == 1 && !strcmp(provider, "deviceflow") &&
+                         strlen(listed) + strlen(word) + 3 < sizeof(listed))
+                        strcat(strcat(strcat(listed, " "), word), " ");
+        }
+        if (pclose(p) != 0 || listed[0] == '\0') {
+                printf("skip: no readelf to list probes\n");
+                return;
+        }
+        for (int i = 0; probes[i]; i++) {
+                char want[80], what[128];
+                snprintf(want, sizeof(want), " %s ", probes[i]);
+                snprintf(what, sizeof(what), "deviceflow:%s is in the binary", probes[i]);
+                CHECK(strstr(listed, want) != NULL, what);
+        }
+}
+#endif
+
+int main(void) {
+        /* stops at the routing table, after the id is drawn and before any network */
+        const char * argv[] = { "routes=/nonexistent/routes.idx" };
+        fakePamItem(PAM_USER, "alice");
+
+        pam_sm_authenticate(NULL, 0, 1, argv);
+        unsigned long long first = traceId;
+        pam_sm_authenticate(NULL, 0, 1, argv);
+        CHECK(first != 0 && traceId != 0, "each login has a correlation id");
+        CHECK(traceId != first, "and a new one every time");
+
+#ifdef HAVE_SDT
+        notes();
+#else
+        printf("skip: probes are no-ops without <sys/sdt.h>\n");
+#endif
+        return failures ? 1 : 0;
+}
@@ -0,0 +1,57 @@
+/**************
+Licensed to the Apache Software Foundation (ASF) under one
+or more contributor license agreements.  See the NOTICE file
+distributed with this work for additional information
+regarding copyright ownership.  The ASF licenses this file
+to you under the Apache License, Version 2.0 (the
+"License"); you may not use this file except in compliance
+with the License.  You may obtain a copy of the License at
+
+  http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing,
+software distributed under the License is distributed on an
+"AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+KIND, either express or implied.  See the License for the
+specific language governing permissions and limitations
+under the License.
+**********/
+
+/*******************************************************************************
+ * description: USDT probes, provider "deviceflow"
+ *
+ * Each probe is a single nop until a tracer attaches. Where <sys/sdt.h> is
+ * missing it only evaluates its arguments, as the probe would, so variables
+ * kept for a probe still count as used. The first argument is always the
+ * login's 64 bit correlation id, so probes from concurrent sshd children can
+ * be told apart:
+ *
+ *   routed(id, tenant)
+ *   authorize_start(id, url)            authorize_done(id, http status)
+ *   qr_rendered(id, bytes)              prompt_delivered(id, pam status)
+ *   poll_start(id, poll number)         poll_done(id, http status, error or "")
+ *   token_decoded(id, exp)              verdict(id, pam status, user)
+*******************************************************************************/
+#ifndef TRACE_H
+#define TRACE_H
+
+extern unsigned long long traceId;
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT 1
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define TRACE(name) DTRACE_PROBE1(deviceflow, name, traceId)
+#define TRACE1(name, a) DTRACE_PROBE2(deviceflow, name, traceId, a)
+#define TRACE2(name, a, b) DTRACE_PROBE3(deviceflow, name, traceId, a, b)
+#else
+#define TRACE(name) ((void)0)
+#define TRACE1(name, a) ((void)(a))
+#define TRACE2(name, a, b) ((void)(a), (void)(b))
+#endif
+
+#endif